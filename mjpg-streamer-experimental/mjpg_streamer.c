@@ -112,13 +112,17 @@ static void signal_handler(int sig)
 
     for(i = 0; i < global.outcnt; i++) {
         global.out[i].stop(global.out[i].param.id);
-        pthread_cond_destroy(&global.in[i].db_update);
-        pthread_mutex_destroy(&global.in[i].db);
         /*for (j = 0; j<MAX_PLUGIN_ARGUMENTS; j++) {
             if (global.out[i].param.argv[j] != NULL)
                 free(global.out[i].param.argv[j]);
         }*/
     }
+
+    /* the outputs may wait for frames until they are stopped */
+    for(i = 0; i < global.incnt; i++) {
+        pthread_cond_destroy(&global.in[i].db_update);
+        pthread_mutex_destroy(&global.in[i].db);
+    }
     usleep(1000 * 1000);
 
     /* close handles of input plugins */
@@ -264,8 +268,11 @@ int main(int argc, char *argv[])
     /* ignore SIGPIPE (send by OS if transmitting to closed TCP sockets) */
     signal(SIGPIPE, SIG_IGN);
 
-    /* register signal handler for <CTRL>+C in order to clean up */
-    if(signal(SIGINT, signal_handler) == SIG_ERR) {
+    /*
+     * register signal handler for <CTRL>+C in order to clean up, the same for
+     * SIGTERM so plugins can finish their files if the daemon gets stopped
+     */
+    if(signal(SIGINT, signal_handler) == SIG_ERR || signal(SIGTERM, signal_handler) == SIG_ERR) {
         LOG("could not register signal handler\n");
         closelog();
         exit(EXIT_FAILURE);
@@ -0,0 +1,497 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Writer for Motion-JPEG AVI files (AVI 1.0 with idx1 index).
+
+  The headers have a fixed size and are written again with the final values
+  when the file gets closed, the frames follow as "00dc" chunks of the "movi"
+  list. After the list the idx1 index makes the file seekable and a "mjts"
+  chunk keeps the capture time of every frame, the frame rate in the headers
+  is only the average. Players ignore the unknown chunk.
+
+      RIFF 'AVI '
+        LIST 'hdrl'
+          avih
+          LIST 'strl'
+            strh
+            strf
+        LIST 'movi'
+          00dc ...
+        idx1
+        mjts
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "../utils.h"
+#include "avi.h"
+
+/* offset of the "movi" fourcc, the index offsets are relative to it */
+#define MOVI_OFFSET (AVI_HEADER_SIZE - 4)
+
+#define AVIF_HASINDEX   0x10
+#define AVIIF_KEYFRAME  0x10
+
+/******************************************************************************
+Description.: store little endian values and fourccs
+Input Value.: * buffer.: where to store the value
+              * value..: the value
+Return Value: pointer behind the stored value
+******************************************************************************/
+static unsigned char *put_u32(unsigned char *buffer, unsigned int value)
+{
+    buffer[0] = value & 0xFF;
+    buffer[1] = (value >> 8) & 0xFF;
+    buffer[2] = (value >> 16) & 0xFF;
+    buffer[3] = (value >> 24) & 0xFF;
+    return buffer + 4;
+}
+
+static unsigned char *put_u16(unsigned char *buffer, unsigned int value)
+{
+    buffer[0] = value & 0xFF;
+    buffer[1] = (value >> 8) & 0xFF;
+    return buffer + 2;
+}
+
+static unsigned char *put_fourcc(unsigned char *buffer, const char *fourcc)
+{
+    memcpy(buffer, fourcc, 4);
+    return buffer + 4;
+}
+
+static unsigned int get_u32(const unsigned char *buffer)
+{
+    return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((unsigned int)buffer[3] << 24);
+}
+
+/******************************************************************************
+Description.: find the size of a JPEG image in its start of frame segment
+Input Value.: * data...: the JPEG image
+              * size...: length of the image
+              * width..: where to store the width
+              * height.: where to store the height
+Return Value: 0 if found, -1 otherwise
+******************************************************************************/
+int jpeg_dimensions(const unsigned char *data, int size, int *width, int *height)
+{
+    int i = 2, marker;
+
+    if(size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return -1;
+
+    while(i + 9 < size) {
+        if(data[i] != 0xFF)
+            return -1;
+
+        /* markers may be preceded by fill bytes */
+        marker = data[i + 1];
+        if(marker == 0xFF) {
+            i++;
+            continue;
+        }
+
+        /* SOF0 - SOF15, except DHT, JPG and DAC */
+        if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            *height = data[i + 5] << 8 | data[i + 6];
+            *width = data[i + 7] << 8 | data[i + 8];
+            return 0;
+        }
+
+        /* the image data starts, there was no frame header */
+        if(marker == 0xDA)
+            return -1;
+
+        i += 2 + (data[i + 2] << 8 | data[i + 3]);
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+Description.: time between the first and the last frame
+Input Value.: the file
+Return Value: microseconds
+******************************************************************************/
+long long avi_duration(avi_file *avi)
+{
+    if(avi->frames < 2)
+        return 0;
+
+    return avi->index[avi->frames - 1].timestamp - avi->index[0].timestamp;
+}
+
+/******************************************************************************
+Description.: fill in the headers in front of the first frame
+Input Value.: * avi....: the file
+              * header.: AVI_HEADER_SIZE bytes
+Return Value: -
+******************************************************************************/
+static void avi_header(avi_file *avi, unsigned char *header)
+{
+    unsigned char *p = header;
+    unsigned int usec_per_frame = 40000, max_size = 0, i;
+    off_t riff_size;
+
+    /* the headers only know a constant frame rate, use the average, frames
+       without capture times keep the default */
+    if(avi->frames > 1 && avi_duration(avi) > 0)
+        usec_per_frame = MAX(avi_duration(avi) / (avi->frames - 1), 1);
+
+    for(i = 0; i < avi->frames; i++)
+        max_size = MAX(max_size, avi->index[i].size);
+
+    /* frames, index and timestamps */
+    riff_size = avi->size - 8;
+
+    p = put_fourcc(p, "RIFF");
+    p = put_u32(p, riff_size);
+    p = put_fourcc(p, "AVI ");
+
+    p = put_fourcc(p, "LIST");
+    p = put_u32(p, 192);
+    p = put_fourcc(p, "hdrl");
+
+    p = put_fourcc(p, "avih");
+    p = put_u32(p, 56);
+    p = put_u32(p, usec_per_frame);
+    p = put_u32(p, (unsigned int)((unsigned long long)max_size * 1000000 / usec_per_frame));
+    p = put_u32(p, 0);                  /* padding granularity */
+    p = put_u32(p, AVIF_HASINDEX);
+    p = put_u32(p, avi->frames);
+    p = put_u32(p, 0);                  /* initial frames */
+    p = put_u32(p, 1);                  /* streams */
+    p = put_u32(p, max_size + 8);       /* suggested buffer size */
+    p = put_u32(p, avi->width);
+    p = put_u32(p, avi->height);
+    memset(p, 0, 16);                   /* reserved */
+    p += 16;
+
+    p = put_fourcc(p, "LIST");
+    p = put_u32(p, 116);
+    p = put_fourcc(p, "strl");
+
+    p = put_fourcc(p, "strh");
+    p = put_u32(p, 56);
+    p = put_fourcc(p, "vids");
+    p = put_fourcc(p, "MJPG");
+    p = put_u32(p, 0);                  /* flags */
+    p = put_u16(p, 0);                  /* priority */
+    p = put_u16(p, 0);                  /* language */
+    p = put_u32(p, 0);                  /* initial frames */
+    p = put_u32(p, usec_per_frame);     /* scale */
+    p = put_u32(p, 1000000);            /* rate, rate / scale is the frame rate */
+    p = put_u32(p, 0);                  /* start */
+    p = put_u32(p, avi->frames);        /* length */
+    p = put_u32(p, max_size + 8);       /* suggested buffer size */
+    p = put_u32(p, 0xFFFFFFFF);         /* quality, default */
+    p = put_u32(p, 0);                  /* sample size */
+    p = put_u16(p, 0);                  /* frame rectangle */
+    p = put_u16(p, 0);
+    p = put_u16(p, avi->width);
+    p = put_u16(p, avi->height);
+
+    p = put_fourcc(p, "strf");
+    p = put_u32(p, 40);
+    p = put_u32(p, 40);                 /* BITMAPINFOHEADER size */
+    p = put_u32(p, avi->width);
+    p = put_u32(p, avi->height);
+    p = put_u16(p, 1);                  /* planes */
+    p = put_u16(p, 24);                 /* bits per pixel */
+    p = put_fourcc(p, "MJPG");
+    p = put_u32(p, avi->width * avi->height * 3);
+    memset(p, 0, 16);                   /* resolution and palette */
+    p += 16;
+
+    p = put_fourcc(p, "LIST");
+    p = put_u32(p, avi->movi_size);
+    put_fourcc(p, "movi");
+}
+
+/******************************************************************************
+Description.: write all bytes of an I/O vector, continue after partial writes
+Input Value.: * fd.....: the file
+              * iov....: the vector, gets modified
+              * count..: number of elements
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+static int write_all(int fd, struct iovec *iov, int count)
+{
+    ssize_t rc;
+    int i = 0;
+
+    while(i < count) {
+        if((rc = writev(fd, iov + i, count - i)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for(; i < count && (size_t)rc >= iov[i].iov_len; i++)
+            rc -= iov[i].iov_len;
+        if(i < count) {
+            iov[i].iov_base = (char *)iov[i].iov_base + rc;
+            iov[i].iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: create a new AVI file, the headers are written on close
+Input Value.: * filename..: path of the file
+              * preallocate: bytes to reserve on the disk, 0 for none
+Return Value: the file or NULL in case of error
+******************************************************************************/
+avi_file *avi_open(const char *filename, off_t preallocate)
+{
+    avi_file *avi;
+
+    if((avi = calloc(1, sizeof(avi_file))) == NULL)
+        return NULL;
+
+    if((avi->fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        free(avi);
+        return NULL;
+    }
+
+    /*
+     * reserve the blocks of the whole segment at once, this keeps the file
+     * contiguous and a full disk is noticed now, not in the middle of it
+     */
+    if(preallocate > 0 && fallocate(avi->fd, FALLOC_FL_KEEP_SIZE, 0, preallocate) == 0)
+        avi->preallocated = preallocate;
+
+    /* the headers are written with the final values on close */
+    if(lseek(avi->fd, AVI_HEADER_SIZE, SEEK_SET) < 0) {
+        close(avi->fd);
+        free(avi);
+        return NULL;
+    }
+    avi->size = AVI_HEADER_SIZE;
+
+    return avi;
+}
+
+/******************************************************************************
+Description.: append a frame as chunk of the "movi" list
+Input Value.: * avi......: the file
+              * data.....: the JPEG image
+              * size.....: length of the image
+              * timestamp: capture time of the frame
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+int avi_write_frame(avi_file *avi, const unsigned char *data, int size, struct timeval timestamp)
+{
+    unsigned char header[8], pad = 0;
+    struct iovec iov[3];
+    avi_index_entry *index;
+    unsigned long capacity;
+
+    if(avi->frames == avi->capacity) {
+        capacity = MAX(avi->capacity * 2, 1024);
+        if((index = realloc(avi->index, capacity * sizeof(avi_index_entry))) == NULL)
+            return -1;
+        avi->index = index;
+        avi->capacity = capacity;
+    }
+
+    /* the stream headers need the size of the image */
+    if(avi->frames == 0 && jpeg_dimensions(data, size, &avi->width, &avi->height) != 0)
+        avi->width = avi->height = 0;
+
+    put_fourcc(header, AVI_FRAME_CHUNK);
+    put_u32(header + 4, size);
+
+    /* chunks start at even offsets */
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = size;
+    iov[2].iov_base = &pad;
+    iov[2].iov_len = size & 1;
+
+    if(write_all(avi->fd, iov, 3) < 0)
+        return -1;
+
+    avi->index[avi->frames].offset = avi->size - MOVI_OFFSET;
+    avi->index[avi->frames].size = size;
+    avi->index[avi->frames].timestamp = (long long)timestamp.tv_sec * 1000000 + timestamp.tv_usec;
+    avi->frames++;
+    avi->size += sizeof(header) + size + (size & 1);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: write index, timestamps and the final headers and close the file
+Input Value.: the file, it is freed
+Return Value: 0 on success, -1 if the file could not be completed
+******************************************************************************/
+int avi_close(avi_file *avi)
+{
+    unsigned char header[AVI_HEADER_SIZE], *buffer, *p;
+    size_t length = 8 + 16 * avi->frames + 8 + 8 * avi->frames;
+    struct iovec iov[1];
+    unsigned long i;
+    int rc = -1;
+
+    if((buffer = malloc(length)) != NULL) {
+        p = put_fourcc(buffer, "idx1");
+        p = put_u32(p, 16 * avi->frames);
+        for(i = 0; i < avi->frames; i++) {
+            p = put_fourcc(p, AVI_FRAME_CHUNK);
+            p = put_u32(p, AVIIF_KEYFRAME);
+            p = put_u32(p, avi->index[i].offset);
+            p = put_u32(p, avi->index[i].size);
+        }
+
+        p = put_fourcc(p, AVI_TIMESTAMP_CHUNK);
+        p = put_u32(p, 8 * avi->frames);
+        for(i = 0; i < avi->frames; i++) {
+            p = put_u32(p, avi->index[i].timestamp & 0xFFFFFFFF);
+            p = put_u32(p, (unsigned long long)avi->index[i].timestamp >> 32);
+        }
+
+        iov[0].iov_base = buffer;
+        iov[0].iov_len = length;
+        avi->movi_size = avi->size - MOVI_OFFSET;
+        if(write_all(avi->fd, iov, 1) == 0) {
+            avi->size += length;
+            avi_header(avi, header);
+            if(pwrite(avi->fd, header, sizeof(header), 0) == sizeof(header))
+                rc = 0;
+        }
+        free(buffer);
+    }
+
+    /* give back the preallocated blocks that were not used */
+    if(avi->preallocated > avi->size && ftruncate(avi->fd, avi->size) < 0)
+        rc = -1;
+
+    if(close(avi->fd) < 0)
+        rc = -1;
+
+    free(avi->index);
+    free(avi);
+    return rc;
+}
+
+/******************************************************************************
+Description.: walk the chunks of the "movi" list and note the frames
+Input Value.: * data...: the file
+              * movi...: first chunk of the list
+              * size...: length of the list
+              * index..: where to store the frames, NULL to count them only
+              * usec_per_frame: frame interval for the capture times
+Return Value: number of frames
+******************************************************************************/
+static unsigned long scan_movi(const unsigned char *data, const unsigned char *movi, size_t size,
+                               avi_index_entry *index, unsigned int usec_per_frame)
+{
+    const unsigned char *p, *end = movi + size;
+    unsigned long count = 0;
+    size_t length;
+
+    for(p = movi; end - p >= 8; p += 8 + length + (length & 1)) {
+        length = MIN((size_t)get_u32(p + 4), (size_t)(end - p - 8));
+
+        /* video chunks only, skipped frames of other writers are empty */
+        if(memcmp(p + 2, "dc", 2) != 0 || length == 0)
+            continue;
+
+        if(index != NULL) {
+            index[count].offset = p + 8 - data;
+            index[count].size = length;
+            index[count].timestamp = (long long)count * usec_per_frame;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+/******************************************************************************
+Description.: find the frames of a Motion-JPEG AVI file that lies in memory,
+              usually mapped. The capture times come from the "mjts" chunk,
+              files of other writers have none and get times from the frame
+              rate in the headers.
+Input Value.: * data...: the file
+              * size...: its length
+              * frames.: where to store the number of frames
+              * usec_per_frame: where to store the frame interval of the
+                               headers, for frames without usable times
+Return Value: the index, the offsets point to the JPEG data relative to the
+              start of the file; NULL if it is no AVI file or has no frames.
+              The caller frees the index.
+******************************************************************************/
+avi_index_entry *avi_parse(const unsigned char *data, size_t size, unsigned long *frames, unsigned int *usec_per_frame)
+{
+    const unsigned char *p, *end, *movi = NULL, *mjts = NULL;
+    size_t length, movi_size = 0, mjts_size = 0;
+    unsigned int interval = 40000;
+    avi_index_entry *index;
+    unsigned long count, i;
+
+    if(size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "AVI ", 4) != 0)
+        return NULL;
+
+    end = data + MIN(size, (size_t)get_u32(data + 4) + 8);
+    for(p = data + 12; end - p >= 8; p += 8 + length + (length & 1)) {
+        length = MIN((size_t)get_u32(p + 4), (size_t)(end - p - 8));
+
+        if(memcmp(p, "LIST", 4) == 0 && length >= 16 && memcmp(p + 8, "hdrl", 4) == 0 && memcmp(p + 12, "avih", 4) == 0) {
+            interval = MAX(get_u32(p + 20), 1);
+        } else if(memcmp(p, "LIST", 4) == 0 && length >= 4 && memcmp(p + 8, "movi", 4) == 0) {
+            movi = p + 12;
+            movi_size = length - 4;
+        } else if(memcmp(p, AVI_TIMESTAMP_CHUNK, 4) == 0) {
+            mjts = p + 8;
+            mjts_size = length;
+        }
+    }
+
+    if(movi == NULL || (count = scan_movi(data, movi, movi_size, NULL, interval)) == 0)
+        return NULL;
+
+    if((index = calloc(count, sizeof(avi_index_entry))) == NULL)
+        return NULL;
+
+    scan_movi(data, movi, movi_size, index, interval);
+
+    if(mjts != NULL && mjts_size == 8 * count) {
+        for(i = 0; i < count; i++)
+            index[i].timestamp = get_u32(mjts + 8 * i) | ((long long)get_u32(mjts + 8 * i + 4) << 32);
+    }
+
+    *frames = count;
+    *usec_per_frame = interval;
+    return index;
+}
@@ -0,0 +1,72 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef AVI_H
+#define AVI_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+/*
+ * AVI 1.0 uses 32 bit sizes and offsets, many players treat them as signed,
+ * so a segment must stay below 2 GB
+ */
+#define AVI_MAX_SIZE (2000LL * 1024 * 1024)
+
+/* fixed size of the headers in front of the first frame, see avi.c */
+#define AVI_HEADER_SIZE 224
+
+/* frame chunks of the only stream: compressed video of stream 00 */
+#define AVI_FRAME_CHUNK "00dc"
+
+/* chunk after the index with the capture time of each frame */
+#define AVI_TIMESTAMP_CHUNK "mjts"
+
+/* what the index needs to know about a frame */
+typedef struct {
+    unsigned int offset;    /* of the chunk, relative to the "movi" fourcc,
+                               avi_parse() stores the offset of the data */
+    unsigned int size;      /* of the JPEG data */
+    long long timestamp;    /* capture time in microseconds since the epoch */
+} avi_index_entry;
+
+/* an AVI file that is being written */
+typedef struct {
+    int fd;
+    off_t size;             /* bytes written so far */
+    off_t preallocated;
+    off_t movi_size;        /* size of the "movi" list, known on close */
+    int width;
+    int height;
+    avi_index_entry *index;
+    unsigned long frames;
+    unsigned long capacity;
+} avi_file;
+
+avi_file *avi_open(const char *filename, off_t preallocate);
+int avi_write_frame(avi_file *avi, const unsigned char *data, int size, struct timeval timestamp);
+int avi_close(avi_file *avi);
+long long avi_duration(avi_file *avi);
+avi_index_entry *avi_parse(const unsigned char *data, size_t size, unsigned long *frames, unsigned int *usec_per_frame);
+int jpeg_dimensions(const unsigned char *data, int size, int *width, int *height);
+
+#endif
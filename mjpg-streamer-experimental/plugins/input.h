@@ -76,6 +76,9 @@ struct _input {
     /* v4l2_buffer timestamp */
     struct timeval timestamp;
 
+    /* number of frames published so far, incremented with db locked */
+    unsigned long sequence;
+
     input_format *in_formats;
     int formatCount;
     int currentFormat; // holds the current format number
@@ -30,16 +30,28 @@
 #include <sys/inotify.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
 
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
+#include "../avi.h"
 
 #define INPUT_PLUGIN_NAME "FILE input plugin"
 
+/* position of a preloaded frame in the arena */
+struct frame_index {
+    size_t offset;
+    size_t size;
+    long long timestamp;    /* recorded capture time in microseconds, AVI only */
+};
+
 typedef enum _read_mode {
     NewFilesOnly,
-    ExistingFiles
+    ExistingFiles,
+    AviFile
 } read_mode;
 
 /* private functions and variables to this plugin */
@@ -56,6 +68,24 @@ static char *filename = NULL;
 static int rm = 0;
 static int plugin_number;
 static read_mode mode = NewFilesOnly;
+static int preload = 0;
+static char *avi_name = NULL;
+
+/* nanoseconds from frame to frame, 0 as fast as possible, -1 as recorded */
+static long long interval = -1;
+
+/* for the frame rate that was reached */
+static unsigned long published = 0;
+static struct timespec started;
+
+/* all frames back to back, read once with --preload or the mapped AVI file */
+static unsigned char *arena = NULL;
+static size_t arena_size = 0;
+static struct frame_index *frames = NULL;
+static int frame_count = 0;
+
+/* microseconds from frame to frame in the AVI headers */
+static unsigned int avi_interval = 40000;
 
 /* global variables for this plugin */
 static int fd, rc, wd, size;
@@ -64,6 +94,7 @@ static struct inotify_event *ev;
 /*** plugin interface functions ***/
 int input_init(input_parameter *param, int id)
 {
+    double fps;
     int i;
     plugin_number = id;
 
@@ -91,6 +122,12 @@ int input_init(input_parameter *param, int id)
             {"name", required_argument, 0, 0},
             {"e", no_argument, 0, 0},
             {"existing", no_argument, 0, 0},
+            {"p", no_argument, 0, 0},
+            {"preload", no_argument, 0, 0},
+            {"fps", required_argument, 0, 0},
+            {"framerate", required_argument, 0, 0},
+            {"a", required_argument, 0, 0},
+            {"avi", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -151,6 +188,35 @@ int input_init(input_parameter *param, int id)
             DBG("case 10,11\n");
             mode = ExistingFiles;
             break;
+
+            /* p, preload */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            mode = ExistingFiles;
+            preload = 1;
+            break;
+
+            /* fps, framerate */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            if(strcmp(optarg, "max") == 0) {
+                interval = 0;
+            } else if((fps = strtod(optarg, NULL)) > 0) {
+                interval = 1000000000LL / fps;
+            } else {
+                help();
+                return 1;
+            }
+            break;
+
+            /* a, avi */
+        case 16:
+        case 17:
+            DBG("case 16,17\n");
+            avi_name = strdup(optarg);
+            break;
         default:
             DBG("default case\n");
             help();
@@ -160,16 +226,35 @@ int input_init(input_parameter *param, int id)
 
     pglobal = param->global;
 
+    /* an AVI file has all it needs, the folder is not used */
+    if(avi_name != NULL)
+        mode = AviFile;
+
     /* check for required parameters */
-    if(folder == NULL) {
+    if(folder == NULL && mode != AviFile) {
         IPRINT("ERROR: no folder specified\n");
         return 1;
     }
 
-    IPRINT("folder to watch...: %s\n", folder);
-    IPRINT("forced delay......: %i\n", delay);
-    IPRINT("delete file.......: %s\n", (rm) ? "yes, delete" : "no, do not delete");
-    IPRINT("filename must be..: %s\n", (filename == NULL) ? "-no filter for certain filename set-" : filename);
+    /* without --fps the frames follow --delay or the times in the AVI file */
+    if(interval < 0 && mode != AviFile)
+        interval = delay * 1000000000LL;
+
+    if(mode == AviFile) {
+        IPRINT("AVI file..........: %s\n", avi_name);
+    } else {
+        IPRINT("folder to watch...: %s\n", folder);
+        IPRINT("delete file.......: %s\n", (rm) ? "yes, delete" : "no, do not delete");
+        IPRINT("filename must be..: %s\n", (filename == NULL) ? "-no filter for certain filename set-" : filename);
+        IPRINT("preload frames....: %s\n", (preload) ? "yes" : "no");
+    }
+    if(interval == 0) {
+        IPRINT("frame rate........: as fast as possible\n");
+    } else if(interval < 0) {
+        IPRINT("frame rate........: as recorded\n");
+    } else {
+        IPRINT("frame rate........: %.3f fps\n", 1000000000.0 / interval);
+    }
 
     param->global->in[id].name = malloc((strlen(INPUT_PLUGIN_NAME) + 1) * sizeof(char));
     sprintf(param->global->in[id].name, INPUT_PLUGIN_NAME);
@@ -232,9 +317,245 @@ void help(void)
     " [-r | --remove ].......: remove/delete JPEG file after reading\n" \
     " [-n | --name ].........: ignore changes unless filename matches\n" \
     " [-e | --existing ].....: serve the existing *.jpg files from the specified directory\n" \
+    " [-p | --preload ]......: like --existing, but read all files into memory once\n" \
+    "                          and serve them from there\n" \
+    " [-fps | --framerate ]..: frames per second, fractions are allowed, \"max\"\n" \
+    "                          publishes as fast as possible, overrides --delay\n" \
+    " [-a | --avi ]..........: play the frames of an AVI file in a loop at their\n" \
+    "                          recorded times, e.g. from output_file --avi\n" \
     " ---------------------------------------------------------------\n");
 }
 
+/******************************************************************************
+Description.: wait for the next frame on a fixed schedule, so the time spent
+              on each frame does not add up. After a stall a new schedule
+              starts instead of catching up with a burst of frames.
+Input Value.: * next...: time of the last frame, advanced to the next one
+              * wait...: nanoseconds from the last to the next frame
+Return Value: -
+******************************************************************************/
+static void wait_next_frame(struct timespec *next, long long wait)
+{
+    struct timespec now;
+
+    published++;
+    if(wait <= 0)
+        return;
+
+    next->tv_sec += wait / 1000000000LL;
+    next->tv_nsec += wait % 1000000000LL;
+    if(next->tv_nsec >= 1000000000L) {
+        next->tv_sec++;
+        next->tv_nsec -= 1000000000L;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(now.tv_sec > next->tv_sec || (now.tv_sec == next->tv_sec && now.tv_nsec > next->tv_nsec)) {
+        *next = now;
+        return;
+    }
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR);
+}
+
+/******************************************************************************
+Description.: map an AVI file and index its frames, the pages are read in
+              advance so playback does not wait for the disk
+Input Value.: -
+Return Value: 0 if frames were found, -1 in case of error
+******************************************************************************/
+static int load_avi(void)
+{
+    avi_index_entry *index;
+    struct stat stats;
+    unsigned long count, i;
+    int file;
+
+    if((file = open(avi_name, O_RDONLY)) == -1) {
+        perror("could not open the AVI file");
+        return -1;
+    }
+
+    if(fstat(file, &stats) == -1) {
+        perror("could not read statistics of file");
+        close(file);
+        return -1;
+    }
+
+    arena_size = stats.st_size;
+    arena = mmap(NULL, arena_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, file, 0);
+    close(file);
+    if(arena == MAP_FAILED) {
+        arena = NULL;
+        perror("could not map the AVI file");
+        return -1;
+    }
+
+    if((index = avi_parse(arena, arena_size, &count, &avi_interval)) == NULL) {
+        fprintf(stderr, "%s is no Motion-JPEG AVI file or has no frames\n", avi_name);
+        return -1;
+    }
+
+    if((frames = calloc(count, sizeof(struct frame_index))) == NULL) {
+        fprintf(stderr, "could not allocate memory\n");
+        free(index);
+        return -1;
+    }
+
+    for(i = 0; i < count; i++) {
+        frames[i].offset = index[i].offset;
+        frames[i].size = index[i].size;
+        frames[i].timestamp = index[i].timestamp;
+    }
+    frame_count = count;
+    free(index);
+
+    IPRINT("mapped %d frames, %.1f s\n", frame_count,
+           (frames[frame_count - 1].timestamp - frames[0].timestamp) / 1000000.0);
+    return 0;
+}
+
+/******************************************************************************
+Description.: read all JPEG files of the folder into one memory area, so
+              serving a frame needs neither system calls nor allocations
+Input Value.: * fileList.....: the directory entries, sorted
+              * fileCount....: number of entries
+Return Value: 0 if frames were loaded, -1 in case of error
+******************************************************************************/
+static int load_frames(struct dirent **fileList, int fileCount)
+{
+    char path[1<<16];
+    struct stat stats;
+    size_t offset;
+    ssize_t got;
+    int *entries;
+    int i, file;
+
+    frames = calloc(fileCount, sizeof(struct frame_index));
+    entries = calloc(fileCount, sizeof(int));
+    if(frames == NULL || entries == NULL) {
+        fprintf(stderr, "could not allocate memory\n");
+        free(entries);
+        return -1;
+    }
+
+    /* the size of the arena is the sum of the file sizes */
+    for(i = 0; i < fileCount; i++) {
+        if((strstr(fileList[i]->d_name, ".jpg") == NULL) &&
+           (strstr(fileList[i]->d_name, ".JPG") == NULL))
+            continue;
+
+        snprintf(path, sizeof(path), "%s%s", folder, fileList[i]->d_name);
+        if(stat(path, &stats) == -1 || !S_ISREG(stats.st_mode) || stats.st_size == 0)
+            continue;
+
+        entries[frame_count] = i;
+        frames[frame_count].offset = arena_size;
+        frames[frame_count].size = stats.st_size;
+        arena_size += stats.st_size;
+        frame_count++;
+    }
+
+    if(frame_count == 0) {
+        fprintf(stderr, "No files with jpg/JPG extension in the folder\n");
+        free(entries);
+        return -1;
+    }
+
+    arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(arena == MAP_FAILED) {
+        arena = NULL;
+        perror("could not map memory for the frames");
+        free(entries);
+        return -1;
+    }
+
+    for(i = 0; i < frame_count; i++) {
+        snprintf(path, sizeof(path), "%s%s", folder, fileList[entries[i]]->d_name);
+        if((file = open(path, O_RDONLY)) == -1) {
+            perror("could not open file for reading");
+            free(entries);
+            return -1;
+        }
+
+        /* a file that shrank since stat() keeps what it has */
+        for(offset = 0; offset < frames[i].size; offset += got) {
+            got = read(file, arena + frames[i].offset + offset, frames[i].size - offset);
+            if(got == -1 && errno == EINTR) {
+                got = 0;
+                continue;
+            }
+            if(got <= 0)
+                break;
+        }
+        close(file);
+
+        if(got == -1) {
+            perror("could not read from file");
+            free(entries);
+            return -1;
+        }
+        frames[i].size = offset;
+    }
+    free(entries);
+
+    /* nobody writes to the frames, outputs only copy them */
+    mprotect(arena, arena_size, PROT_READ);
+
+    IPRINT("preloaded %d frames, %zu bytes\n", frame_count, arena_size);
+    return 0;
+}
+
+/******************************************************************************
+Description.: publish the preloaded frames in a loop. The global buffer points
+              into the arena, there is nothing to copy or to free. The frames
+              follow a fixed schedule, a late frame does not delay the next.
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void serve_frames(void)
+{
+    struct timespec next;
+    struct timeval timestamp;
+    long long wait, average = 0;
+    int current = 0;
+
+    /* the loop goes back to the first frame after the average interval */
+    if(frame_count > 1)
+        average = (frames[frame_count - 1].timestamp - frames[0].timestamp) / (frame_count - 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while(!pglobal->stop) {
+        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        pglobal->in[plugin_number].buf = arena + frames[current].offset;
+        pglobal->in[plugin_number].size = frames[current].size;
+        gettimeofday(&timestamp, NULL);
+        pglobal->in[plugin_number].timestamp = timestamp;
+        DBG("new frame published (size: %d)\n", pglobal->in[plugin_number].size);
+        pglobal->in[plugin_number].sequence++;
+        /* signal fresh_frame */
+        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
+        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+
+        if(interval >= 0) {
+            wait = interval;
+        } else {
+            wait = current + 1 < frame_count ? frames[current + 1].timestamp - frames[current].timestamp : average;
+
+            /* recordings of inputs without timestamps have none that help */
+            if(wait <= 0)
+                wait = avi_interval;
+            wait *= 1000;
+        }
+
+        if(++current == frame_count)
+            current = 0;
+
+        wait_next_frame(&next, wait);
+    }
+}
+
 /* the single writer thread */
 void *worker_thread(void *arg)
 {
@@ -242,11 +563,12 @@ void *worker_thread(void *arg)
     int file;
     size_t filesize = 0;
     struct stat stats;
-    struct dirent **fileList;
+    struct dirent **fileList = NULL;
     int fileCount = 0;
     int currentFileNumber = 0;
     char hasJpgFile = 0;
     struct timeval timestamp;
+    struct timespec next;
 
     if (mode == ExistingFiles) {
         fileCount = scandir(folder, &fileList, 0, alphasort);
@@ -259,6 +581,20 @@ void *worker_thread(void *arg)
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    if(mode == AviFile || preload) {
+        if(mode == AviFile)
+            rc = load_avi();
+        else
+            rc = load_frames(fileList, fileCount);
+
+        if(rc == 0)
+            serve_frames();
+        goto thread_quit;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
     while(!pglobal->stop) {
         if (mode == NewFilesOnly) {
             /* wait for new frame, read will block until something happens */
@@ -349,6 +685,7 @@ void *worker_thread(void *arg)
         gettimeofday(&timestamp, NULL);
         pglobal->in[plugin_number].timestamp = timestamp;
         DBG("new frame copied (size: %d)\n", pglobal->in[plugin_number].size);
+        pglobal->in[plugin_number].sequence++;
         /* signal fresh_frame */
         pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
         pthread_mutex_unlock(&pglobal->in[plugin_number].db);
@@ -363,8 +700,7 @@ void *worker_thread(void *arg)
             }
         }
 
-        if(delay != 0)
-            usleep(1000 * 1000 * delay);
+        wait_next_frame(&next, interval);
     }
 
 thread_quit:
@@ -392,6 +728,26 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
 
+    if(published > 1) {
+        struct timespec now;
+        double elapsed;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1000000000.0;
+        IPRINT("published %lu frames in %.1f s, %.1f fps\n", published, elapsed, published / elapsed);
+    }
+
+    if(arena != NULL) {
+        /* the global buffer points into the arena */
+        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        pglobal->in[plugin_number].buf = NULL;
+        pglobal->in[plugin_number].size = 0;
+        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        munmap(arena, arena_size);
+        arena = NULL;
+    }
+    free(frames);
+
     if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
 
     free(ev);
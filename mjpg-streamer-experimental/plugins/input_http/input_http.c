@@ -31,9 +31,11 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <limits.h>
 
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
@@ -45,14 +47,104 @@ static pthread_t   worker;
 static globals     *pglobal;
 static pthread_mutex_t controls_mutex;
 static int plugin_number;
+static int buffer_capacity;
 
 void *worker_thread(void *);
 void worker_cleanup(void *);
 
 #define INPUT_PLUGIN_NAME "HTTP Input plugin"
 
+/* read-only controls with the timing of the upstream being streamed from */
+#define IN_HTTP_CMD_UPSTREAM    1
+#define IN_HTTP_CMD_DELAY       2
+#define IN_HTTP_CMD_JITTER      3
+#define IN_HTTP_CMD_DELAYS      10  /* one per histogram bucket */
+#define IN_HTTP_CMD_JITTERS     20
+#define IN_HTTP_CONTROLS        (3 + 2 * DELAY_BUCKETS)
+
 struct extractor_state  proxy;
 
+/******************************************************************************
+Description.: add a read-only integer control
+Input Value.: * id...: control id
+              * name.: name of the control
+Return Value: -
+******************************************************************************/
+static void add_control(int id, const char *name)
+{
+    control *c = &pglobal->in[plugin_number].in_parameters[pglobal->in[plugin_number].parametercount++];
+
+    c->group = IN_CMD_GENERIC;
+    c->menuitems = NULL;
+    c->value = 0;
+    c->class_id = 0;
+    c->ctrl.id = id;
+    c->ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+    c->ctrl.flags = V4L2_CTRL_FLAG_READ_ONLY;
+    snprintf((char *)c->ctrl.name, sizeof(c->ctrl.name), "%s", name);
+    c->ctrl.minimum = 0;
+    c->ctrl.maximum = INT_MAX;
+    c->ctrl.step = 1;
+    c->ctrl.default_value = 0;
+}
+
+/******************************************************************************
+Description.: create the controls: the upstream, the delay and jitter of the
+              last image in microseconds and histograms of both
+Input Value.: -
+Return Value: 0 if everything is ok
+******************************************************************************/
+static int init_controls(void)
+{
+    char name[32];
+    int i;
+
+    pglobal->in[plugin_number].parametercount = 0;
+    if((pglobal->in[plugin_number].in_parameters = calloc(IN_HTTP_CONTROLS, sizeof(control))) == NULL)
+        return -1;
+
+    add_control(IN_HTTP_CMD_UPSTREAM, "Upstream");
+    add_control(IN_HTTP_CMD_DELAY, "End-to-end delay (us)");
+    add_control(IN_HTTP_CMD_JITTER, "Jitter (us)");
+
+    for(i = 0; i < DELAY_BUCKETS; i++) {
+        if(i < DELAY_BUCKETS - 1)
+            snprintf(name, sizeof(name), "Delay < %d ms", delay_bucket_limits[i]);
+        else
+            snprintf(name, sizeof(name), "Delay >= %d ms", delay_bucket_limits[i - 1]);
+        add_control(IN_HTTP_CMD_DELAYS + i, name);
+    }
+    for(i = 0; i < DELAY_BUCKETS; i++) {
+        if(i < DELAY_BUCKETS - 1)
+            snprintf(name, sizeof(name), "Jitter < %d ms", delay_bucket_limits[i]);
+        else
+            snprintf(name, sizeof(name), "Jitter >= %d ms", delay_bucket_limits[i - 1]);
+        add_control(IN_HTTP_CMD_JITTERS + i, name);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: show the timing of the upstream in the controls
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void update_controls(void)
+{
+    struct upstream_stats *stats = &proxy.upstreams[proxy.current].stats;
+    control *c = pglobal->in[plugin_number].in_parameters;
+    int i;
+
+    c[0].value = proxy.current;
+    c[1].value = MIN(MAX(stats->delay, 0), INT_MAX);
+    c[2].value = MIN(stats->jitter, INT_MAX);
+    for(i = 0; i < DELAY_BUCKETS; i++) {
+        c[3 + i].value = MIN(stats->delays[i], INT_MAX);
+        c[3 + DELAY_BUCKETS + i].value = MIN(stats->jitters[i], INT_MAX);
+    }
+}
+
 /*** plugin interface functions ***/
 
 /******************************************************************************
@@ -84,9 +176,18 @@ int input_init(input_parameter *param, int plugin_no)
        return 1;
 
     pglobal = param->global;
+    plugin_number = plugin_no;
 
-    IPRINT("host.............: %s\n", proxy.hostname);
-    IPRINT("port.............: %s\n", proxy.port);
+    if(init_controls() != 0) {
+        IPRINT("could not allocate memory\n");
+        return 1;
+    }
+
+    for(i = 0; i < proxy.upstream_count; i++) {
+        IPRINT("%s..........: http://%s:%s%s\n", i == 0 ? "primary" : "replica", proxy.upstreams[i].host,
+               proxy.upstreams[i].port, proxy.upstreams[i].path);
+    }
+    IPRINT("max frame size...: %d kB\n", proxy.max_frame_size / 1024);
 
     return 0;
 }
@@ -110,11 +211,12 @@ Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    pglobal->in[id].buf = malloc(256 * 1024);
+    pglobal->in[id].buf = malloc(BUFFER_SIZE);
     if(pglobal->in[id].buf == NULL) {
         fprintf(stderr, "could not allocate memory\n");
         exit(EXIT_FAILURE);
     }
+    buffer_capacity = BUFFER_SIZE;
 
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
         free(pglobal->in[id].buf);
@@ -127,13 +229,33 @@ int input_run(int id)
 }
 
 
-void on_image_received(char * data, int length){
-        /* copy JPG picture to global buffer */
+/******************************************************************************
+Description.: publishes a JPG picture without copying it: the buffer it was
+              received into becomes the global buffer, and the previous
+              global buffer takes the next picture
+Input Value.: * data.....: the picture, gets the previous global buffer
+              * capacity.: size of the buffer, gets the size of the other one
+              * length...: length of the picture
+              * timestamp: capture time of the picture
+Return Value: -
+******************************************************************************/
+void on_image_received(char ** data, int * capacity, int length, struct timeval timestamp){
+        char * published;
+        int published_capacity;
+
         pthread_mutex_lock(&pglobal->in[plugin_number].db);
 
+        published = (char *)pglobal->in[plugin_number].buf;
+        published_capacity = buffer_capacity;
+        pglobal->in[plugin_number].buf = (unsigned char *)*data;
         pglobal->in[plugin_number].size = length;
-        memcpy(pglobal->in[plugin_number].buf, data, pglobal->in[plugin_number].size);
+        pglobal->in[plugin_number].timestamp = timestamp;
+        update_controls();
+        buffer_capacity = *capacity;
+        *data = published;
+        *capacity = published_capacity;
 
+        pglobal->in[plugin_number].sequence++;
         /* signal fresh_frame */
         pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
         pthread_mutex_unlock(&pglobal->in[plugin_number].db);
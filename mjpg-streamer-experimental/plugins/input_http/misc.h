@@ -22,24 +22,4 @@
 int min(int a, int b);
 void write_image(char * image, int length);
 
-// dumb 4 byte storing to detect double CRLF
-int is_crlf(int bytes);
-
-int is_crlfcrlf(int bytes) ;
-void push_byte(int * bytes, char byte);
-
-struct search_pattern {
-    const char * string;
-    const char * current_matched_char;
-};
-
-void search_pattern_reset(struct search_pattern * pattern);
-
-
-int search_pattern_compare(struct search_pattern * pattern, char c) ;
-
-int search_pattern_matches(struct search_pattern * pattern);
-
-
-
 #endif
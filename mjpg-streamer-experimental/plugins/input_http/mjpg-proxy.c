@@ -24,6 +24,11 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -38,92 +43,556 @@
 
 
 
+#define RESPONSE 2
 #define HEADER 1
 #define CONTENT 0
-#define BUFFER_SIZE 1024 * 100
-#define NETBUFFER_SIZE 1024 * 4
+#define NETBUFFER_SIZE 1024 * 64
 #define TRUE 1
 #define FALSE 0
 
+// seconds to wait for a connection and for data before trying the next upstream
+#define CONNECT_TIMEOUT 3
+#define STALL_TIMEOUT 5
+// longest pause before a failed upstream is tried again
+#define MAX_BACKOFF 30
+// seconds between attempts to return from a replica to a preferred upstream
+#define FAILBACK_INTERVAL 30
+
 const char * CONTENT_LENGTH = "Content-Length:";
-// TODO: this must be decoupled from mjpeg-streamer
+// used if the response does not name the boundary
 const char * BOUNDARY =     "--boundarydonotcross";
 
 struct extractor_state state;
 
+const int delay_bucket_limits [DELAY_BUCKETS - 1] = {5, 10, 20, 50, 100, 200, 500, 1000};
+
+// the parts of the stream follow the headers of the response
 void init_extractor_state(struct extractor_state * state) {
+    state->length = 0;
+    state->status = 0;
+    state->part = RESPONSE;
+    state->header_length = 0;
+    state->content_length = -1;
+    state->overflow = FALSE;
+    snprintf(state->boundary, sizeof(state->boundary), "%s", BOUNDARY);
+}
+
+// the headers of the next part follow
+void next_part(struct extractor_state * state) {
     state->length = 0;
     state->part = HEADER;
-    state->last_four_bytes = 0;
-    state->contentlength.string = CONTENT_LENGTH;
-    state->boundary.string = BOUNDARY;
-    search_pattern_reset(&state->contentlength);
-    search_pattern_reset(&state->boundary);
+    state->header_length = 0;
+    state->content_length = -1;
+    state->overflow = FALSE;
+    state->has_timestamp = FALSE;
 }
 
 void init_mjpg_proxy(struct extractor_state * state){
 state->hostname = strdup("localhost");
 state->port = strdup("8080");
+state->buffer = malloc(BUFFER_SIZE);
+state->capacity = state->buffer != NULL ? BUFFER_SIZE : 0;
+state->max_frame_size = MAX_FRAME_SIZE;
+state->upstream_count = 0;
+state->images = 0;
+state->probe_fd = -1;
 
 init_extractor_state(state);
 
 }
 
+// makes room for size bytes in state->buffer, FALSE if that is more than allowed
+static int reserve(struct extractor_state * state, int size) {
+    int capacity = state->capacity > 0 ? state->capacity : BUFFER_SIZE;
+    char * buffer;
+
+    if (size <= state->capacity)
+        return TRUE;
+    if (size > state->max_frame_size)
+        return FALSE;
+
+    while (capacity < size)
+        capacity *= 2;
+    capacity = min(capacity, state->max_frame_size);
+
+    if ((buffer = realloc(state->buffer, capacity)) == NULL)
+        return FALSE;
+    DBG("frame buffer grows to %d bytes\n", capacity);
+    state->buffer = buffer;
+    state->capacity = capacity;
+    return TRUE;
+}
+
+// finds a header line in state->header, returns its value or NULL
+static char * find_header(struct extractor_state * state, const char * name) {
+    char * line = state->header;
+
+    while ((line = strcasestr(line, name)) != NULL) {
+        if (line == state->header || line[-1] == '\n')
+            return line + strlen(name);
+        line += strlen(name);
+    }
+    return NULL;
+}
+
+// takes the boundary from the Content-Type of the response
+static void parse_response(struct extractor_state * state) {
+    char * value = find_header(state, "Content-Type:");
+    int length;
+
+    if (sscanf(state->header, "HTTP/%*d.%*d %d", &state->status) != 1)
+        state->status = -1;
+
+    if (value == NULL || (value = strcasestr(value, "boundary=")) == NULL)
+        return;
+
+    value += strlen("boundary=");
+    if (*value == '"')
+        value++;
+    length = strcspn(value, "\"; \t\r\n");
+    if (length == 0 || length + 3 > BOUNDARY_SIZE)
+        return;
+
+    // some servers put the dashes of the delimiter into the boundary
+    snprintf(state->boundary, sizeof(state->boundary), "%s%.*s",
+             strncmp(value, "--", 2) == 0 ? "" : "--", length, value);
+    DBG("boundary is %s\n", state->boundary);
+}
+
+// reads "seconds.microseconds" like mjpg-streamer sends it in X-Timestamp
+static int parse_timestamp(const char * value, struct timeval * timestamp) {
+    char * end;
+    int digits;
+
+    timestamp->tv_sec = strtol(value, &end, 10);
+    timestamp->tv_usec = 0;
+    if (end == value || timestamp->tv_sec <= 0)
+        return FALSE;
+
+    if (*end == '.')
+        for (end++, digits = 0; digits < 6; digits++)
+            timestamp->tv_usec = timestamp->tv_usec * 10 + (*end >= '0' && *end <= '9' ? *end++ - '0' : 0);
+    return TRUE;
+}
+
+// takes the length of the image and its capture time from the headers of a part
+static void parse_part_header(struct extractor_state * state) {
+    char * value = find_header(state, CONTENT_LENGTH);
+    char * timestamp = find_header(state, "X-Timestamp:");
+
+    state->has_timestamp = timestamp != NULL && parse_timestamp(timestamp, &state->timestamp);
+
+    state->content_length = value != NULL && atoi(value) >= 0 ? atoi(value) : -1;
+    if (value != NULL) {
+        DBG("Content length found\n");
+    }
+
+    if (state->content_length >= 0 && !reserve(state, state->content_length))
+        state->overflow = TRUE;
+}
+
+// the bucket of a histogram for a time in us
+static int delay_bucket(long long delay) {
+    int i;
+
+    for (i = 0; i < DELAY_BUCKETS - 1 && delay >= delay_bucket_limits[i] * 1000LL; i++);
+    return i;
+}
+
+// updates the delay and jitter of the upstream with an image that just arrived
+static void measure(struct extractor_state * state) {
+    struct upstream_stats * stats = &state->upstreams[state->current].stats;
+    struct timeval received;
+    long long transit, difference;
+
+    gettimeofday(&received, NULL);
+    if (!state->has_timestamp) {
+        state->timestamp = received;
+        return;
+    }
+
+    // clocks that are not quite in sync may make it negative
+    transit = (received.tv_sec - state->timestamp.tv_sec) * 1000000LL + (received.tv_usec - state->timestamp.tv_usec);
+    stats->delay = transit;
+    stats->delays[delay_bucket(transit)]++;
+
+    if (stats->measured) {
+        difference = transit > stats->last_transit ? transit - stats->last_transit : stats->last_transit - transit;
+        stats->jitter += (difference - stats->jitter) / 16;
+        stats->jitters[delay_bucket(difference)]++;
+    }
+    stats->last_transit = transit;
+    stats->measured = TRUE;
+}
+
+// hands the image in state->buffer over and waits for the next part
+static void image_complete(struct extractor_state * state) {
+    if (state->overflow) {
+        DBG("Image too large, dropped\n");
+    } else {
+        DBG("Image of length %d received\n", (int)state->length);
+        state->images++;
+        measure(state);
+        if (state->on_image_received) // callback
+            state->on_image_received(&state->buffer, &state->capacity, state->length, state->timestamp);
+    }
+    next_part(state);
+}
+
+// collects headers up to the empty line, returns how many bytes it took
+static int extract_header(struct extractor_state * state, char * buffer, int length) {
+    int start = state->header_length > 3 ? state->header_length - 3 : 0;
+    int count = min(length, HEADER_SIZE - state->header_length);
+    char * end;
+
+    memcpy(state->header + state->header_length, buffer, count);
+    state->header_length += count;
+    state->header[state->header_length] = 0;
+
+    end = memmem(state->header + start, state->header_length - start, "\r\n\r\n", 4);
+    if (end == NULL) {
+        // garbage, start over with what follows
+        if (state->header_length == HEADER_SIZE)
+            state->header_length = 0;
+        return count;
+    }
+
+    // the rest of the buffer belongs to the content
+    count -= state->header_length - (end + 4 - state->header);
+    state->header_length = end + 2 - state->header;
+    state->header[state->header_length] = 0;
+
+    if (state->part == RESPONSE) {
+        parse_response(state);
+        next_part(state);
+    } else {
+        parse_part_header(state);
+        state->part = CONTENT;
+    }
+    return count;
+}
+
+// count bytes of an image of known length are in state->buffer
+static void content_received(struct extractor_state * state, int count) {
+    state->length += count;
+    if (state->length == state->content_length)
+        image_complete(state);
+}
+
+// copies an image of known length, returns how many bytes it took
+static int extract_content(struct extractor_state * state, char * buffer, int length) {
+    int count = min(length, state->content_length - state->length);
+
+    if (!state->overflow)
+        memcpy(state->buffer + state->length, buffer, count);
+    content_received(state, count);
+    return count;
+}
+
+// looks for the boundary after an image of unknown length, returns how many bytes it took
+static int extract_until_boundary(struct extractor_state * state, char * buffer, int length) {
+    int boundary_length = strlen(state->boundary);
+    int start = state->length > boundary_length - 1 ? state->length - (boundary_length - 1) : 0;
+    int count, old_length;
+    char * end;
+
+    // too large, keep only what may be the start of the boundary
+    if (state->length == state->capacity && !reserve(state, state->capacity + 1)) {
+        memmove(state->buffer, state->buffer + start, state->length - start);
+        state->length -= start;
+        start = 0;
+        state->overflow = TRUE;
+    }
+
+    count = min(length, state->capacity - state->length);
+    memcpy(state->buffer + state->length, buffer, count);
+    old_length = state->length;
+    state->length += count;
+
+    end = memmem(state->buffer + start, state->length - start, state->boundary, boundary_length);
+    if (end == NULL)
+        return count;
+
+    // the line break in front of the boundary is not part of the image
+    count = end + boundary_length - state->buffer - old_length;
+    state->length = end - state->buffer;
+    if (state->length > 0 && state->buffer[state->length - 1] == '\n')
+        state->length--;
+    if (state->length > 0 && state->buffer[state->length - 1] == '\r')
+        state->length--;
+
+    image_complete(state);
+    return count;
+}
+
 // main method
-// we process all incoming buffer byte per byte and extract binary data from it to state->buffer
-// if boundary is detected, then callback for image processing is run
-// TODO; decouple from mjpeg streamer and ensure content-length processing
-//       for that, we must properly work with headers, not just detect them
+// we process whole buffers: headers are collected up to the empty line,
+// images with a Content-Length are copied at once, the others are searched
+// for the boundary with memmem(). If an image is complete, the callback for
+// image processing is run
 void extract_data(struct extractor_state * state, char * buffer, int length) {
-    int i;
-    for (i = 0; i < length && !*(state->should_stop); i++) {
-        switch (state->part) {
-        case HEADER:
-            push_byte(&state->last_four_bytes, buffer[i]);
-            if (is_crlfcrlf(state->last_four_bytes))
-                state->part = CONTENT;
-            else if (is_crlf(state->last_four_bytes))
-                search_pattern_reset(&state->contentlength);
-            else {
-                search_pattern_compare(&state->contentlength, buffer[i]);
-                if (search_pattern_matches(&state->contentlength))
-                    DBG("Content length found\n");
-            }
+    int count;
+
+    while (length > 0 && !*(state->should_stop)) {
+        if (state->part != CONTENT)
+            count = extract_header(state, buffer, length);
+        else if (state->content_length >= 0)
+            count = extract_content(state, buffer, length);
+        else
+            count = extract_until_boundary(state, buffer, length);
+
+        buffer += count;
+        length -= count;
+    }
+
+}
+
+// current time in seconds that does not jump with the wall clock
+static time_t now_seconds(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+// connects to an upstream, gives up after CONNECT_TIMEOUT, returns the socket or -1
+static int connect_upstream(struct upstream * upstream) {
+    struct addrinfo hints, * info, * rp;
+    struct timeval timeout = {STALL_TIMEOUT, 0};
+    struct pollfd pfd;
+    socklen_t length = sizeof(int);
+    int sockfd = -1, error, flags;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((error = getaddrinfo(upstream->host, upstream->port, &hints, &info)) != 0) {
+        fprintf(stderr, "%s: %s\n", upstream->host, gai_strerror(error));
+        return -1;
+    }
+
+    for (rp = info ; rp != NULL; rp = rp->ai_next) {
+        if ((sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) < 0)
+            continue;
+
+        // a host that is down must not block us for minutes
+        flags = fcntl(sockfd, F_GETFL);
+        fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+        error = connect(sockfd, rp->ai_addr, rp->ai_addrlen) < 0 ? errno : 0;
+        if (error == EINPROGRESS) {
+            pfd.fd = sockfd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, CONNECT_TIMEOUT * 1000) == 1)
+                getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &length);
+            else
+                error = ETIMEDOUT;
+        }
+
+        if (error == 0) {
+            fcntl(sockfd, F_SETFL, flags);
+            // an upstream that stops sending counts as failed
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
             break;
+        }
 
-        case CONTENT:
-            state->buffer[state->length++] = buffer[i];
-            search_pattern_compare(&state->boundary, buffer[i]);
-            if (search_pattern_matches(&state->boundary)) {
-                state->length -= (strlen(state->boundary.string)+2); // magic happens here
-                DBG("Image of length %d received\n", (int)state->length);
-                if (state->on_image_received) // callback
-                  state->on_image_received(state->buffer, state->length);
-                init_extractor_state(state); // reset fsm
-            }
+        close(sockfd);
+        sockfd = -1;
+    }
+
+    freeaddrinfo(info);
+    return sockfd;
+}
+
+// the next attempt waits longer with every failure in a row
+static void upstream_failed(struct upstream * upstream) {
+    upstream->failures++;
+    upstream->retry = now_seconds() + min(1 << min(upstream->failures - 1, 5), MAX_BACKOFF);
+    fprintf(stderr, "upstream %s:%s%s failed %d times, next try in %d s\n", upstream->host, upstream->port,
+            upstream->path, upstream->failures, (int)(upstream->retry - now_seconds()));
+}
+
+// the first upstream in the order of preference that may be tried, -1 if none
+static int choose_upstream(struct extractor_state * state, int before) {
+    time_t now = now_seconds();
+    int i;
+
+    for (i = 0; i < before; i++)
+        if (state->upstreams[i].retry <= now)
+            return i;
+    return -1;
+}
+
+// ends the probe, a failed one delays the next attempt on that upstream
+static void end_probe(struct extractor_state * state, int failed) {
+    if (state->probe_fd < 0)
+        return;
+
+    close(state->probe_fd);
+    state->probe_fd = -1;
+    if (failed)
+        upstream_failed(&state->upstreams[state->probe_upstream]);
+}
+
+// starts to connect to the most preferred upstream that may be tried, without waiting for it
+static void start_probe(struct extractor_state * state) {
+    struct addrinfo hints, * info, * rp;
+    int i = choose_upstream(state, state->current), sockfd = -1;
+
+    if (i < 0)
+        return;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(state->upstreams[i].host, state->upstreams[i].port, &hints, &info) != 0) {
+        upstream_failed(&state->upstreams[i]);
+        return;
+    }
+
+    for (rp = info ; rp != NULL; rp = rp->ai_next) {
+        if ((sockfd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK, rp->ai_protocol)) < 0)
+            continue;
+        if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) == 0 || errno == EINPROGRESS)
             break;
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(info);
+
+    if (sockfd < 0) {
+        upstream_failed(&state->upstreams[i]);
+        return;
+    }
+
+    state->probe_fd = sockfd;
+    state->probe_upstream = i;
+    state->probe_connected = FALSE;
+    state->probe_length = 0;
+    state->probe_deadline = now_seconds() + CONNECT_TIMEOUT;
+}
+
+// goes on with the probe when its socket is ready, TRUE once the upstream answered with 200
+static int step_probe(struct extractor_state * state) {
+    struct upstream * upstream = &state->upstreams[state->probe_upstream];
+    char request [HEADER_SIZE];
+    socklen_t length = sizeof(int);
+    int error = 0, count, status;
+
+    if (!state->probe_connected) {
+        if (getsockopt(state->probe_fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            end_probe(state, TRUE);
+            return FALSE;
         }
 
+        count = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", upstream->path, upstream->host);
+        if (count >= (int)sizeof(request) || send(state->probe_fd, request, count, MSG_NOSIGNAL) != count) {
+            end_probe(state, TRUE);
+            return FALSE;
+        }
+
+        state->probe_connected = TRUE;
+        state->probe_deadline = now_seconds() + STALL_TIMEOUT;
+        return FALSE;
+    }
+
+    count = recv(state->probe_fd, state->probe_response + state->probe_length,
+                 sizeof(state->probe_response) - 1 - state->probe_length, 0);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return FALSE;
+    if (count <= 0) {
+        end_probe(state, TRUE);
+        return FALSE;
+    }
+
+    state->probe_length += count;
+    state->probe_response[state->probe_length] = '\0';
+    if (strchr(state->probe_response, '\n') == NULL && state->probe_length < (int)sizeof(state->probe_response) - 1)
+        return FALSE;
+
+    if (sscanf(state->probe_response, "HTTP/%*d.%*d %d", &status) != 1 || status != 200) {
+        fprintf(stderr, "upstream %s:%s%s is reachable, but does not stream\n", upstream->host, upstream->port, upstream->path);
+        end_probe(state, TRUE);
+        return FALSE;
     }
 
+    fprintf(stderr, "upstream %s:%s%s streams again\n", upstream->host, upstream->port, upstream->path);
+    end_probe(state, FALSE);
+    return TRUE;
 }
 
-char request [] = "GET /?action=stream HTTP/1.0\r\n\r\n";
+// waits for data of the stream and serves the probe meanwhile,
+// returns 1 if there is data, 0 if a preferred upstream is back, -1 if the stream stalled
+static int wait_stream(struct extractor_state * state) {
+    struct pollfd pfd [2];
+    int timeout, count;
+
+    while (state->probe_fd >= 0) {
+        if ((timeout = state->probe_deadline - now_seconds()) <= 0) {
+            end_probe(state, TRUE);
+            break;
+        }
+
+        pfd[0].fd = state->sockfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = state->probe_fd;
+        pfd[1].events = state->probe_connected ? POLLIN : POLLOUT;
+        if ((count = poll(pfd, 2, min(timeout, STALL_TIMEOUT) * 1000)) < 0 && errno != EINTR)
+            return -1;
+
+        // the probe deadline may end the wait, the stall timeout of the stream may not be over yet
+        if (count == 0 && timeout >= STALL_TIMEOUT)
+            return -1;
+        if (count > 0 && pfd[1].revents && step_probe(state))
+            return 0;
+        if (count > 0 && pfd[0].revents)
+            return 1;
+    }
+    return 1;
+}
 
 void send_request_and_process_response(struct extractor_state * state) {
+    struct upstream * upstream = &state->upstreams[state->current];
     int recv_length;
     char netbuffer[NETBUFFER_SIZE];
+    time_t failback = now_seconds() + FAILBACK_INTERVAL;
 
     init_extractor_state(state);
     
     // send request
-    send(state->sockfd, request, sizeof(request), 0);
+    recv_length = snprintf(netbuffer, sizeof(netbuffer), "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", upstream->path, upstream->host);
+    send(state->sockfd, netbuffer, recv_length, 0);
 
     // and listen for answer until sockerror or THEY stop us 
     // TODO: we must handle EINTR here, it really might occur
-    while ( (recv_length = recv(state->sockfd, netbuffer, sizeof(netbuffer), 0)) > 0 && !*(state->should_stop))
-        extract_data(state, netbuffer, recv_length);
+    while (!*(state->should_stop)) {
+        // streaming from a replica, check now and then if a preferred one is back
+        if (state->current > 0 && state->probe_fd < 0 && now_seconds() >= failback) {
+            start_probe(state);
+            failback = now_seconds() + FAILBACK_INTERVAL;
+        }
+        if (state->probe_fd >= 0 && wait_stream(state) <= 0)
+            break;
+
+        // the rest of an image of known length goes straight into the frame buffer
+        if (state->part == CONTENT && state->content_length > state->length && !state->overflow) {
+            if ((recv_length = recv(state->sockfd, state->buffer + state->length, state->content_length - state->length, 0)) <= 0)
+                break;
+            content_received(state, recv_length);
+        }
+        else {
+            if ((recv_length = recv(state->sockfd, netbuffer, sizeof(netbuffer), 0)) <= 0)
+                break;
+            extract_data(state, netbuffer, recv_length);
+        }
 
+        if (state->status != 0 && state->status != 200) {
+            fprintf(stderr, "upstream %s:%s%s answered with status %d\n", upstream->host, upstream->port, upstream->path, state->status);
+            break;
+        }
+    }
+
+    // the stream ended, not the probe
+    end_probe(state, FALSE);
 }
 
 // TODO:this must be reworked to decouple from mjpeg-streamer
@@ -137,6 +606,9 @@ fprintf(stderr, " --------------------------------------------------------------
                 " [-h | --help]............: show this message\n"
                 " [-H | --host]............: select host to data from, localhost is default\n"
                 " [-p | --port]............: port, defaults to 8080\n"
+                " [-u | --url].............: stream from http://host[:port]/path?query instead,\n"
+                "                            repeat it for replicas to fail over to\n"
+                " [-m | --max_frame_size]..: largest frame in kB, defaults to 8192\n"
                 " ---------------------------------------------------------------\n", program_name);
 }
 // TODO: this must be reworked, too. I don't know how
@@ -144,6 +616,42 @@ void show_version() {
     printf("Version - %s\n", VERSION);
 }
 
+static void add_upstream(struct extractor_state * state, const char * host, const char * port, const char * path) {
+    struct upstream * upstream = &state->upstreams[state->upstream_count++];
+
+    upstream->host = strdup(host);
+    upstream->port = strdup(port);
+    upstream->path = strdup(path);
+    upstream->failures = 0;
+    upstream->retry = 0;
+}
+
+// adds an upstream given as http://host[:port][/path], returns 0 on success
+static int add_url(struct extractor_state * state, const char * url) {
+    char host[256], port[16] = "80";
+    const char * path;
+    int length;
+
+    if (state->upstream_count == MAX_UPSTREAMS || strncmp(url, "http://", 7) != 0)
+        return -1;
+    url += 7;
+
+    path = url + strcspn(url, "/");
+    length = strcspn(url, ":/");
+    if (length == 0 || length >= (int)sizeof(host))
+        return -1;
+    snprintf(host, sizeof(host), "%.*s", length, url);
+
+    if (url[length] == ':') {
+        if (path - url - length - 1 <= 0 || path - url - length - 1 >= (int)sizeof(port))
+            return -1;
+        snprintf(port, sizeof(port), "%.*s", (int)(path - url - length - 1), url + length + 1);
+    }
+
+    add_upstream(state, host, port, *path != 0 ? path : "/");
+    return 0;
+}
+
 int parse_cmd_line(struct extractor_state * state, int argc, char * argv []) {
     while (TRUE) {
         static struct option long_options [] = {
@@ -151,11 +659,13 @@ int parse_cmd_line(struct extractor_state * state, int argc, char * argv []) {
             {"version", no_argument, 0, 'v'},
             {"host", required_argument, 0, 'H'},
             {"port", required_argument, 0, 'p'},
+            {"max_frame_size", required_argument, 0, 'm'},
+            {"url", required_argument, 0, 'u'},
             {0,0,0,0}
         };
 
         int index = 0, c = 0;
-        c = getopt_long_only(argc,argv, "hvH:p:", long_options, &index);
+        c = getopt_long_only(argc,argv, "hvH:p:m:u:", long_options, &index);
 
         if (c==-1) break;
 
@@ -181,62 +691,74 @@ int parse_cmd_line(struct extractor_state * state, int argc, char * argv []) {
                 free(state->port);
                 state->port = strdup(optarg);
                 break;
+            case 'm' :
+                state->max_frame_size = atoi(optarg) * 1024;
+                if (state->max_frame_size <= 0) {
+                    show_help(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'u' :
+                if (add_url(state, optarg) != 0) {
+                    fprintf(stderr, "can not stream from %s\n", optarg);
+                    return 1;
+                }
+                break;
             }
     }
 
+  // without URLs the stream of mjpg-streamer on host and port
+  if (state->upstream_count == 0)
+      add_upstream(state, state->hostname, state->port, "/?action=stream");
+
   return 0;
 }
 
-// TODO: consider using hints for http
-
-// TODO: consider moving delays to plugin command line arguments
+// streams from the most preferred upstream that is not waiting for its retry,
+// an upstream that brought no image before it ended waits longer each time
 void connect_and_stream(struct extractor_state * state){
-    struct addrinfo * info, * rp;
-    int errorcode;
-    while (TRUE) {
-        errorcode = getaddrinfo(state->hostname, state->port, NULL, &info);
-        if (errorcode) {
-            perror(gai_strerror(errorcode));
-        };
-        for (rp = info ; rp != NULL; rp = rp->ai_next) {
-            state->sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-            if (state->sockfd <0) {
-                perror("Can't allocate socket, will continue probing\n");
-                continue;
-            }
-
-            DBG("socket value is %d\n", sockfd);
-            if (connect(state->sockfd, (struct sockaddr *) rp->ai_addr, rp->ai_addrlen)>=0 ) {
-                DBG("connected to host\n");
-                break;
-            }
+    struct upstream * upstream;
+    unsigned long images;
 
-            close(state->sockfd);
+    while (!*state->should_stop) {
+        if ((state->current = choose_upstream(state, state->upstream_count)) < 0) {
+            sleep(1);
+            continue;
+        }
+        upstream = &state->upstreams[state->current];
 
+        if ((state->sockfd = connect_upstream(upstream)) < 0) {
+            upstream_failed(upstream);
+            continue;
         }
 
-        freeaddrinfo(info);
+        fprintf(stderr, "streaming from %s:%s%s\n", upstream->host, upstream->port, upstream->path);
+        images = state->images;
+        // the transit times of an earlier connection do not compare
+        upstream->stats.measured = FALSE;
+        send_request_and_process_response(state);
 
-        if (rp==NULL) {
-            perror("Can't connect to server, will retry in 5 sec");
-            sleep(5);
-        }
-        else
-        {
-            send_request_and_process_response(state);
-            
-            DBG ("Closing socket\n");
-            close (state->sockfd);
-            if (*state->should_stop)
-              break;
-            sleep(1);
-        };
+        DBG ("Closing socket\n");
+        close (state->sockfd);
+
+        if (state->images > images)
+            upstream->failures = 0;
+        else if (!*state->should_stop)
+            upstream_failed(upstream);
     }
 
 }
 
 void close_mjpg_proxy(struct extractor_state * state){
+int i;
+
+for (i = 0; i < state->upstream_count; i++) {
+    free(state->upstreams[i].host);
+    free(state->upstreams[i].port);
+    free(state->upstreams[i].path);
+}
 free(state->hostname);
 free(state->port);
+free(state->buffer);
 }
 
@@ -20,6 +20,9 @@
 #ifndef MJPG_PROXY_H
 #define MJPG_PROXY_H
 
+#include <time.h>
+#include <sys/time.h>
+
 #include "misc.h"
 
 
@@ -31,27 +34,77 @@
 #endif
 #endif
 
-#define BUFFER_SIZE 1024 * 100
+#define BUFFER_SIZE (1024 * 100)
+#define MAX_FRAME_SIZE (1024 * 1024 * 8)
+#define HEADER_SIZE 1024 * 4
+#define BOUNDARY_SIZE 128
+#define MAX_UPSTREAMS 8
+
+// histogram buckets, the limits in ms are in delay_bucket_limits, the last bucket holds the rest
+#define DELAY_BUCKETS 9
+extern const int delay_bucket_limits [DELAY_BUCKETS - 1];
+
+// timing of the images of an upstream that sends X-Timestamp headers
+struct upstream_stats {
+    int measured;           // last_transit is valid
+    long long last_transit; // receive time minus X-Timestamp of the last image, in us
+    long long delay;        // end-to-end delay of the last image, in us
+    long long jitter;       // interarrival jitter like RFC 3550, in us
+    unsigned long delays [DELAY_BUCKETS];
+    unsigned long jitters [DELAY_BUCKETS];  // of the transit time differences
+};
+
+// a server to stream from, the first one is the primary
+struct upstream {
+    char * host;
+    char * port;
+    char * path;            // with the query
+    int failures;           // connections in a row that brought no image
+    time_t retry;           // monotonic second before which it is not tried
+    struct upstream_stats stats;
+};
 
 struct extractor_state {
     
     char * port;
     char * hostname;
 
-    // this is current result
-    char buffer [BUFFER_SIZE];
+    struct upstream upstreams [MAX_UPSTREAMS];
+    int upstream_count;
+    int current;                    // the upstream being streamed from
+
+    // connection to a preferred upstream while streaming from a replica
+    int probe_fd;                   // -1 if there is none
+    int probe_upstream;
+    int probe_connected;            // the request was sent
+    time_t probe_deadline;          // monotonic second of the give up
+    char probe_response [64];       // begin of the response, the status line
+    int probe_length;
+
+    // this is current result, the buffer grows up to max_frame_size
+    char * buffer;
+    int capacity;
     int length;
+    int max_frame_size;
 
     // this is inner state of a parser
 
     int sockfd;
+    int status;                     // of the HTTP response, 0 until it arrived
+    unsigned long images;           // received since the start
     int part;
-    int last_four_bytes;
-    struct search_pattern contentlength;
-    struct search_pattern boundary;
+    char header [HEADER_SIZE + 1];  // headers of the response or of the current part
+    int header_length;
+    int content_length;             // of the current part, -1 if the part has none
+    int overflow;                   // the current part does not fit into buffer
+    int has_timestamp;              // the current part has an X-Timestamp
+    struct timeval timestamp;       // of the current image
+    char boundary [BOUNDARY_SIZE];  // delimiter line between the parts, "--" included
 
     int * should_stop;
-    void (*on_image_received)(char * data, int length);
+    // gets the image and its capture time (the receive time if the upstream does not send it),
+    // it may exchange the buffer for another one of *capacity bytes
+    void (*on_image_received)(char ** data, int * capacity, int length, struct timeval timestamp);
         
 };
 
@@ -439,6 +439,7 @@ void *worker_thread(void *arg)
         in->buf = &jpeg_buffer[0];
         in->size = jpeg_buffer.size();
         
+        in->sequence++;
         /* signal fresh_frame */
         pthread_cond_broadcast(&in->db_update);
         pthread_mutex_unlock(&in->db);
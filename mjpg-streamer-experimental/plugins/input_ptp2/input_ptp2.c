@@ -264,6 +264,7 @@ void* capture(void* arg)
 						CAMERA_CHECK_GP(res, "gp_file_unref");
 						global->in[plugin_id].size = xsize;
 						DBG("Read %d bytes from camera.\n", global->in[plugin_id].size);
+						global->in[plugin_id].sequence++;
 						pthread_cond_broadcast(&global->in[plugin_id].db_update);
 						pthread_mutex_unlock(&global->in[plugin_id].db);
 						usleep(delay);
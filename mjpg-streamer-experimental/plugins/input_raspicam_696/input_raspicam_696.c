@@ -792,6 +792,7 @@ static void encoder_buffer_callback(MMAL_PORT_T *port,
 
             pData->offset = 0;
             ++pData->frame_no;
+            pglobal->in[plugin_number].sequence++;
             /* signal fresh_frame */
             pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
             pthread_mutex_unlock(&pglobal->in[plugin_number].db);
@@ -243,6 +243,7 @@ void *worker_thread(void *arg)
         pglobal->in[plugin_number].size = pics->sequence[i].size;
         memcpy(pglobal->in[plugin_number].buf, pics->sequence[i].data, pglobal->in[plugin_number].size);
 
+        pglobal->in[plugin_number].sequence++;
         /* signal fresh_frame */
         pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
         pthread_mutex_unlock(&pglobal->in[plugin_number].db);
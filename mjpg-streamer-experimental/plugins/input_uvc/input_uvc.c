@@ -706,6 +706,7 @@ void *cam_thread(void *arg)
 #endif
 
 
+        pglobal->in[pcontext->id].sequence++;
         /* signal fresh_frame */
         pthread_cond_broadcast(&pglobal->in[pcontext->id].db_update);
         pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
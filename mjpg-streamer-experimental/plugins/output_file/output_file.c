@@ -36,15 +36,19 @@
 #include <time.h>
 #include <syslog.h>
 #include <dirent.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #include "output_file.h"
+#include "../avi.h"
 
 #include "../../utils.h"
 #include "../../mjpg_streamer.h"
 
 #define OUTPUT_PLUGIN_NAME "FILE output plugin"
 
-static pthread_t worker;
+static pthread_t worker, writer, trigger;
 static globals *pglobal;
 static int fd, delay, ringbuffer_size = -1, ringbuffer_exceed = 0, max_frame_size;
 static char *folder = "/tmp";
@@ -52,6 +56,44 @@ static unsigned char *frame = NULL;
 static char *command = NULL;
 static int input_number = 0;
 static char *mjpgFileName = NULL;
+static int plugin_number = 0;
+
+/* segmented AVI recording, only the writer thread uses the open file */
+static char *aviPattern = NULL;
+static avi_file *avi = NULL;
+static char aviFileName[PATH_MAX], aviLastName[PATH_MAX];
+static int avi_counter = 0;
+static long long segment_size = SEGMENT_SIZE * 1024LL * 1024;
+static int segment_time = 0;
+
+/* frames between the worker and the writer thread, oldest first */
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_update = PTHREAD_COND_INITIALIZER;
+static queued_frame *queue_head = NULL, *queue_tail = NULL;
+static int queue_length = 0, queue_size = QUEUE_SIZE;
+static unsigned long dropped = 0;
+
+/* failed writes, the writer gives up only if no write can ever succeed */
+static unsigned long write_errors = 0;
+static int writer_stopped = 0;
+
+/*
+ * event mode: the last seconds of frames wait in RAM and only reach the
+ * queue when a trigger fires, recording goes on until record_until
+ * (monotonic microseconds, protected by queue_mutex)
+ */
+static int pre_event = 0, post_event = POST_EVENT, trigger_port = 0;
+static long long pre_event_memory = PRE_EVENT_MEMORY * 1024LL * 1024;
+static long long record_until = 0;
+
+/* the frames before the event, oldest first, only the worker thread uses it */
+static queued_frame *pre_head = NULL, *pre_tail = NULL;
+static long long pre_bytes = 0;
+static int pre_count = 0;
+
+/* the files of the ringbuffer, oldest first, only the writer thread uses it */
+static char **ring_names = NULL;
+static int ring_head = 0, ring_count = 0, ring_capacity = 0;
 
 /******************************************************************************
 Description.: print a help message
@@ -66,12 +108,23 @@ void help(void)
             " The following parameters can be passed to this plugin:\n\n" \
             " [-f | --folder ]........: folder to save pictures\n" \
             " [-m | --mjpeg ].........: save the frames to an mjpg file \n" \
+            " [-a | --avi ]...........: record seekable AVI files, the name is\n" \
+            "                           passed to strftime, e.g. cam_%%Y%%m%%d_%%H%%M%%S.avi\n" \
+            " [-ss | --segment_size ].: start a new AVI file after this many MB\n" \
+            " [-st | --segment_time ].: start a new AVI file after this many seconds\n" \
             " [-d | --delay ].........: delay after saving pictures in ms\n" \
             " [-i | --input ].........: read frames from the specified input plugin\n" \
+            " [-q | --queue ].........: frames that may wait to be written, if the\n" \
+            "                           storage is slower new frames are dropped\n" \
             " The following arguments are takes effect only if the current mode is not MJPG\n" \
             " [-s | --size ]..........: size of ring buffer (max number of pictures to hold)\n" \
             " [-e | --exceed ]........: allow ringbuffer to exceed limit by this amount\n" \
             " [-c | --command ].......: execute command after saving picture\n"\
+            " The following arguments enable the event mode, frames are only saved around a trigger\n" \
+            " [-pre | --pre_event ]...: seconds of frames kept in RAM before a trigger\n" \
+            " [-post | --post_event ].: seconds recorded after the last trigger\n" \
+            " [-mem | --pre_event_memory ]: MB of RAM for the frames before a trigger\n" \
+            " [-t | --trigger_port ]..: UDP port, any message triggers a recording\n" \
             " ---------------------------------------------------------------\n");
 }
 
@@ -84,9 +137,10 @@ void worker_cleanup(void *arg)
 {
     static unsigned char first_run = 1;
 
-    if (mjpgFileName != NULL) {
-        close(fd);
-    }
+    /* the writer thread drains the queue and closes the MJPG file on its own */
+    pthread_mutex_lock(&queue_mutex);
+    pthread_cond_signal(&queue_update);
+    pthread_mutex_unlock(&queue_mutex);
 
     if(!first_run) {
         DBG("already cleaned up resources\n");
@@ -99,7 +153,14 @@ void worker_cleanup(void *arg)
     if(frame != NULL) {
         free(frame);
     }
-    close(fd);
+
+    /* nothing happened, the frames before it are not needed */
+    while(pre_head != NULL) {
+        queued_frame *item = pre_head;
+        pre_head = pre_head->next;
+        free(item);
+    }
+    pre_tail = NULL;
 }
 
 /******************************************************************************
@@ -143,12 +204,76 @@ int check_for_filename(const struct dirent *entry)
 }
 
 /******************************************************************************
-Description.: delete oldest files, just keep "size" most recent files
-              This funtion MAY delete the wrong files if the time is not valid
+Description.: add a file to the ring index, the index grows if necessary
+Input Value.: path of the file
+Return Value: 0 on success, -1 if out of memory
+******************************************************************************/
+static int ring_append(const char *filename)
+{
+    char **names, *name;
+    int capacity, i;
+
+    if((name = strdup(filename)) == NULL)
+        return -1;
+
+    if(ring_count == ring_capacity) {
+        capacity = MAX(ring_capacity * 2, 64);
+        if((names = malloc(capacity * sizeof(char *))) == NULL) {
+            free(name);
+            return -1;
+        }
+
+        /* unroll the ring into the new array */
+        for(i = 0; i < ring_count; i++)
+            names[i] = ring_names[(ring_head + i) % ring_capacity];
+        free(ring_names);
+
+        ring_names = names;
+        ring_capacity = capacity;
+        ring_head = 0;
+    }
+
+    ring_names[(ring_head + ring_count) % ring_capacity] = name;
+    ring_count++;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: delete the oldest files of the ring index until "size" are left
 Input Value.: how many files to keep
 Return Value: -
 ******************************************************************************/
-void maintain_ringbuffer(int size)
+static void ring_trim(int size)
+{
+    char *name;
+
+    while(ring_count > size) {
+        name = ring_names[ring_head];
+        ring_head = (ring_head + 1) % ring_capacity;
+        ring_count--;
+
+        DBG("delete: %s\n", name);
+
+        /* somebody else may have deleted it already */
+        if(unlink(name) == -1 && errno != ENOENT) {
+            perror("could not delete file");
+        }
+
+        free(name);
+    }
+}
+
+/******************************************************************************
+Description.: build the ring index from the files a previous run left in the
+              folder, delete the oldest ones if there are too many.
+              This is the only time the folder gets scanned and sorted,
+              afterwards the index knows the order of the files.
+              This funtion MAY sort the files wrong if the time was not valid
+Input Value.: how many files to keep
+Return Value: -
+******************************************************************************/
+void load_ringbuffer(int size)
 {
     struct dirent **namelist;
     int n, i;
@@ -166,52 +291,567 @@ void maintain_ringbuffer(int size)
 
     DBG("found %d directory entries\n", n);
 
-    /* delete the first (thus oldest) number of files */
-    for(i = 0; i < (n - size); i++) {
-
+    for(i = 0; i < n; i++) {
         /* put together the folder name and the directory item */
         snprintf(buffer, sizeof(buffer), "%s/%s", folder, namelist[i]->d_name);
 
-        DBG("delete: %s\n", buffer);
-
-        /* mark item for deletion */
-        if(unlink(buffer) == -1) {
-            perror("could not delete file");
-        }
+        if(ring_append(buffer) != 0)
+            LOG("not enough memory, %s is not part of the ringbuffer\n", namelist[i]->d_name);
 
         /* free allocated memory for name */
         free(namelist[i]);
     }
 
-    /* keep the rest, but we still have to free every result */
-    for(i = MAX(n - size, 0); i < n; i++) {
-        DBG("keep: %s\n", namelist[i]->d_name);
-        free(namelist[i]);
-    }
-
     /* free last just allocated resources */
     free(namelist);
+
+    ring_trim(size);
+}
+
+/******************************************************************************
+Description.: add a new file to the ringbuffer and delete the oldest files,
+              just keep "size" most recent files. With --exceed the ring may
+              grow by that many files before it is trimmed.
+Input Value.: * filename: path of the file that was just written
+              * size....: how many files to keep
+Return Value: -
+******************************************************************************/
+void maintain_ringbuffer(const char *filename, int size)
+{
+    /* do nothing if ringbuffer is not set or wrong value is set */
+    if(size < 0) return;
+
+    if(ring_append(filename) != 0) {
+        LOG("not enough memory, %s is not part of the ringbuffer\n", filename);
+        return;
+    }
+
+    if(ring_count > size + MAX(ringbuffer_exceed, 0))
+        ring_trim(size);
+}
+
+/******************************************************************************
+Description.: write a single frame to its own file, run the command for it
+Input Value.: the queued frame
+Return Value: 0 if the file was written, -1 otherwise
+******************************************************************************/
+static int write_picture(queued_frame *item)
+{
+    char buffer[1024] = {0};
+    int rc, picture, error;
+    ssize_t written;
+
+    DBG("writing file: %s\n", item->filename);
+
+    /* open file for write */
+    if((picture = open(item->filename, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        DBG("could not open the file %s: %s\n", item->filename, strerror(errno));
+        return -1;
+    }
+
+    /* save picture to file, a short write means the disk is full */
+    if((written = write(picture, item->data, item->size)) != item->size) {
+        error = written < 0 ? errno : ENOSPC;
+        DBG("could not write to file %s: %s\n", item->filename, strerror(error));
+        close(picture);
+        unlink(item->filename);
+        errno = error;
+        return -1;
+    }
+
+    close(picture);
+
+    /* call the command if user specified one, pass current filename as argument */
+    if(command != NULL) {
+        snprintf(buffer, sizeof(buffer), "%s \"%s\"", command, item->filename);
+        DBG("calling command %s", buffer);
+
+        /* in addition provide the filename as environment variable */
+        if((rc = setenv("MJPG_FILE", item->filename, 1)) != 0) {
+            LOG("setenv failed (return value %d)\n", rc);
+        }
+
+        /* execute the command now */
+        if((rc = system(buffer)) != 0) {
+            LOG("command failed (return value %d)\n", rc);
+        }
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: append a batch of frames to the MJPG file with as few system
+              calls as possible
+Input Value.: the first frame of the batch, the list ends with NULL
+Return Value: 0 if all frames were written, -1 otherwise
+******************************************************************************/
+static int write_mjpeg(queued_frame *item)
+{
+    struct iovec iov[WRITE_BATCH];
+    ssize_t rc;
+    int count, i;
+
+    while(item != NULL) {
+        for(count = 0; item != NULL && count < WRITE_BATCH; item = item->next, count++) {
+            iov[count].iov_base = item->data;
+            iov[count].iov_len = item->size;
+        }
+
+        /* continue after partial writes */
+        for(i = 0; i < count;) {
+            if((rc = writev(fd, iov + i, count - i)) < 0) {
+                if(errno == EINTR)
+                    continue;
+                DBG("could not write to file %s: %s\n", mjpgFileName, strerror(errno));
+                return -1;
+            }
+
+            for(; i < count && (size_t)rc >= iov[i].iov_len; i++)
+                rc -= iov[i].iov_len;
+            if(i < count) {
+                iov[i].iov_base = (char *)iov[i].iov_base + rc;
+                iov[i].iov_len -= rc;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: read the monotonic clock, the post event window is measured
+              with it
+Input Value.: -
+Return Value: microseconds
+******************************************************************************/
+static long long monotonic_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/******************************************************************************
+Description.: finish the current AVI segment
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void close_segment(void)
+{
+    if(avi == NULL)
+        return;
+
+    DBG("closing %s with %lu frames\n", aviFileName, avi->frames);
+    if(avi_close(avi) != 0) {
+        OPRINT("could not complete the AVI segment\n");
+        perror(aviFileName);
+    }
+    avi = NULL;
+}
+
+/******************************************************************************
+Description.: start a new AVI segment, the name is taken from the capture time
+              of its first frame. If the pattern gives the name of the previous
+              segment again a counter is inserted in front of the extension.
+Input Value.: capture time of the first frame
+Return Value: 0 on success, -1 otherwise
+******************************************************************************/
+static int open_segment(struct timeval timestamp)
+{
+    char name[PATH_MAX], *extension;
+    time_t t = timestamp.tv_sec;
+    struct tm now;
+    int length;
+
+    if(localtime_r(&t, &now) == NULL || strftime(name, sizeof(name), aviPattern, &now) == 0) {
+        OPRINT("could not build the filename from %s\n", aviPattern);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* several segments within the resolution of the pattern */
+    if(strcmp(name, aviLastName) == 0) {
+        avi_counter++;
+        extension = strrchr(name, '.');
+        length = snprintf(aviFileName, sizeof(aviFileName), "%s/%.*s_%d%s", folder,
+                          extension != NULL ? (int)(extension - name) : (int)strlen(name), name,
+                          avi_counter, extension != NULL ? extension : "");
+    } else {
+        avi_counter = 0;
+        strcpy(aviLastName, name);
+        length = snprintf(aviFileName, sizeof(aviFileName), "%s/%s", folder, name);
+    }
+
+    if(length < 0 || length >= (int)sizeof(aviFileName)) {
+        OPRINT("the path of the AVI segment is too long\n");
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    DBG("opening %s\n", aviFileName);
+    if((avi = avi_open(aviFileName, segment_size)) == NULL) {
+        DBG("could not open the AVI segment %s: %s\n", aviFileName, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: add a batch of frames to the AVI segment, start a new one when
+              the current one reached its size or duration. After a failed
+              write the segment ends, the next frame starts a new one.
+Input Value.: the first frame of the batch, the list ends with NULL
+Return Value: 0 if all frames were written, -1 otherwise
+******************************************************************************/
+static int write_avi(queued_frame *item)
+{
+    long long timestamp, needed;
+    int error;
+
+    for(; item != NULL; item = item->next) {
+        if(avi != NULL) {
+            /* chunk of the frame, its index entry, its timestamp and the chunk headers */
+            needed = avi->size + 8 + item->size + 1 + 24 * (avi->frames + 1) + 16;
+            timestamp = (long long)item->timestamp.tv_sec * 1000000 + item->timestamp.tv_usec;
+
+            if(needed > segment_size ||
+               (segment_time > 0 && timestamp - avi->index[0].timestamp >= segment_time * 1000000LL))
+                close_segment();
+        }
+
+        if(avi == NULL && open_segment(item->timestamp) != 0)
+            return -1;
+
+        if(avi_write_frame(avi, item->data, item->size, item->timestamp) != 0) {
+            error = errno;
+            DBG("could not write to the AVI segment %s: %s\n", aviFileName, strerror(error));
+            close_segment();
+            errno = error;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: count a failed write and decide whether the writer can go on.
+              A full disk or an I/O error may go away, a read-only file
+              system or a bad file name do not.
+Input Value.: errno of the failure
+Return Value: 0 to go on with the next frames, -1 if no frame can be stored
+******************************************************************************/
+static int write_failed(int error)
+{
+    int fatal = error == EROFS || error == EBADF || error == EINVAL || error == ENAMETOOLONG;
+
+    pthread_mutex_lock(&queue_mutex);
+    /* the counter is shown as control of this plugin */
+    pglobal->out[plugin_number].out_parameters[4].value = ++write_errors;
+    if(fatal)
+        writer_stopped = 1;
+    pthread_mutex_unlock(&queue_mutex);
+
+    if(fatal) {
+        LOG("could not store the frames (%s), giving up\n", strerror(error));
+        return -1;
+    }
+
+    if(write_errors == 1 || write_errors % 100 == 0)
+        LOG("could not store a frame (%s), %lu write errors so far\n", strerror(error), write_errors);
+    return 0;
+}
+
+/******************************************************************************
+Description.: the writer thread takes all queued frames at once and stores
+              them, so a slow disk delays writing but never the capture.
+              Failed writes cost their frames, the writer goes on with the
+              next ones unless write_failed() gives up.
+Input Value.: unused
+Return Value: NULL
+******************************************************************************/
+void *writer_thread(void *arg)
+{
+    queued_frame *batch, *item;
+    struct timespec deadline;
+    int ok = 0;
+
+    while(ok >= 0) {
+        pthread_mutex_lock(&queue_mutex);
+        while(queue_head == NULL && !pglobal->stop) {
+            /* finish the file of an event as soon as its recording is over */
+            if(avi != NULL && pre_event > 0 && monotonic_now() >= record_until) {
+                pthread_mutex_unlock(&queue_mutex);
+                close_segment();
+                pthread_mutex_lock(&queue_mutex);
+                continue;
+            }
+
+            /* wake up now and then to notice the stop signal */
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&queue_update, &queue_mutex, &deadline);
+        }
+        batch = queue_head;
+        queue_head = queue_tail = NULL;
+        queue_length = 0;
+        pthread_mutex_unlock(&queue_mutex);
+
+        /* the queue is drained, stop now */
+        if(batch == NULL)
+            break;
+
+        if(mjpgFileName != NULL) {
+            if(write_mjpeg(batch) != 0)
+                ok = write_failed(errno);
+        } else if(aviPattern != NULL) {
+            if(write_avi(batch) != 0)
+                ok = write_failed(errno);
+        } else {
+            for(item = batch; item != NULL && ok >= 0; item = item->next) {
+                if(write_picture(item) == 0)
+                    maintain_ringbuffer(item->filename, ringbuffer_size);
+                else
+                    ok = write_failed(errno);
+            }
+        }
+
+        while(batch != NULL) {
+            item = batch;
+            batch = batch->next;
+            free(item);
+        }
+    }
+
+    /* the worker queues nothing after giving up, free what is left */
+    pthread_mutex_lock(&queue_mutex);
+    while(queue_head != NULL) {
+        item = queue_head;
+        queue_head = queue_head->next;
+        free(item);
+    }
+    queue_tail = NULL;
+    queue_length = 0;
+    pthread_mutex_unlock(&queue_mutex);
+
+    if(mjpgFileName != NULL) {
+        close(fd);
+    }
+
+    /* an unfinished segment would have neither index nor valid headers */
+    close_segment();
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: add a frame to the queue of the writer thread, if the queue is
+              full the frame is dropped and counted
+Input Value.: the frame, it is freed if it gets dropped
+Return Value: 0 if the frame was queued or dropped, -1 if the writer gave up
+******************************************************************************/
+static int queue_frame(queued_frame *item)
+{
+    pthread_mutex_lock(&queue_mutex);
+    if(writer_stopped) {
+        pthread_mutex_unlock(&queue_mutex);
+        free(item);
+        return -1;
+    }
+
+    if(queue_length >= queue_size) {
+        pthread_mutex_unlock(&queue_mutex);
+        free(item);
+
+        /* the counter is shown as control of this plugin */
+        pglobal->out[plugin_number].out_parameters[2].value = ++dropped;
+        if(dropped == 1 || dropped % 100 == 0)
+            LOG("storage is too slow, %lu frames dropped so far\n", dropped);
+        return 0;
+    }
+
+    item->next = NULL;
+    if(queue_tail != NULL)
+        queue_tail->next = item;
+    else
+        queue_head = item;
+    queue_tail = item;
+    queue_length++;
+    pthread_cond_signal(&queue_update);
+    pthread_mutex_unlock(&queue_mutex);
+    return 0;
+}
+
+/******************************************************************************
+Description.: start or extend the recording of an event, the frames before
+              it are flushed with the next captured frame
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void trigger_event(void)
+{
+    pthread_mutex_lock(&queue_mutex);
+    if(monotonic_now() >= record_until) {
+        DBG("event triggered, recording %d seconds\n", post_event);
+    }
+    record_until = monotonic_now() + post_event * 1000000LL;
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+/******************************************************************************
+Description.: hand all frames before the event to the writer thread at once.
+              They do not count against the queue size, so live frames are
+              not dropped while the writer stores them.
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void flush_pre_event(void)
+{
+    DBG("flushing %d frames (%lld bytes) from before the event\n", pre_count, pre_bytes);
+
+    pthread_mutex_lock(&queue_mutex);
+    /* the writer gave up, worker_cleanup() frees them */
+    if(writer_stopped) {
+        pthread_mutex_unlock(&queue_mutex);
+        return;
+    }
+    if(queue_tail != NULL)
+        queue_tail->next = pre_head;
+    else
+        queue_head = pre_head;
+    queue_tail = pre_tail;
+    pthread_cond_signal(&queue_update);
+    pthread_mutex_unlock(&queue_mutex);
+
+    pre_head = pre_tail = NULL;
+    pre_bytes = 0;
+    pre_count = 0;
+}
+
+/******************************************************************************
+Description.: event mode, queue the frame while an event is recorded or keep
+              it in RAM. The oldest frames are freed when they are older than
+              --pre_event seconds or when they exceed --pre_event_memory.
+Input Value.: the frame
+Return Value: 0 on success, -1 if the writer gave up
+******************************************************************************/
+static int event_frame(queued_frame *item)
+{
+    long long newest, oldest;
+    queued_frame *old;
+    int recording;
+
+    pthread_mutex_lock(&queue_mutex);
+    recording = monotonic_now() < record_until;
+    pthread_mutex_unlock(&queue_mutex);
+
+    if(recording) {
+        if(pre_head != NULL)
+            flush_pre_event();
+        return queue_frame(item);
+    }
+
+    item->next = NULL;
+    if(pre_tail != NULL)
+        pre_tail->next = item;
+    else
+        pre_head = item;
+    pre_tail = item;
+    pre_bytes += item->size;
+    pre_count++;
+
+    /* the age is taken from the capture times, they come from the same clock */
+    newest = (long long)item->timestamp.tv_sec * 1000000 + item->timestamp.tv_usec;
+    while(pre_head != item) {
+        oldest = (long long)pre_head->timestamp.tv_sec * 1000000 + pre_head->timestamp.tv_usec;
+        if(pre_bytes <= pre_event_memory && newest - oldest <= pre_event * 1000000LL)
+            break;
+
+        old = pre_head;
+        pre_head = old->next;
+        pre_bytes -= old->size;
+        pre_count--;
+        free(old);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: wait for UDP messages, each one triggers a recording. The
+              message is sent back as confirmation like output_udp does.
+Input Value.: unused
+Return Value: NULL
+******************************************************************************/
+void *trigger_thread(void *arg)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    struct pollfd pfd;
+    char message[1024];
+    ssize_t bytes;
+    int sd;
+
+    if((sd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket");
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(trigger_port);
+    if(bind(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("bind");
+        OPRINT("could not listen for triggers on UDP port %d\n", trigger_port);
+        close(sd);
+        return NULL;
+    }
+
+    pfd.fd = sd;
+    pfd.events = POLLIN;
+
+    while(!pglobal->stop) {
+        /* wake up now and then to notice the stop signal */
+        if(poll(&pfd, 1, 1000) <= 0)
+            continue;
+
+        addr_len = sizeof(addr);
+        if((bytes = recvfrom(sd, message, sizeof(message), 0, (struct sockaddr *)&addr, &addr_len)) < 0)
+            continue;
+
+        trigger_event();
+        sendto(sd, message, bytes, 0, (struct sockaddr *)&addr, addr_len);
+    }
+
+    close(sd);
+    return NULL;
 }
 
 /******************************************************************************
 Description.: this is the main worker thread
-              it loops forever, grabs a fresh frame and stores it to file
+              it loops forever, grabs a fresh frame and queues it for the
+              writer thread
 Input Value.:
 Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int ok = 1, frame_size = 0, rc = 0;
+    int frame_size = 0;
     char buffer1[1024] = {0}, buffer2[1024] = {0};
     unsigned long long counter = 0;
     time_t t;
     struct tm *now;
-    unsigned char *tmp_framebuffer = NULL;
+    queued_frame *item;
+    size_t name_size;
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
-    while(ok >= 0 && !pglobal->stop) {
+    while(!pglobal->stop) {
         DBG("waiting for fresh frame\n");
 
         pthread_mutex_lock(&pglobal->in[input_number].db);
@@ -220,108 +860,57 @@ void *worker_thread(void *arg)
         /* read buffer */
         frame_size = pglobal->in[input_number].size;
 
-        /* check if buffer for frame is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
-
-            max_frame_size = frame_size + (1 << 16);
-            if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                LOG("not enough memory\n");
-                return NULL;
-            }
-
-            frame = tmp_framebuffer;
-        }
-
-        /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-
-        /* allow others to access the global buffer again */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-
-        if (mjpgFileName == NULL) { // single files with ringbuffer mode
-            /* prepare filename */
-            memset(buffer1, 0, sizeof(buffer1));
-            memset(buffer2, 0, sizeof(buffer2));
-
-            /* get current time */
+        name_size = 0;
+        if (mjpgFileName == NULL && aviPattern == NULL) { // single files with ringbuffer mode
+            /* the name is taken from the time of the capture, not of the write */
             t = time(NULL);
             now = localtime(&t);
             if(now == NULL) {
+                pthread_mutex_unlock(&pglobal->in[input_number].db);
                 perror("localtime");
-                return NULL;
+                break;
             }
 
             /* prepare string, add time and date values */
             if(strftime(buffer1, sizeof(buffer1), "%%s/%Y_%m_%d_%H_%M_%S_picture_%%09llu.jpg", now) == 0) {
+                pthread_mutex_unlock(&pglobal->in[input_number].db);
                 OPRINT("strftime returned 0\n");
-                free(frame); frame = NULL;
-                return NULL;
+                break;
             }
 
             /* finish filename by adding the foldername and a counter value */
             snprintf(buffer2, sizeof(buffer2), buffer1, folder, counter);
-
             counter++;
+            name_size = strlen(buffer2) + 1;
+        }
 
-            DBG("writing file: %s\n", buffer2);
-
-            /* open file for write */
-            if((fd = open(buffer2, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-                OPRINT("could not open the file %s\n", buffer2);
-                return NULL;
-            }
-
-            /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
-                OPRINT("could not write to file %s\n", buffer2);
-                perror("write()");
-                close(fd);
-                return NULL;
-            }
-
-            close(fd);
-
-            /* call the command if user specified one, pass current filename as argument */
-            if(command != NULL) {
-                memset(buffer1, 0, sizeof(buffer1));
+        /* copy the frame for the writer, the name is stored behind it */
+        if((item = malloc(sizeof(queued_frame) + frame_size + name_size)) == NULL) {
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            LOG("not enough memory\n");
+            break;
+        }
+        item->data = (unsigned char *)(item + 1);
+        item->size = frame_size;
+        item->timestamp = pglobal->in[input_number].timestamp;
+        memcpy(item->data, pglobal->in[input_number].buf, frame_size);
 
-                /* buffer2 still contains the filename, pass it to the command as parameter */
-                snprintf(buffer1, sizeof(buffer1), "%s \"%s\"", command, buffer2);
-                DBG("calling command %s", buffer1);
+        /* allow others to access the global buffer again */
+        pthread_mutex_unlock(&pglobal->in[input_number].db);
 
-                /* in addition provide the filename as environment variable */
-                if((rc = setenv("MJPG_FILE", buffer2, 1)) != 0) {
-                    LOG("setenv failed (return value %d)\n", rc);
-                }
+        /* not all inputs set a timestamp, the pre-event buffer ages the frames by it */
+        if(!timerisset(&item->timestamp))
+            gettimeofday(&item->timestamp, NULL);
 
-                /* execute the command now */
-                if((rc = system(buffer1)) != 0) {
-                    LOG("command failed (return value %d)\n", rc);
-                }
-            }
+        item->filename = NULL;
+        if(name_size > 0) {
+            item->filename = (char *)item->data + frame_size;
+            memcpy(item->filename, buffer2, name_size);
+        }
 
-            /*
-             * maintain ringbuffer
-             * do not maintain ringbuffer for each picture, this saves resources since
-             * each run of the maintainance function involves sorting/malloc/free operations
-             */
-            if(ringbuffer_exceed <= 0) {
-                /* keep ringbuffer excactly at specified siOUTPUT_PLUGIN_NAMEze */
-                maintain_ringbuffer(ringbuffer_size);
-            } else if(counter == 1 || counter % (ringbuffer_exceed + 1) == 0) {
-                DBG("counter: %llu, will clean-up now\n", counter);
-                maintain_ringbuffer(ringbuffer_size);
-            }
-        } else { // recording to MJPG file
-            /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
-                OPRINT("could not write to file %s\n", buffer2);
-                perror("write()");
-                close(fd);
-                return NULL;
-            }
+        if((pre_event > 0 ? event_frame(item) : queue_frame(item)) != 0) {
+            OPRINT("stopped, the frames can not be stored\n");
+            break;
         }
 
         /* if specified, wait now */
@@ -348,6 +937,7 @@ int output_init(output_parameter *param, int id)
 	int i;
     delay = 0;
     pglobal = param->global;
+    plugin_number = id;
     pglobal->out[id].name = malloc((1+strlen(OUTPUT_PLUGIN_NAME))*sizeof(char));
     sprintf(pglobal->out[id].name, "%s", OUTPUT_PLUGIN_NAME);
     DBG("OUT plugin %d name: %s\n", id, pglobal->out[id].name);
@@ -378,6 +968,24 @@ int output_init(output_parameter *param, int id)
             {"input", required_argument, 0, 0},
             {"m", required_argument, 0, 0},
             {"mjpeg", required_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"queue", required_argument, 0, 0},
+            {"c", required_argument, 0, 0},
+            {"command", required_argument, 0, 0},
+            {"a", required_argument, 0, 0},
+            {"avi", required_argument, 0, 0},
+            {"ss", required_argument, 0, 0},
+            {"segment_size", required_argument, 0, 0},
+            {"st", required_argument, 0, 0},
+            {"segment_time", required_argument, 0, 0},
+            {"pre", required_argument, 0, 0},
+            {"pre_event", required_argument, 0, 0},
+            {"post", required_argument, 0, 0},
+            {"post_event", required_argument, 0, 0},
+            {"mem", required_argument, 0, 0},
+            {"pre_event_memory", required_argument, 0, 0},
+            {"t", required_argument, 0, 0},
+            {"trigger_port", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -443,6 +1051,60 @@ int output_init(output_parameter *param, int id)
             DBG("case 12,13\n");
             mjpgFileName = strdup(optarg);
             break;
+            /* q, queue */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            queue_size = MAX(atoi(optarg), 1);
+            break;
+            /* c, command */
+        case 16:
+        case 17:
+            DBG("case 16,17\n");
+            command = strdup(optarg);
+            break;
+            /* a, avi */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            aviPattern = strdup(optarg);
+            break;
+            /* ss, segment_size */
+        case 20:
+        case 21:
+            DBG("case 20,21\n");
+            segment_size = MIN(MAX(atoll(optarg), 1) * 1024 * 1024, AVI_MAX_SIZE);
+            break;
+            /* st, segment_time */
+        case 22:
+        case 23:
+            DBG("case 22,23\n");
+            segment_time = MAX(atoi(optarg), 0);
+            break;
+            /* pre, pre_event */
+        case 24:
+        case 25:
+            DBG("case 24,25\n");
+            pre_event = MAX(atoi(optarg), 0);
+            break;
+            /* post, post_event */
+        case 26:
+        case 27:
+            DBG("case 26,27\n");
+            post_event = MAX(atoi(optarg), 1);
+            break;
+            /* mem, pre_event_memory */
+        case 28:
+        case 29:
+            DBG("case 28,29\n");
+            pre_event_memory = MAX(atoll(optarg), 1) * 1024 * 1024;
+            break;
+            /* t, trigger_port */
+        case 30:
+        case 31:
+            DBG("case 30,31\n");
+            trigger_port = atoi(optarg);
+            break;
         }
     }
 
@@ -454,7 +1116,18 @@ int output_init(output_parameter *param, int id)
     OPRINT("output folder.....: %s\n", folder);
     OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
     OPRINT("delay after save..: %d\n", delay);
-    if  (mjpgFileName == NULL) {
+    OPRINT("queued frames.....: %d\n", queue_size);
+    if(mjpgFileName != NULL && aviPattern != NULL) {
+        OPRINT("ERROR: --mjpeg and --avi can not be used together\n");
+        return 1;
+    }
+    if(aviPattern != NULL) {
+        OPRINT("output files......: %s/%s\n", folder, aviPattern);
+        OPRINT("segment size......: %lld MB\n", segment_size / (1024 * 1024));
+        if(segment_time > 0) {
+            OPRINT("segment duration..: %d s\n", segment_time);
+        }
+    } else if  (mjpgFileName == NULL) {
         if(ringbuffer_size > 0) {
             OPRINT("ringbuffer size...: %d to %d\n", ringbuffer_size, ringbuffer_size + ringbuffer_exceed);
         } else {
@@ -473,9 +1146,20 @@ int output_init(output_parameter *param, int id)
         free(fnBuffer);
     }
 
-    param->global->out[id].parametercount = 2;
+    if(pre_event > 0) {
+        OPRINT("before event......: %d s, at most %lld MB\n", pre_event, pre_event_memory / (1024 * 1024));
+        OPRINT("after event.......: %d s\n", post_event);
+        if(trigger_port > 0) {
+            OPRINT("trigger UDP port..: %d\n", trigger_port);
+        }
+    } else if(trigger_port > 0) {
+        OPRINT("ERROR: --trigger_port needs --pre_event\n");
+        return 1;
+    }
 
-    param->global->out[id].out_parameters = (control*) calloc(2, sizeof(control));
+    param->global->out[id].parametercount = 5;
+
+    param->global->out[id].out_parameters = (control*) calloc(5, sizeof(control));
 
     control take_ctrl;
 	take_ctrl.group = IN_CMD_GENERIC;
@@ -509,12 +1193,66 @@ int output_init(output_parameter *param, int id)
 
 	param->global->out[id].out_parameters[1] = filename_ctrl;
 
+    control dropped_ctrl;
+	memset(&dropped_ctrl, 0, sizeof(dropped_ctrl));
+	dropped_ctrl.group = IN_CMD_GENERIC;
+	dropped_ctrl.menuitems = NULL;
+	dropped_ctrl.value = 0;
+	dropped_ctrl.class_id = 0;
+
+	dropped_ctrl.ctrl.id = OUT_FILE_CMD_DROPPED;
+	dropped_ctrl.ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+	dropped_ctrl.ctrl.flags = V4L2_CTRL_FLAG_READ_ONLY;
+	strcpy((char*) dropped_ctrl.ctrl.name, "Dropped frames");
+	dropped_ctrl.ctrl.minimum = 0;
+	dropped_ctrl.ctrl.maximum = INT_MAX;
+	dropped_ctrl.ctrl.step = 1;
+	dropped_ctrl.ctrl.default_value = 0;
+
+	param->global->out[id].out_parameters[2] = dropped_ctrl;
+
+    control trigger_ctrl;
+	memset(&trigger_ctrl, 0, sizeof(trigger_ctrl));
+	trigger_ctrl.group = IN_CMD_GENERIC;
+	trigger_ctrl.menuitems = NULL;
+	trigger_ctrl.value = 0;
+	trigger_ctrl.class_id = 0;
+
+	trigger_ctrl.ctrl.id = OUT_FILE_CMD_TRIGGER;
+	trigger_ctrl.ctrl.type = V4L2_CTRL_TYPE_BUTTON;
+	strcpy((char*) trigger_ctrl.ctrl.name, "Trigger recording");
+	trigger_ctrl.ctrl.minimum = 0;
+	trigger_ctrl.ctrl.maximum = 1;
+	trigger_ctrl.ctrl.step = 1;
+	trigger_ctrl.ctrl.default_value = 0;
+
+	param->global->out[id].out_parameters[3] = trigger_ctrl;
+
+    control errors_ctrl;
+	memset(&errors_ctrl, 0, sizeof(errors_ctrl));
+	errors_ctrl.group = IN_CMD_GENERIC;
+	errors_ctrl.menuitems = NULL;
+	errors_ctrl.value = 0;
+	errors_ctrl.class_id = 0;
+
+	errors_ctrl.ctrl.id = OUT_FILE_CMD_ERRORS;
+	errors_ctrl.ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+	errors_ctrl.ctrl.flags = V4L2_CTRL_FLAG_READ_ONLY;
+	strcpy((char*) errors_ctrl.ctrl.name, "Write errors");
+	errors_ctrl.ctrl.minimum = 0;
+	errors_ctrl.ctrl.maximum = INT_MAX;
+	errors_ctrl.ctrl.step = 1;
+	errors_ctrl.ctrl.default_value = 0;
+
+	param->global->out[id].out_parameters[4] = errors_ctrl;
+
 
     return 0;
 }
 
 /******************************************************************************
-Description.: calling this function stops the worker thread
+Description.: calling this function stops the worker thread and waits
+              for the writer thread to store the queued frames
 Input Value.: -
 Return Value: always 0
 ******************************************************************************/
@@ -522,6 +1260,15 @@ int output_stop(int id)
 {
     DBG("will cancel worker thread\n");
     pthread_cancel(worker);
+
+    if(trigger_port > 0 && pre_event > 0)
+        pthread_join(trigger, NULL);
+
+    /* wait until the writer stored the queue and finished the AVI segment */
+    pthread_mutex_lock(&queue_mutex);
+    pthread_cond_signal(&queue_update);
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_join(writer, NULL);
     return 0;
 }
 
@@ -532,9 +1279,16 @@ Return Value: always 0
 ******************************************************************************/
 int output_run(int id)
 {
-    DBG("launching worker thread\n");
+    /* pick up the files of a previous run */
+    if(mjpgFileName == NULL && aviPattern == NULL)
+        load_ringbuffer(ringbuffer_size);
+
+    DBG("launching worker and writer thread\n");
+    pthread_create(&writer, 0, writer_thread, NULL);
     pthread_create(&worker, 0, worker_thread, NULL);
     pthread_detach(worker);
+    if(trigger_port > 0 && pre_event > 0)
+        pthread_create(&trigger, 0, trigger_thread, NULL);
     return 0;
 }
 
@@ -607,6 +1361,18 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                 DBG("Not yet implemented\n");
                                 return -1;
                             } break;
+                            case OUT_FILE_CMD_TRIGGER: {
+                                if(pre_event <= 0) {
+                                    DBG("Not in event mode\n");
+                                    return -1;
+                                }
+                                trigger_event();
+                            } break;
+                            case OUT_FILE_CMD_DROPPED:
+                            case OUT_FILE_CMD_ERRORS: {
+                                DBG("%s is read-only\n", pglobal->out[plugin_id].out_parameters[i].ctrl.name);
+                                return -1;
+                            } break;
                             default: {
                                 DBG("Unknown command\n");
                                 return -1;
@@ -1,7 +1,37 @@
 #ifndef OUTPUT_FILE_H
 #define OUTPUT_FILE_H
 
+#include <sys/time.h>
+
 #define OUT_FILE_CMD_TAKE           1
 #define OUT_FILE_CMD_FILENAME       2
+#define OUT_FILE_CMD_DROPPED        3
+#define OUT_FILE_CMD_TRIGGER        4
+#define OUT_FILE_CMD_ERRORS         5
+
+/* default number of frames that may wait for the writer thread */
+#define QUEUE_SIZE 16
+
+/* frames appended to the MJPG file with one writev() */
+#define WRITE_BATCH 64
+
+/* default limit of an AVI segment in MB, --segment_size */
+#define SEGMENT_SIZE 1024
+
+/* defaults of the event mode: seconds recorded after a trigger, MB of RAM for the frames before it */
+#define POST_EVENT 10
+#define PRE_EVENT_MEMORY 32
+
+/*
+ * a captured frame waiting to be written, the filename (single file mode)
+ * and the JPEG data are stored behind the structure
+ */
+typedef struct _queued_frame {
+    struct _queued_frame *next;
+    char *filename;
+    unsigned char *data;
+    int size;
+    struct timeval timestamp;   /* capture time, used for AVI files */
+} queued_frame;
 
 #endif
@@ -0,0 +1,429 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Events for the text/event-stream (Server-Sent Events) endpoint.
+
+  Every event is formatted exactly once into a ring buffer that is shared by
+  all subscribers. A monitor thread per input plugin publishes the metadata
+  of each frame, the HTTP command handler publishes control changes.
+  Subscribers remember the id of the last event they have sent and only copy
+  the already formatted bytes, a subscriber that falls behind by more than
+  EVENT_RING events misses the oldest ones.
+
+  While clients wait for frames, the monitors also keep copies of the last
+  FRAME_RING frames of their input with the same sequence numbers as the
+  frame events. Each client remembers the sequence number of the last frame
+  it got and takes a reference to the following copy, so it gets every
+  frame exactly once unless it falls more than FRAME_RING frames behind.
+  The copying stops FRAME_LINGER seconds after the last client waited.
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "events.h"
+
+static globals *pglobal;
+
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t events_update = PTHREAD_COND_INITIALIZER;
+
+/* the formatted events, event number n is stored at ring[n % EVENT_RING] */
+static struct {
+    int length;
+    char data[EVENT_SIZE];
+} ring[EVENT_RING];
+
+/* number of the next event, ids start at 1 */
+static unsigned long next_event = 1;
+
+/* 0 before events_start(), 1 while the monitors run, -1 after events_stop() */
+static int monitors_started = 0;
+static pthread_t monitors[MAX_INPUT_PLUGINS];
+static int monitor_running[MAX_INPUT_PLUGINS];
+
+static pthread_mutex_t frames_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frames_update = PTHREAD_COND_INITIALIZER;
+
+/* the last frames of each input, frame n is stored at ring[n % FRAME_RING] */
+static shared_frame *frame_ring[MAX_INPUT_PLUGINS][FRAME_RING];
+static unsigned long sequences[MAX_INPUT_PLUGINS];
+
+/* frames are copied while clients wait and for FRAME_LINGER seconds after */
+static int frame_waiters[MAX_INPUT_PLUGINS];
+static time_t frames_wanted_until[MAX_INPUT_PLUGINS];
+
+/******************************************************************************
+Description.: copy the current frame of an input, the db mutex must be held
+Input Value.: * input_number: number of the input plugin
+              * sequence....: sequence number of the frame
+Return Value: the copy with one reference or NULL if out of memory
+******************************************************************************/
+static shared_frame *copy_frame(int input_number, unsigned long sequence)
+{
+    shared_frame *frame;
+    int size = pglobal->in[input_number].size;
+
+    if((frame = malloc(sizeof(shared_frame) + size)) == NULL)
+        return NULL;
+
+    frame->references = 1;
+    frame->sequence = sequence;
+    frame->timestamp = pglobal->in[input_number].timestamp;
+    frame->size = size;
+    memcpy(frame->data, pglobal->in[input_number].buf, size);
+
+    return frame;
+}
+
+/******************************************************************************
+Description.: check if clients wait for the frames of an input
+Input Value.: input_number: number of the input plugin
+Return Value: 1 if the frames have to be copied, 0 otherwise
+******************************************************************************/
+static int frames_wanted(int input_number)
+{
+    struct timespec now;
+    int wanted;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&frames_lock);
+    wanted = frame_waiters[input_number] > 0 || now.tv_sec < frames_wanted_until[input_number];
+    pthread_mutex_unlock(&frames_lock);
+
+    return wanted;
+}
+
+/******************************************************************************
+Description.: wait for the frames of one input plugin and publish their metadata
+              The sequence numbers are the ones of the input plugin, if the
+              monitor was too slow for some frames they are counted as skipped.
+Input Value.: arg is the number of the input plugin
+Return Value: NULL
+******************************************************************************/
+static void *monitor_thread(void *arg)
+{
+    int input_number = (int)(long)arg;
+    unsigned long sequence, skipped;
+    struct timeval timestamp, now, previous = {0, 0};
+    shared_frame *frame, *old;
+    long interval;
+    int size;
+
+    pthread_mutex_lock(&pglobal->in[input_number].db);
+    sequence = pglobal->in[input_number].sequence;
+    pthread_mutex_unlock(&pglobal->in[input_number].db);
+
+    while(!pglobal->stop) {
+        pthread_mutex_lock(&pglobal->in[input_number].db);
+        while(pglobal->in[input_number].sequence == sequence && !pglobal->stop)
+            pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+        if(pglobal->stop) {
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            break;
+        }
+        skipped = pglobal->in[input_number].sequence - sequence - 1;
+        sequence = pglobal->in[input_number].sequence;
+        size = pglobal->in[input_number].size;
+        timestamp = pglobal->in[input_number].timestamp;
+        frame = frames_wanted(input_number) ? copy_frame(input_number, sequence) : NULL;
+        pthread_mutex_unlock(&pglobal->in[input_number].db);
+
+        pthread_mutex_lock(&frames_lock);
+        old = frame_ring[input_number][sequence % FRAME_RING];
+        frame_ring[input_number][sequence % FRAME_RING] = frame;
+        sequences[input_number] = sequence;
+        pthread_cond_broadcast(&frames_update);
+        pthread_mutex_unlock(&frames_lock);
+        frames_release(old);
+
+        gettimeofday(&now, NULL);
+        interval = (previous.tv_sec == 0) ? 0 :
+                   (now.tv_sec - previous.tv_sec) * 1000L + (now.tv_usec - previous.tv_usec) / 1000;
+        previous = now;
+
+        events_publish("frame",
+                       "{\"input\": %d, \"sequence\": %lu, \"skipped\": %lu, \"size\": %d, "
+                       "\"timestamp\": %d.%06d, \"interval\": %ld}",
+                       input_number, sequence, skipped, size,
+                       (int)timestamp.tv_sec, (int)timestamp.tv_usec, interval);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: start the frame monitors, only the first call does something
+Input Value.: global is the global context of mjpg-streamer
+Return Value: -
+******************************************************************************/
+void events_start(globals *global)
+{
+    int i;
+
+    pthread_mutex_lock(&events_lock);
+    if(monitors_started == 0) {
+        pglobal = global;
+        for(i = 0; i < pglobal->incnt; i++) {
+            monitor_running[i] = (pthread_create(&monitors[i], NULL, monitor_thread, (void *)(long)i) == 0);
+            if(!monitor_running[i])
+                LOG("could not start the event monitor of input %d\n", i);
+        }
+        monitors_started = 1;
+    }
+    pthread_mutex_unlock(&events_lock);
+}
+
+/******************************************************************************
+Description.: wake up the frame monitors and wait until they have finished,
+              the inputs must not be destroyed before. pglobal->stop has to
+              be set already, only the first call does something.
+Input Value.: -
+Return Value: -
+******************************************************************************/
+void events_stop(void)
+{
+    int i, started;
+
+    pthread_mutex_lock(&events_lock);
+    started = (monitors_started == 1);
+    if(monitors_started == 1)
+        monitors_started = -1;
+    pthread_mutex_unlock(&events_lock);
+
+    if(!started)
+        return;
+
+    for(i = 0; i < pglobal->incnt; i++) {
+        if(!monitor_running[i])
+            continue;
+        pthread_mutex_lock(&pglobal->in[i].db);
+        pthread_cond_broadcast(&pglobal->in[i].db_update);
+        pthread_mutex_unlock(&pglobal->in[i].db);
+        pthread_join(monitors[i], NULL);
+    }
+}
+
+/******************************************************************************
+Description.: format an event once and wake up all subscribers
+Input Value.: * name...: the event type
+              * format.: printf format of the JSON data, must be a single line
+Return Value: -
+******************************************************************************/
+void events_publish(const char *name, const char *format, ...)
+{
+    char data[EVENT_SIZE];
+    va_list ap;
+    int slot;
+
+    va_start(ap, format);
+    vsnprintf(data, sizeof(data), format, ap);
+    va_end(ap);
+
+    pthread_mutex_lock(&events_lock);
+    slot = next_event % EVENT_RING;
+    ring[slot].length = snprintf(ring[slot].data, EVENT_SIZE,
+                                 "id: %lu\nevent: %s\ndata: %s\n\n", next_event, name, data);
+    if(ring[slot].length >= EVENT_SIZE) {
+        /* keep the event well-formed even if the data got truncated */
+        ring[slot].length = EVENT_SIZE - 1;
+        ring[slot].data[EVENT_SIZE - 3] = '\n';
+        ring[slot].data[EVENT_SIZE - 2] = '\n';
+    }
+    next_event++;
+    pthread_cond_broadcast(&events_update);
+    pthread_mutex_unlock(&events_lock);
+}
+
+/******************************************************************************
+Description.: id of the most recent event, new subscribers start after it
+Input Value.: -
+Return Value: event id
+******************************************************************************/
+unsigned long events_current(void)
+{
+    unsigned long current;
+
+    pthread_mutex_lock(&events_lock);
+    current = next_event - 1;
+    pthread_mutex_unlock(&events_lock);
+
+    return current;
+}
+
+/******************************************************************************
+Description.: wait for events newer than "last" and copy them to buffer
+Input Value.: * last...: id of the last event the caller has, gets updated
+              * buffer.: where to copy the formatted events to
+              * size...: size of the buffer, should hold EVENT_RING events
+              * timeout: seconds to wait for a new event
+Return Value: number of bytes copied, 0 on timeout
+******************************************************************************/
+int events_wait(unsigned long *last, char *buffer, size_t size, int timeout)
+{
+    struct timespec deadline;
+    size_t length = 0;
+    int slot;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    pthread_mutex_lock(&events_lock);
+    while(*last + 1 >= next_event) {
+        if(pthread_cond_timedwait(&events_update, &events_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    /* the oldest events got overwritten already */
+    if(next_event - *last - 1 > EVENT_RING)
+        *last = next_event - EVENT_RING - 1;
+
+    while(*last + 1 < next_event) {
+        slot = (*last + 1) % EVENT_RING;
+        if(length + ring[slot].length > size)
+            break;
+        memcpy(buffer + length, ring[slot].data, ring[slot].length);
+        length += ring[slot].length;
+        (*last)++;
+    }
+    pthread_mutex_unlock(&events_lock);
+
+    return (int)length;
+}
+
+/******************************************************************************
+Description.: sequence number of the latest frame of an input
+Input Value.: input_number: number of the input plugin
+Return Value: sequence number, 0 if there was no frame yet
+******************************************************************************/
+unsigned long frames_current(int input_number)
+{
+    unsigned long sequence;
+
+    pthread_mutex_lock(&frames_lock);
+    sequence = sequences[input_number];
+    pthread_mutex_unlock(&frames_lock);
+
+    return sequence;
+}
+
+/******************************************************************************
+Description.: find the oldest buffered frame with a sequence number larger
+              than "after", frames_lock must be held
+Input Value.: * input_number: number of the input plugin
+              * after.......: sequence number of the last frame the client has
+Return Value: the frame or NULL if there is none
+******************************************************************************/
+static shared_frame *next_frame(int input_number, unsigned long after)
+{
+    unsigned long sequence = after + 1, last = sequences[input_number];
+    shared_frame *frame;
+
+    /* the client fell behind, older frames got overwritten already */
+    if(last >= FRAME_RING && sequence <= last - FRAME_RING)
+        sequence = last - FRAME_RING + 1;
+
+    for(; sequence <= last; sequence++) {
+        /* frames that came while nobody waited were not copied */
+        frame = frame_ring[input_number][sequence % FRAME_RING];
+        if(frame != NULL && frame->sequence == sequence)
+            return frame;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: wait for the frame that follows "after". Clients that pass the
+              sequence number of the last frame they got receive every frame
+              once, unless they fall more than FRAME_RING frames behind.
+              "after" 0 stands for the latest frame and if "after" lies in the
+              future (e.g. the server was restarted) the next frame is
+              returned. events_start() has to be called before.
+Input Value.: * input_number: number of the input plugin
+              * after.......: sequence number of the last frame the client has
+              * timeout.....: seconds to wait
+Return Value: a reference to the frame that has to be released with
+              frames_release(), NULL on timeout
+******************************************************************************/
+shared_frame *frames_wait(int input_number, unsigned long after, int timeout)
+{
+    struct timespec deadline, now;
+    shared_frame *frame;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    pthread_mutex_lock(&frames_lock);
+    frame_waiters[input_number]++;
+    if(after == 0 && sequences[input_number] > 0)
+        after = sequences[input_number] - 1;
+    if(after > sequences[input_number])
+        after = sequences[input_number];
+
+    while((frame = next_frame(input_number, after)) == NULL) {
+        if(pthread_cond_timedwait(&frames_update, &frames_lock, &deadline) == ETIMEDOUT)
+            break;
+        if(pglobal->stop)
+            break;
+    }
+
+    if(frame != NULL)
+        frame->references++;
+
+    /* keep copying while the client sends this frame and asks for the next */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    frame_waiters[input_number]--;
+    frames_wanted_until[input_number] = now.tv_sec + FRAME_LINGER;
+    pthread_mutex_unlock(&frames_lock);
+
+    return frame;
+}
+
+/******************************************************************************
+Description.: drop a reference to a frame returned by frames_wait()
+Input Value.: frame, may be NULL
+Return Value: -
+******************************************************************************/
+void frames_release(shared_frame *frame)
+{
+    int last;
+
+    if(frame == NULL)
+        return;
+
+    pthread_mutex_lock(&frames_lock);
+    last = (--frame->references == 0);
+    pthread_mutex_unlock(&frames_lock);
+
+    if(last)
+        free(frame);
+}
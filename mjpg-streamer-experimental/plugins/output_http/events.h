@@ -0,0 +1,63 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <sys/time.h>
+
+#include "../../mjpg_streamer.h"
+
+/* number of events kept for subscribers that are behind */
+#define EVENT_RING 64
+
+/* maximum size of one formatted event including "id:", "event:" and "data:" */
+#define EVENT_SIZE 512
+
+/* number of frames kept per input for clients that are behind */
+#define FRAME_RING 8
+
+/* seconds the frames are still copied after the last client waited for one */
+#define FRAME_LINGER 2
+
+/*
+ * a copy of a frame shared by the clients that wait for it,
+ * the last reference frees it
+ */
+typedef struct {
+    int references;
+    unsigned long sequence;
+    struct timeval timestamp;
+    int size;
+    unsigned char data[];
+} shared_frame;
+
+void events_start(globals *global);
+void events_stop(void);
+void events_publish(const char *name, const char *format, ...);
+unsigned long events_current(void);
+int events_wait(unsigned long *last, char *buffer, size_t size, int timeout);
+unsigned long frames_current(int input_number);
+shared_frame *frames_wait(int input_number, unsigned long after, int timeout);
+void frames_release(shared_frame *frame);
+
+#endif
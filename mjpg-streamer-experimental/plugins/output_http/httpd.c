@@ -36,6 +36,8 @@
 #include <netdb.h>
 #include <errno.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdarg.h>
 
 #include <linux/version.h>
 #include <linux/types.h>          /* for videodev2.h */
@@ -45,6 +47,8 @@
 #include "../../utils.h"
 
 #include "httpd.h"
+#include "websocket.h"
+#include "events.h"
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
 #define V4L2_CTRL_TYPE_STRING_SUPPORTED
@@ -55,6 +59,7 @@
 
 static globals *pglobal;
 extern context servers[MAX_OUTPUT_PLUGINS];
+client_table client_infos = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 int piggy_fine = 2; // FIXME make it command line parameter
 
 /******************************************************************************
@@ -64,8 +69,9 @@ Return Value: iobuf
 ******************************************************************************/
 void init_iobuffer(iobuffer *iobuf)
 {
-    memset(iobuf->buffer, 0, sizeof(iobuf->buffer));
+    iobuf->buffer[0] = '\0';
     iobuf->level = 0;
+    iobuf->scanned = 0;
 }
 
 /******************************************************************************
@@ -75,125 +81,261 @@ Return Value: req
 ******************************************************************************/
 void init_request(request *req)
 {
-    req->type        = A_UNKNOWN;
-    req->parameter   = NULL;
-    req->client      = NULL;
-    req->credentials = NULL;
+    req->type            = A_UNKNOWN;
+    req->input_number    = 0;
+    req->numbered        = 0;
+    req->path_input      = -1;
+    req->method          = NULL;
+    req->path            = NULL;
+    req->version         = NULL;
+    req->parameter       = NULL;
+    req->client          = NULL;
+    req->credentials     = NULL;
+    req->query_string    = NULL;
+    req->encoding        = NULL;
+    req->accept_encoding = 0;
+    req->upgrade         = NULL;
+    req->websocket_key   = NULL;
+    req->last_event_id   = NULL;
+    req->connection      = NULL;
 }
 
 /******************************************************************************
-Description.: If strings were assigned to the different members free them
-              This will fail if strings are static, so always use strdup().
-Input Value.: req: pointer to request structure
+Description.: write to the client, through TLS if the connection uses it.
+              Partial writes are continued, so either all bytes get sent or
+              an error is returned.
+Input Value.: * context_fd: the client connection
+              * buffer....: data to send
+              * length....: number of bytes to send
+Return Value: length or -1 in case of an error
+******************************************************************************/
+ssize_t http_write(cfd *context_fd, const void *buffer, size_t length)
+{
+    const char *data = buffer;
+    size_t sent = 0;
+    ssize_t rc;
+
+    while(sent < length) {
+        #ifdef USE_OPENSSL
+        if(context_fd->ssl != NULL)
+            rc = SSL_write(context_fd->ssl, data + sent, MIN(length - sent, INT_MAX));
+        else
+        #endif
+            rc = write(context_fd->fd, data + sent, length - sent);
+
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return -1;
+        sent += rc;
+    }
+
+    return sent;
+}
+
+/******************************************************************************
+Description.: read from the client, through TLS if the connection uses it
+Input Value.: * context_fd: the client connection
+              * buffer....: where to store the data
+              * length....: size of the buffer
+Return Value: number of bytes read, 0 if the connection was closed, -1 on error
+******************************************************************************/
+ssize_t http_read(cfd *context_fd, void *buffer, size_t length)
+{
+    #ifdef USE_OPENSSL
+    if(context_fd->ssl != NULL)
+        return SSL_read(context_fd->ssl, buffer, MIN(length, INT_MAX));
+    #endif
+
+    return read(context_fd->fd, buffer, length);
+}
+
+/******************************************************************************
+Description.: TLS reads whole records, bytes of a record that were not
+              requested yet wait inside OpenSSL and select() does not
+              report them
+Input Value.: context_fd is the client connection
+Return Value: number of bytes that can be read without blocking
+******************************************************************************/
+int http_pending(cfd *context_fd)
+{
+    #ifdef USE_OPENSSL
+    if(context_fd->ssl != NULL)
+        return SSL_pending(context_fd->ssl);
+    #endif
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: close the connection to the client, a TLS connection gets a
+              close_notify first
+Input Value.: context_fd is the client connection
 Return Value: -
 ******************************************************************************/
-void free_request(request *req)
+void http_close(cfd *context_fd)
 {
-    if(req->parameter != NULL) free(req->parameter);
-    if(req->client != NULL) free(req->client);
-    if(req->credentials != NULL) free(req->credentials);
-    if(req->query_string != NULL) free(req->query_string);
+    #ifdef USE_OPENSSL
+    if(context_fd->ssl != NULL) {
+        SSL_shutdown(context_fd->ssl);
+        SSL_free(context_fd->ssl);
+        context_fd->ssl = NULL;
+    }
+    #endif
+
+    release_client(context_fd->client);
+    context_fd->client = NULL;
+
+    close(context_fd->fd);
 }
 
+#ifdef USE_OPENSSL
 /******************************************************************************
-Description.: read with timeout, implemented without using signals
-              tries to read len bytes and returns if enough bytes were read
-              or the timeout was triggered. In case of timeout the return
-              value may differ from the requested bytes "len".
-Input Value.: * fd.....: fildescriptor to read from
-              * iobuf..: iobuffer that allows to use this functions from multiple
-                         threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
+Description.: create the TLS context of a server instance. Session tickets
+              let returning clients skip the full handshake. If OpenSSL and
+              the kernel support it, the record encryption is offloaded to
+              the kernel (kTLS) after the handshake, so frames and files are
+              written to the socket without another copy in user space.
+Input Value.: * certificate: PEM file with the certificate (chain)
+              * key........: PEM file with the private key
+Return Value: the context or NULL in case of an error
 ******************************************************************************/
-int _read(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
+SSL_CTX *tls_context(const char *certificate, const char *key)
 {
-    int copied = 0, rc, i;
-    fd_set fds;
-    struct timeval tv;
+    static const unsigned char session_id_context[] = "mjpg-streamer";
+    SSL_CTX *ctx;
 
-    memset(buffer, 0, len);
+    if((ctx = SSL_CTX_new(TLS_server_method())) == NULL)
+        return NULL;
 
-    while((copied < len)) {
-        i = MIN(iobuf->level, len - copied);
-        memcpy(buffer + copied, iobuf->buffer + IO_BUFFER - iobuf->level, i);
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+    #ifdef USE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    #endif
 
-        iobuf->level -= i;
-        copied += i;
-        if(copied >= len)
-            return copied;
+    /* resumption with tickets, the ticket keys are created per process */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_timeout(ctx, 3600);
+
+    if(SSL_CTX_use_certificate_chain_file(ctx, certificate) != 1 ||
+       SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+       SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
 
-        /* select will return in case of timeout or new data arrived */
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        if((rc = select(fd + 1, &fds, NULL, NULL, &tv)) <= 0) {
-            if(rc < 0)
-                exit(EXIT_FAILURE);
+    return ctx;
+}
 
-            /* this must be a timeout */
-            return copied;
-        }
+/******************************************************************************
+Description.: perform the TLS handshake with a client that just connected
+Input Value.: * context_fd: the client connection, ssl gets set
+              * timeout...: seconds the client may take for the handshake
+Return Value: 0 if the handshake succeeded, -1 otherwise
+******************************************************************************/
+int tls_accept(cfd *context_fd, int timeout)
+{
+    struct timeval tv = {timeout, 0};
 
-        init_iobuffer(iobuf);
+    if((context_fd->ssl = SSL_new(context_fd->pc->ssl_ctx)) == NULL)
+        return -1;
 
-        /*
-         * there should be at least one byte, because select signalled it.
-         * But: It may happen (very seldomly), that the socket gets closed remotly between
-         * the select() and the following read. That is the reason for not relying
-         * on reading at least one byte.
-         */
-        if((iobuf->level = read(fd, &iobuf->buffer, IO_BUFFER)) <= 0) {
-            /* an error occured */
-            return -1;
-        }
+    /* blocking socket, a silent client must not keep this thread forever */
+    setsockopt(context_fd->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-        /* align data to the end of the buffer if less than IO_BUFFER bytes were read */
-        memmove(iobuf->buffer + (IO_BUFFER - iobuf->level), iobuf->buffer, iobuf->level);
+    if(SSL_set_fd(context_fd->ssl, context_fd->fd) != 1 ||
+       SSL_accept(context_fd->ssl) != 1) {
+        DBG("TLS handshake failed\n");
+        SSL_free(context_fd->ssl);
+        context_fd->ssl = NULL;
+        return -1;
     }
 
+    tv.tv_sec = 0;
+    setsockopt(context_fd->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    DBG("TLS handshake done: %s, %s, session %s\n",
+        SSL_get_version(context_fd->ssl), SSL_get_cipher(context_fd->ssl),
+        SSL_session_reused(context_fd->ssl) ? "resumed" : "new");
+    #ifdef USE_KTLS
+    DBG("kTLS send offload: %s\n", BIO_get_ktls_send(SSL_get_wbio(context_fd->ssl)) ? "on" : "off");
+    #endif
+
     return 0;
 }
+#endif
 
 /******************************************************************************
-Description.: Read a single line from the provided fildescriptor.
-              This funtion will return under two conditions:
-              * line end was reached
-              * timeout occured
-Input Value.: * fd.....: fildescriptor to read from
+Description.: read the request header with timeout, implemented without using
+              signals. The socket is read in large chunks and only the newly
+              arrived bytes get searched for the empty line that finishes the
+              header, so each byte is looked at just once.
+Input Value.: * context_fd: connection to read from
               * iobuf..: iobuffer that allows to use this functions from multiple
                          threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
+              * timeout: seconds to wait for more data
+Return Value: * iobuf..: contains the header followed by a null-character,
+                         bytes received after the header are kept behind it
+              * func().: length of the header including the empty line or
+                         -1 in case of error, timeout or a too large header
 ******************************************************************************/
-/* read just a single line or timeout */
-int _readline(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
+int read_request(cfd *context_fd, iobuffer *iobuf, int timeout)
 {
-    char c = '\0', *out = buffer;
-    int i;
+    char *lf, *end;
+    int rc;
+    fd_set fds;
+    struct timeval tv;
 
-    memset(buffer, 0, len);
+    while(1) {
+        /* a header ends with "\n\n" or "\n\r\n", an LF of the last round may start it */
+        end = iobuf->buffer + iobuf->level;
+        for(lf = iobuf->buffer + MAX(iobuf->scanned - 2, 0);
+            (lf = memchr(lf, '\n', end - lf)) != NULL; lf++) {
+            if(lf + 1 < end && lf[1] == '\n')
+                return lf + 2 - iobuf->buffer;
+            if(lf + 2 < end && lf[1] == '\r' && lf[2] == '\n')
+                return lf + 3 - iobuf->buffer;
+        }
+        iobuf->scanned = iobuf->level;
 
-    for(i = 0; i < len && c != '\n'; i++) {
-        if(_read(fd, iobuf, &c, 1, timeout) <= 0) {
-            /* timeout or error occured */
+        /* keep one byte for the terminating null-character */
+        if(iobuf->level >= IO_BUFFER - 1) {
+            DBG("request header exceeds %d bytes\n", IO_BUFFER);
             return -1;
         }
-        *out++ = c;
-    }
 
-    return i;
+        /*
+         * select will return in case of timeout or new data arrived,
+         * data that TLS already decrypted is not visible to select
+         */
+        tv.tv_sec = timeout;
+        tv.tv_usec = 0;
+        FD_ZERO(&fds);
+        FD_SET(context_fd->fd, &fds);
+        if(http_pending(context_fd) == 0 &&
+           (rc = select(context_fd->fd + 1, &fds, NULL, NULL, &tv)) <= 0) {
+            /* timeout or error */
+            return -1;
+        }
+
+        /*
+         * there should be at least one byte, because select signalled it.
+         * But: It may happen (very seldomly), that the socket gets closed remotly between
+         * the select() and the following read. That is the reason for not relying
+         * on reading at least one byte.
+         */
+        if((rc = http_read(context_fd, iobuf->buffer + iobuf->level, IO_BUFFER - 1 - iobuf->level)) <= 0) {
+            /* an error occured */
+            return -1;
+        }
+
+        iobuf->level += rc;
+        iobuf->buffer[iobuf->level] = '\0';
+    }
 }
 
 /******************************************************************************
@@ -305,92 +447,593 @@ int unescape(char *string)
     return 0;
 }
 
-#ifdef MANAGMENT
+/******************************************************************************
+Description.: parse the value of an Accept-Encoding header
+              Codings with "q=0" are treated as refused, other weights are
+              ignored since send_file() prefers the smallest variant anyway.
+Input Value.: value of the header (without the "Accept-Encoding:" part)
+Return Value: bitmask of the ENCODING_* flags the client accepts
+******************************************************************************/
+int parse_accept_encoding(const char *value)
+{
+    int result = 0, i;
+    size_t len;
+    const char *q;
+
+    while(*value != '\0' && *value != '\r' && *value != '\n') {
+        value += strspn(value, " \t,");
+        len = strcspn(value, " \t,;\r\n");
+
+        /* "gzip;q=0" means the coding must not be used */
+        q = value + len;
+        q += strspn(q, " \t;");
+        if(strncmp(q, "q=", 2) == 0 && strtod(q + 2, NULL) == 0.0)
+            len = 0;
+
+        for(i = 0; i < LENGTH_OF(encodings) && len > 0; i++) {
+            if(len == strlen(encodings[i].token) && strncasecmp(value, encodings[i].token, len) == 0) {
+                result |= encodings[i].flag;
+                break;
+            }
+        }
+
+        value += strcspn(value, ",\r\n");
+    }
+
+    return result;
+}
+
+/*
+ * request header fields this server evaluates, the value of a matching
+ * field is stored to the char pointer at "offset" within the request
+ */
+static const struct {
+    const char *name;
+    size_t offset;
+} request_headers[] = {
+    { "User-Agent",        offsetof(request, client) },
+    { "Authorization",     offsetof(request, credentials) },
+    { "Accept-Encoding",   offsetof(request, encoding) },
+    { "Upgrade",           offsetof(request, upgrade) },
+    { "Sec-WebSocket-Key", offsetof(request, websocket_key) },
+    { "Last-Event-ID",     offsetof(request, last_event_id) },
+    { "Connection",        offsetof(request, connection) }
+};
+
+/*
+ * the values of the "action" query parameter for requests to "/"
+ * "suffixed" actions accept an "_<input plugin number>" suffix
+ */
+static const struct {
+    const char *name;
+    answer_t type;
+    char suffixed;
+} request_actions[] = {
+    { "snapshot", A_SNAPSHOT,  1 },
+    { "stream",   A_STREAM,    1 },
+    { "take",     A_TAKE,      1 },
+    { "command",  A_COMMAND,   0 },
+    { "ws",       A_WEBSOCKET, 1 },
+    { "events",   A_EVENTS,    0 }
+};
+
+/*
+ * resources with a fixed name, "prefix[_<plugin number>]suffix" for
+ * the suffixed ones, every other path is looked up in the www-folder
+ */
+static const struct {
+    const char *method;
+    const char *prefix;
+    const char *suffix;
+    answer_t type;
+    char suffixed;
+} request_resources[] = {
+    { "POST", "/stream",       "",      A_STREAM,       1 },
+    { "GET",  "/stream",       "",      A_STREAM,       1 },
+    { "GET",  "/input",        ".json", A_INPUT_JSON,   1 },
+    { "GET",  "/output",       ".json", A_OUTPUT_JSON,  1 },
+    { "GET",  "/program.json", "",      A_PROGRAM_JSON, 0 },
+    #ifdef MANAGMENT
+    { "GET",  "/clients.json", "",      A_CLIENTS_JSON, 0 },
+    #endif
+    #ifdef WXP_COMPAT
+    { "GET",  "/cam",          ".jpg",  A_SNAPSHOT_WXP, 1 },
+    { "GET",  "/cam",          ".mjpg", A_STREAM_WXP,   1 },
+    #endif
+};
+
+/******************************************************************************
+Description.: checks for an empty string or an "_<number>" suffix
+Input Value.: * string.: the suffix, it does not need to be null-terminated
+              * length.: length of the suffix
+              * number.: where to store the number of the suffix
+Return Value: 0 if the suffix is valid, -1 otherwise
+******************************************************************************/
+int parse_number_suffix(const char *string, size_t length, int *number)
+{
+    size_t i;
+
+    if(length == 0)
+        return 0;
+
+    if(string[0] != '_' || length == 1 || length > 10)
+        return -1;
+
+    for(i = 1; i < length; i++) {
+        if(!isdigit((unsigned char)string[i]))
+            return -1;
+    }
+
+    *number = atoi(string + 1);
+    return 0;
+}
+
+/******************************************************************************
+Description.: determine what to deliver from method, path and query
+Input Value.: * req....: request with method and path set
+              * query..: the query string of the request, "" if there is none
+Return Value: * req....: type, input_number, parameter and query_string
+******************************************************************************/
+void classify_request(request *req, char *query)
+{
+    int i;
+    size_t len, plen, slen;
+
+    /* "GET /?action=<action>[_<input>]..." */
+    if(strcmp(req->method, "GET") == 0 && strcmp(req->path, "/") == 0 &&
+       strncmp(query, "action=", strlen("action=")) == 0) {
+        query += strlen("action=");
+        len = strcspn(query, "&");
+
+        for(i = 0; i < LENGTH_OF(request_actions); i++) {
+            plen = strlen(request_actions[i].name);
+            if(len < plen || strncmp(query, request_actions[i].name, plen) != 0)
+                continue;
+            if(len != plen && (!request_actions[i].suffixed ||
+                               parse_number_suffix(query + plen, len - plen, &req->input_number) != 0))
+                continue;
+            req->numbered = (len != plen);
+
+            req->type = request_actions[i].type;
+
+            /* the remaining query is the parameter, only accept certain characters */
+            req->parameter = query + len;
+            req->parameter[strspn(req->parameter, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./")] = '\0';
+            return;
+        }
+    }
+
+    /* resources with fixed names */
+    len = strlen(req->path);
+    for(i = 0; i < LENGTH_OF(request_resources); i++) {
+        plen = strlen(request_resources[i].prefix);
+        slen = strlen(request_resources[i].suffix);
+
+        if(strcmp(req->method, request_resources[i].method) != 0 ||
+           len < plen + slen ||
+           strncmp(req->path, request_resources[i].prefix, plen) != 0 ||
+           strcmp(req->path + len - slen, request_resources[i].suffix) != 0)
+            continue;
+        if(len != plen + slen && (!request_resources[i].suffixed ||
+                                  parse_number_suffix(req->path + plen, len - plen - slen, &req->input_number) != 0))
+            continue;
+        req->numbered = (len != plen + slen);
+
+        req->type = request_resources[i].type;
+
+        /* webcamxp adds offset to the camera number */
+        if(req->numbered && (req->type == A_SNAPSHOT_WXP || req->type == A_STREAM_WXP))
+            req->input_number--;
+        return;
+    }
+
+    if(strcmp(req->method, "GET") != 0)
+        return;
+
+    /* try to serve a file, only accept certain characters */
+    DBG("try to serve a file\n");
+    req->type = A_FILE;
+    req->parameter = req->path + 1;
+    req->parameter[strspn(req->parameter, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890")] = '\0';
+
+    if(strstr(req->parameter, ".cgi") != NULL) {
+        req->type = A_CGI;
+        query[strspn(query, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890=&")] = '\0';
+        req->query_string = (*query != '\0') ? query : " ";
+    }
+}
+
+/******************************************************************************
+Description.: remove a configured path prefix from the path of the request,
+              "/cam2/stream" becomes "/stream" and "/cam2" becomes "/". The
+              prefix only matches whole path segments.
+Input Value.: * req....: request with path set
+              * conf...: configuration of the server with the prefixes
+Return Value: * req....: path and path_input are updated if a prefix matched
+******************************************************************************/
+static void strip_path_prefix(request *req, config *conf)
+{
+    size_t len;
+    int i;
+
+    for(i = 0; i < conf->path_count; i++) {
+        len = strlen(conf->paths[i].prefix);
+        if(strncmp(req->path, conf->paths[i].prefix, len) != 0 ||
+           (req->path[len] != '/' && req->path[len] != '\0'))
+            continue;
+
+        req->path_input = conf->paths[i].input;
+        if(req->path[len] == '\0') {
+            /* the last character of the prefix becomes the remaining "/" */
+            req->path += len - 1;
+            req->path[0] = '/';
+        } else {
+            req->path += len;
+        }
+        return;
+    }
+}
+
+/******************************************************************************
+Description.: Tokenize the request header in a single pass. Method, path,
+              query and the interesting header fields get null-terminated
+              in place, no memory is allocated.
+Input Value.: * buffer.: the header as returned from read_request()
+              * length.: length of the header
+              * req....: initialized request structure
+              * conf...: configuration of the server, for the path prefixes
+Return Value: * req....: filled with pointers into buffer
+              * func().: 0 if the request could be parsed, -1 if it is malformed
+******************************************************************************/
+int parse_request(char *buffer, int length, request *req, config *conf)
+{
+    char *line, *next, *value, *query, *end = buffer + length;
+    int i;
+
+    /* request line: "<method> <path>[?<query>] [HTTP-version]" */
+    line = buffer;
+    next = memchr(line, '\n', end - line);
+    *next = '\0';
+    if(next > line && next[-1] == '\r')
+        next[-1] = '\0';
+
+    req->method = line;
+    if((value = strchr(line, ' ')) == NULL)
+        return -1;
+    *value++ = '\0';
+    value += strspn(value, " ");
+
+    if(*value != '/')
+        return -1;
+    req->path = value;
+
+    value += strcspn(value, " ");
+    if(*value != '\0') {
+        *value++ = '\0';
+        value += strspn(value, " ");
+        value[strcspn(value, " ")] = '\0';
+        req->version = value;
+    }
+
+    if((query = strchr(req->path, '?')) != NULL)
+        *query++ = '\0';
+    else
+        query = req->path + strlen(req->path);
+
+    /* header fields: "<name>: <value>" until the empty line */
+    for(line = next + 1; line < end; line = next + 1) {
+        next = memchr(line, '\n', end - line);
+        *next = '\0';
+        if(next > line && next[-1] == '\r')
+            next[-1] = '\0';
+
+        if(*line == '\0')
+            break;
+
+        if((value = strchr(line, ':')) == NULL)
+            continue;
+        *value++ = '\0';
+        value += strspn(value, " \t");
+
+        for(i = 0; i < LENGTH_OF(request_headers); i++) {
+            if(strcasecmp(line, request_headers[i].name) == 0) {
+                *(char **)((char *)req + request_headers[i].offset) = value;
+                break;
+            }
+        }
+    }
+
+    if(req->credentials != NULL) {
+        if(strncasecmp(req->credentials, "Basic ", strlen("Basic ")) == 0) {
+            req->credentials += strlen("Basic ");
+            decodeBase64(req->credentials);
+            DBG("username:password: %s\n", req->credentials);
+        } else {
+            req->credentials = NULL;
+        }
+    }
+
+    if(req->encoding != NULL)
+        req->accept_encoding = parse_accept_encoding(req->encoding);
+
+    strip_path_prefix(req, conf);
+    classify_request(req, query);
+
+    DBG("method: %s, path: %s, type: %d, plugin_no: %d\n", req->method, req->path, req->type, req->input_number);
+    return 0;
+}
 
 /******************************************************************************
-Description.: Adds a new client information struct to the ino list.
+Description.: hash function for the client table (FNV-1a)
+Input Value.: Client IP address as a string
+Return Value: index of the hash bucket
+******************************************************************************/
+static unsigned int client_hash(const char *address)
+{
+    unsigned int hash = 2166136261u;
+
+    while(*address != '\0') {
+        hash ^= (unsigned char)*address++;
+        hash *= 16777619u;
+    }
+
+    return hash & (CLIENT_HASH_SIZE - 1);
+}
+
+/******************************************************************************
+Description.: remove an entry from the list of idle clients, the table mutex
+              must be held
+Input Value.: the client entry
+Return Value: -
+******************************************************************************/
+static void unlink_idle_client(client_info *client)
+{
+    if(client->idle_prev != NULL)
+        client->idle_prev->idle_next = client->idle_next;
+    else
+        client_infos.idle_head = client->idle_next;
+
+    if(client->idle_next != NULL)
+        client->idle_next->idle_prev = client->idle_prev;
+    else
+        client_infos.idle_tail = client->idle_prev;
+
+    client->idle_prev = client->idle_next = NULL;
+}
+
+/******************************************************************************
+Description.: forget the clients that had no connection for CLIENT_IDLE_TIMEOUT
+              seconds, their entries go back to the free list. The idle list
+              is ordered by time, so only expired entries are looked at.
+              The table mutex must be held.
+Input Value.: current time in seconds
+Return Value: -
+******************************************************************************/
+static void evict_idle_clients(time_t now)
+{
+    client_info *client, **link;
+
+    while((client = client_infos.idle_head) != NULL &&
+          now - client->idle_since >= CLIENT_IDLE_TIMEOUT) {
+        unlink_idle_client(client);
+
+        for(link = &client_infos.buckets[client_hash(client->address)];
+            *link != client; link = &(*link)->next);
+        *link = client->next;
+
+        DBG("forgetting idle client %s\n", client->address);
+        client->next = client_infos.free;
+        client_infos.free = client;
+        client_infos.client_count--;
+    }
+}
+
+/******************************************************************************
+Description.: Adds a new client information struct to the client table. Each
+              call takes a reference that has to be dropped with release_client().
 Input Value.: Client IP address as a string
 Return Value: Returns with the newly added info or with a pointer to the existing item
 ******************************************************************************/
 client_info *add_client(char *address)
 {
-    unsigned int i = 0;
-    int name_length = strlen(address) + 1;
+    unsigned int hash = client_hash(address);
+    client_info *client;
+    struct timespec now;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
     pthread_mutex_lock(&client_infos.mutex);
 
-    for (; i<client_infos.client_count; i++) {
-        if (strcmp(client_infos.infos[i]->address, address) == 0) {
+    for(client = client_infos.buckets[hash]; client != NULL; client = client->next) {
+        if(strcmp(client->address, address) == 0) {
+            if(client->references++ == 0)
+                unlink_idle_client(client);
             pthread_mutex_unlock(&client_infos.mutex);
-            return client_infos.infos[i];
+            return client;
         }
     }
 
-    client_info *current_client_info = malloc(sizeof(client_info));
-    if (current_client_info == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        pthread_mutex_unlock(&client_infos.mutex);
-        return NULL;
-    }
+    evict_idle_clients(now.tv_sec);
 
-    current_client_info->address = malloc(name_length * sizeof(char));
-    if (current_client_info->address == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        pthread_mutex_unlock(&client_infos.mutex);
-        return NULL;
+    /* entries are allocated in slabs and never returned to the system */
+    if(client_infos.free == NULL) {
+        if((client = calloc(CLIENT_SLAB_SIZE, sizeof(client_info))) == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            pthread_mutex_unlock(&client_infos.mutex);
+            return NULL;
+        }
+        for(i = 0; i < CLIENT_SLAB_SIZE; i++) {
+            pthread_mutex_init(&client[i].bucket.mutex, NULL);
+            client[i].next = client_infos.free;
+            client_infos.free = &client[i];
+        }
     }
 
-    strcpy(current_client_info->address, address);
-    memset(&(current_client_info->last_take_time), 0, sizeof(struct timeval)); // set last time to zero
+    client = client_infos.free;
+    client_infos.free = client->next;
 
-    client_infos.infos = realloc(client_infos.infos, (client_infos.client_count + 1) * sizeof(client_info*));
-    client_infos.infos[client_infos.client_count] = current_client_info;
-    client_infos.client_count += 1;
+    strncpy(client->address, address, sizeof(client->address) - 1);
+    client->address[sizeof(client->address) - 1] = '\0';
+    client->references = 1;
+    client->idle_prev = client->idle_next = NULL;
+    client->last_take_time = 0;
+    client->frames = 0;
+    client->dropped_frames = 0;
+    client->bucket.tokens = 0;
+    client->bucket.last.tv_sec = 0;
+    client->bucket.last.tv_nsec = 0;
+
+    client->next = client_infos.buckets[hash];
+    client_infos.buckets[hash] = client;
+    client_infos.client_count++;
 
     pthread_mutex_unlock(&client_infos.mutex);
-    return current_client_info;
+    return client;
 }
 
 /******************************************************************************
-Description.: Looks in the client_infos for the current ip address.
-Input Value.: Client IP address as a string
+Description.: Drop a reference taken by add_client(). An entry without
+              references is remembered for CLIENT_IDLE_TIMEOUT seconds.
+Input Value.: the client entry, may be NULL
+Return Value: -
+******************************************************************************/
+void release_client(client_info *client)
+{
+    struct timespec now;
+
+    if(client == NULL)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&client_infos.mutex);
+    if(--client->references == 0) {
+        client->idle_since = now.tv_sec;
+        client->idle_prev = client_infos.idle_tail;
+        client->idle_next = NULL;
+        if(client_infos.idle_tail != NULL)
+            client_infos.idle_tail->idle_next = client;
+        else
+            client_infos.idle_head = client;
+        client_infos.idle_tail = client;
+    }
+    pthread_mutex_unlock(&client_infos.mutex);
+}
+
+/******************************************************************************
+Description.: add the tokens for the time since the last refill, a bucket that
+              was never used starts full
+Input Value.: * bucket.: the token bucket, its mutex must be held
+              * rate...: bytes per second
+              * now....: current time of the monotonic clock
+Return Value: -
+******************************************************************************/
+static void refill_bucket(token_bucket *bucket, unsigned long rate, struct timespec *now)
+{
+    double elapsed;
+
+    if(bucket->last.tv_sec == 0 && bucket->last.tv_nsec == 0) {
+        bucket->tokens = rate;
+    } else {
+        elapsed = (now->tv_sec - bucket->last.tv_sec) + (now->tv_nsec - bucket->last.tv_nsec) / 1e9;
+        bucket->tokens = MIN(bucket->tokens + elapsed * rate, (double)rate);
+    }
+    bucket->last = *now;
+}
+
+/******************************************************************************
+Description.: Decide if a frame may be sent to a stream client. The frame has
+              to fit into the budget of the client's address and into the
+              budget of the server, if it does both pay for it.
+Input Value.: * context_fd: the client connection
+              * size......: size of the frame in bytes
+Return Value: 1 if the frame may be sent, 0 if it has to be dropped
+******************************************************************************/
+int allow_frame(cfd *context_fd, int size)
+{
+    config *conf = &context_fd->pc->conf;
+    token_bucket *server = &context_fd->pc->bucket, *client = NULL;
+    struct timespec now;
+    int allowed = 1;
+
+    if(conf->client_rate > 0 && context_fd->client != NULL)
+        client = &context_fd->client->bucket;
+
+    if(conf->rate == 0 && client == NULL)
+        return 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* lock order: client before server */
+    if(client != NULL) {
+        pthread_mutex_lock(&client->mutex);
+        refill_bucket(client, conf->client_rate, &now);
+        allowed = (client->tokens > 0);
+    }
+
+    if(allowed && conf->rate > 0) {
+        pthread_mutex_lock(&server->mutex);
+        refill_bucket(server, conf->rate, &now);
+        if((allowed = (server->tokens > 0)))
+            server->tokens -= size;
+        pthread_mutex_unlock(&server->mutex);
+    }
+
+    if(client != NULL) {
+        if(allowed)
+            client->tokens -= size;
+        else
+            __atomic_add_fetch(&context_fd->client->dropped_frames, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&client->mutex);
+    }
+
+    return allowed;
+}
+
+#ifdef MANAGMENT
+/******************************************************************************
+Description.: Checks when the client got its last frame, the statistics are
+              read without locking.
+Input Value.: the client entry
 Return Value: If a frame was served to it within the specified interval it returns 1
               If not it returns with 0
 ******************************************************************************/
 int check_client_status(client_info *client)
 {
-    unsigned int i = 0;
-    pthread_mutex_lock(&client_infos.mutex);
-    for (; i<client_infos.client_count; i++) {
-        if (client_infos.infos[i] == client) {
-            long msec;
-            struct timeval tim;
-            gettimeofday(&tim, NULL);
-            msec  =(tim.tv_sec - client_infos.infos[i]->last_take_time.tv_sec)*1000;
-            msec +=(tim.tv_usec - client_infos.infos[i]->last_take_time.tv_usec)/1000;
-            DBG("diff: %ld\n", msec);
-            if ((msec < 1000) && (msec > 0)) { // FIXME make it parameter
-                DBG("CHEATER\n");
-                pthread_mutex_unlock(&client_infos.mutex);
-                return 1;
-            } else {
-                pthread_mutex_unlock(&client_infos.mutex);
-                return 0;
-            }
-        }
+    struct timeval tim;
+    long long msec;
+
+    if(client == NULL)
+        return 0;
+
+    gettimeofday(&tim, NULL);
+    msec = ((long long)tim.tv_sec * 1000000 + tim.tv_usec -
+            __atomic_load_n(&client->last_take_time, __ATOMIC_RELAXED)) / 1000;
+    DBG("diff: %lld\n", msec);
+    if ((msec < 1000) && (msec > 0)) { // FIXME make it parameter
+        DBG("CHEATER\n");
+        return 1;
     }
-    DBG("Client not found in the client list! How did it happend?? This is a BUG\n");
-    pthread_mutex_unlock(&client_infos.mutex);
+
     return 0;
 }
 
+/******************************************************************************
+Description.: Remember that a frame was sent to the client.
+Input Value.: the client entry
+Return Value: -
+******************************************************************************/
 void update_client_timestamp(client_info *client)
 {
     struct timeval tim;
-    pthread_mutex_lock(&client_infos.mutex);
+
+    if(client == NULL)
+        return;
+
     gettimeofday(&tim, NULL);
-    memcpy(&client->last_take_time, &tim, sizeof(struct timeval));
-    pthread_mutex_unlock(&client_infos.mutex);
+    __atomic_store_n(&client->last_take_time, (long long)tim.tv_sec * 1000000 + tim.tv_usec, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&client->frames, 1, __ATOMIC_RELAXED);
 }
 #endif
 
@@ -417,7 +1060,7 @@ void send_snapshot(cfd *context_fd, int input_number)
     if((frame = malloc(frame_size + 1)) == NULL) {
         free(frame);
         pthread_mutex_unlock(&pglobal->in[input_number].db);
-        send_error(context_fd->fd, 500, "not enough memory");
+        send_error(context_fd, 500, "not enough memory");
         return;
     }
     /* copy v4l2_buffer timeval to user space */
@@ -432,22 +1075,117 @@ void send_snapshot(cfd *context_fd, int input_number)
     update_client_timestamp(context_fd->client);
     #endif
 
-    /* write the response */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Access-Control-Allow-Origin: *\r\n" \
-            STD_HEADER \
-            "Content-type: image/jpeg\r\n" \
-            "X-Timestamp: %d.%06d\r\n" \
-            "\r\n", (int) timestamp.tv_sec, (int) timestamp.tv_usec);
-
-    /* send header and image now */
-    if (write(context_fd->fd, buffer, strlen(buffer)) < 0 ||
-        write(context_fd->fd, frame, frame_size) < 0) {
-        free(frame);
-        return;
+    /* write the response */
+    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+            "Access-Control-Allow-Origin: *\r\n" \
+            STD_HEADER \
+            "Content-type: image/jpeg\r\n" \
+            "X-Timestamp: %d.%06d\r\n" \
+            "\r\n", (int) timestamp.tv_sec, (int) timestamp.tv_usec);
+
+    /* send header and image now */
+    if (http_write(context_fd, buffer, strlen(buffer)) < 0 ||
+        http_write(context_fd, frame, frame_size) < 0) {
+        free(frame);
+        return;
+    }
+
+    free(frame);
+}
+
+/******************************************************************************
+Description.: answer a long-poll without a frame
+Input Value.: * context_fd: connection and server context
+              * status....: status line, e.g. "204 No Content"
+              * sequence..: the sequence number the client continues after
+              * keep_alive: 1 if the client wants to send further requests
+Return Value: 0 if the connection can take another request, -1 otherwise
+******************************************************************************/
+static int send_no_frame(cfd *context_fd, const char *status, unsigned long sequence, int keep_alive)
+{
+    char buffer[BUFFER_SIZE];
+
+    snprintf(buffer, sizeof(buffer), "HTTP/1.1 %s\r\n" \
+             "Access-Control-Allow-Origin: *\r\n" \
+             "Access-Control-Expose-Headers: X-Sequence\r\n" \
+             "Connection: %s\r\n" \
+             NO_CACHE_HEADER \
+             "%s" \
+             "X-Sequence: %lu\r\n" \
+             "\r\n", status, keep_alive ? "keep-alive" : "close",
+             /* a 204 has no body by definition, other answers have to say it */
+             strncmp(status, "204", 3) == 0 ? "" : "Content-Length: 0\r\n", sequence);
+
+    return (http_write(context_fd, buffer, strlen(buffer)) < 0 || !keep_alive) ? -1 : 0;
+}
+
+/******************************************************************************
+Description.: Long-poll for the next frame: wait until the input has a frame
+              newer than "after" and send it as a single JPEG together with
+              its sequence number. Clients that pass back the X-Sequence value
+              get every frame once, as long as they stay within FRAME_RING
+              frames of the input. If no frame arrives in time the answer is
+              "204 No Content" with the current sequence number. A frame over
+              the bandwidth budget is skipped with "429 Too Many Requests"
+              and its sequence number, like the streams skip it.
+              The sequence numbers are the ones of the "frame" events.
+Input Value.: * context_fd..: connection and server context
+              * input_number: input plugin to take the frame from
+              * parameter...: "&after=<sequence>[&timeout=<seconds>]"
+              * keep_alive..: 1 if the client wants to send further requests
+Return Value: 0 if the connection can take another request, -1 otherwise
+******************************************************************************/
+int send_next_frame(cfd *context_fd, int input_number, char *parameter, int keep_alive)
+{
+    char buffer[BUFFER_SIZE];
+    char *value;
+    unsigned long after = 0;
+    int timeout = NEXT_FRAME_TIMEOUT;
+    shared_frame *frame;
+
+    if((value = strstr(parameter, "&after=")) != NULL)
+        after = strtoul(value + strlen("&after="), NULL, 10);
+    if((value = strstr(parameter, "&timeout=")) != NULL)
+        timeout = MAX(0, MIN(atoi(value + strlen("&timeout=")), NEXT_FRAME_MAX_TIMEOUT));
+
+    events_start(pglobal);
+    frame = frames_wait(input_number, after, timeout);
+
+    if(frame == NULL)
+        return send_no_frame(context_fd, "204 No Content", frames_current(input_number), keep_alive);
+
+    /* over the bandwidth budget, the client continues after this frame */
+    if(!allow_frame(context_fd, frame->size)) {
+        after = frame->sequence;
+        frames_release(frame);
+        return send_no_frame(context_fd, "429 Too Many Requests", after, keep_alive);
+    }
+
+    #ifdef MANAGMENT
+    update_client_timestamp(context_fd->client);
+    #endif
+
+    snprintf(buffer, sizeof(buffer), "HTTP/1.1 200 OK\r\n" \
+             "Access-Control-Allow-Origin: *\r\n" \
+             "Access-Control-Expose-Headers: X-Sequence, X-Timestamp\r\n" \
+             "Connection: %s\r\n" \
+             NO_CACHE_HEADER \
+             "Content-Type: image/jpeg\r\n" \
+             "Content-Length: %d\r\n" \
+             "X-Timestamp: %d.%06d\r\n" \
+             "X-Sequence: %lu\r\n" \
+             "\r\n", keep_alive ? "keep-alive" : "close", frame->size,
+             (int)frame->timestamp.tv_sec, (int)frame->timestamp.tv_usec, frame->sequence);
+
+    /* the frame is shared with the other pollers, it is sent without a copy */
+    if(http_write(context_fd, buffer, strlen(buffer)) < 0 ||
+       http_write(context_fd, frame->data, frame->size) < 0) {
+        frames_release(frame);
+        return -1;
     }
 
-    free(frame);
+    frames_release(frame);
+    return keep_alive ? 0 : -1;
 }
 
 /******************************************************************************
@@ -457,10 +1195,9 @@ Return Value: -
 ******************************************************************************/
 void send_stream(cfd *context_fd, int input_number)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
-    int frame_size = 0, max_frame_size = 0;
+    shared_frame *frame;
+    unsigned long sequence;
     char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
 
     DBG("preparing header\n");
     sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
@@ -470,44 +1207,28 @@ void send_stream(cfd *context_fd, int input_number)
             "\r\n" \
             "--" BOUNDARY "\r\n");
 
-    if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
-        free(frame);
+    if(http_write(context_fd, buffer, strlen(buffer)) < 0)
         return;
-    }
 
     DBG("Headers send, sending stream now\n");
 
-    while(!pglobal->stop) {
-
-        /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    events_start(pglobal);
+    sequence = frames_current(input_number);
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-
-        /* check if framebuffer is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+    while(!pglobal->stop) {
 
-            max_frame_size = frame_size + TEN_K;
-            if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                send_error(context_fd->fd, 500, "not enough memory");
-                return;
-            }
+        /* wait for fresh frames, all clients of the input share one copy */
+        if((frame = frames_wait(input_number, sequence, 1)) == NULL)
+            continue;
+        sequence = frame->sequence;
 
-            frame = tmp;
+        /* over the bandwidth budget, skip this frame */
+        if(!allow_frame(context_fd, frame->size)) {
+            frames_release(frame);
+            continue;
         }
 
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
-
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-        DBG("got frame (size: %d kB)\n", frame_size / 1024);
-
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        DBG("got frame (size: %d kB)\n", frame->size / 1024);
 
         #ifdef MANAGMENT
         update_client_timestamp(context_fd->client);
@@ -521,19 +1242,261 @@ void send_stream(cfd *context_fd, int input_number)
         sprintf(buffer, "Content-Type: image/jpeg\r\n" \
                 "Content-Length: %d\r\n" \
                 "X-Timestamp: %d.%06d\r\n" \
-                "\r\n", frame_size, (int)timestamp.tv_sec, (int)timestamp.tv_usec);
+                "\r\n", frame->size, (int)frame->timestamp.tv_sec, (int)frame->timestamp.tv_usec);
         DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+        if(http_write(context_fd, buffer, strlen(buffer)) < 0) {
+            frames_release(frame);
+            break;
+        }
 
         DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
+        if(http_write(context_fd, frame->data, frame->size) < 0) {
+            frames_release(frame);
+            break;
+        }
+        frames_release(frame);
 
         DBG("sending boundary\n");
         sprintf(buffer, "\r\n--" BOUNDARY "\r\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+        if(http_write(context_fd, buffer, strlen(buffer)) < 0) break;
     }
+}
 
-    free(frame);
+/******************************************************************************
+Description.: A control of a plugin was changed through this server: the cached
+              JSON description of the plugin gets outdated and the event-stream
+              subscribers are notified.
+Input Value.: * dest....: Dest_Input or Dest_Output
+              * plugin..: number of the plugin
+              * id......: control id
+              * group...: control group
+              * value...: new value
+Return Value: -
+******************************************************************************/
+void control_changed(int dest, int plugin, int id, int group, int value)
+{
+    invalidate_JSON(dest, plugin);
+    events_publish("control", "{\"dest\": %d, \"plugin\": %d, \"id\": %d, \"group\": %d, \"value\": %d}",
+                   dest, plugin, id, group, value);
+}
+
+/******************************************************************************
+Description.: Send a text/event-stream (Server-Sent Events) with the metadata
+              of every frame and the control changes. The events are formatted
+              once by events.c, this function only copies them to the client.
+              A reconnecting client continues after its Last-Event-ID if
+              that event is still buffered.
+Input Value.: * context_fd...: connection and server context
+              * last_event_id: value of the Last-Event-ID header or NULL
+Return Value: -
+******************************************************************************/
+void send_events(cfd *context_fd, char *last_event_id)
+{
+    char *buffer;
+    unsigned long last, current;
+    int length, idle = 0;
+
+    /* room for all buffered events, too large for the stack of a client thread */
+    if((buffer = malloc(EVENT_RING * EVENT_SIZE)) == NULL) {
+        send_error(context_fd, 500, "not enough memory");
+        return;
+    }
+
+    events_start(pglobal);
+    last = current = events_current();
+    if(last_event_id != NULL) {
+        last = strtoul(last_event_id, NULL, 10);
+        if(last > current)
+            last = current;
+    }
+
+    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+            "Access-Control-Allow-Origin: *\r\n" \
+            STD_HEADER \
+            "Content-Type: text/event-stream\r\n" \
+            "\r\n" \
+            "retry: 2000\n\n");
+
+    if(http_write(context_fd, buffer, strlen(buffer)) < 0) {
+        free(buffer);
+        return;
+    }
+
+    while(!pglobal->stop) {
+        if((length = events_wait(&last, buffer, EVENT_RING * EVENT_SIZE, 1)) == 0) {
+            /* a comment now and then detects clients that went away */
+            if(++idle < 15)
+                continue;
+            strcpy(buffer, ": keep-alive\n\n");
+            length = strlen(buffer);
+        }
+        idle = 0;
+
+        if(http_write(context_fd, buffer, length) < 0)
+            break;
+    }
+
+    free(buffer);
+}
+
+/******************************************************************************
+Description.: Handle one message of a WebSocket client, if it arrived completely.
+              Text messages control the stream:
+                pause, resume, fps=<frames per second, 0 for all>,
+                quality=<JPEG quality forwarded to the input plugin>
+Input Value.: * context_fd..: connection and server context
+              * reader......: the message received so far
+              * input_number: input plugin the client is subscribed to
+              * paused......: pause state of the client, gets updated
+              * interval....: minimum microseconds between frames, gets updated
+Return Value: 0 if the connection stays open, -1 if it has to be closed
+******************************************************************************/
+static int websocket_message(cfd *context_fd, websocket_reader *reader, int input_number, int *paused, long *interval)
+{
+    char *message = reader->payload, answer[128];
+    websocket_opcode opcode;
+    int length, value;
+
+    if((length = websocket_receive(context_fd, reader, &opcode)) == WEBSOCKET_PARTIAL)
+        return 0;
+    if(length < 0)
+        return -1;
+
+    switch(opcode) {
+    case WS_OP_CLOSE:
+        websocket_send(context_fd, WS_OP_CLOSE, message, MIN(length, 2));
+        return -1;
+    case WS_OP_PING:
+        return websocket_send(context_fd, WS_OP_PONG, message, length);
+    case WS_OP_TEXT:
+        break;
+    default:
+        /* pongs and binary messages are ignored */
+        return 0;
+    }
+
+    DBG("WebSocket message: %s\n", message);
+
+    if(strcmp(message, "pause") == 0) {
+        *paused = 1;
+        sprintf(answer, "{\"paused\": true}");
+    } else if(strcmp(message, "resume") == 0) {
+        *paused = 0;
+        sprintf(answer, "{\"paused\": false}");
+    } else if(sscanf(message, "fps=%d", &value) == 1 && value >= 0) {
+        *interval = (value == 0) ? 0 : 1000000 / value;
+        sprintf(answer, "{\"fps\": %d}", value);
+    } else if(sscanf(message, "quality=%d", &value) == 1) {
+        /* the quality is a setting of the input plugin, it changes for every client */
+        if(context_fd->pc->conf.nocommands) {
+            sprintf(answer, "{\"error\": \"commands are disabled\"}");
+        } else if(pglobal->in[input_number].cmd == NULL ||
+                  pglobal->in[input_number].cmd(input_number, 0, IN_CMD_JPEG_QUALITY, value, NULL) != 0) {
+            sprintf(answer, "{\"error\": \"quality not supported\"}");
+        } else {
+            sprintf(answer, "{\"quality\": %d}", value);
+            control_changed(Dest_Input, input_number, 0, IN_CMD_JPEG_QUALITY, value);
+        }
+    } else {
+        sprintf(answer, "{\"error\": \"unknown message\"}");
+    }
+
+    return websocket_send(context_fd, WS_OP_TEXT, answer, strlen(answer));
+}
+
+/******************************************************************************
+Description.: Upgrade the connection to a WebSocket and send each JPG-frame as
+              one binary message. The client may pause and resume the stream,
+              limit the framerate and change the JPEG quality with text messages.
+Input Value.: * context_fd..: connection and server context
+              * input_number: input plugin to stream
+              * key.........: the Sec-WebSocket-Key of the client
+Return Value: -
+******************************************************************************/
+void send_websocket(cfd *context_fd, int input_number, char *key)
+{
+    shared_frame *frame;
+    unsigned long sequence;
+    websocket_reader reader = { .level = 0 };
+    int paused = 0;
+    long interval = 0, elapsed;
+    char buffer[BUFFER_SIZE] = {0};
+    char accept[WEBSOCKET_ACCEPT_SIZE];
+    struct timeval last = {0, 0}, now, timeout;
+    fd_set fds;
+
+    if(key == NULL) {
+        send_error(context_fd, 400, "WebSocket handshake without Sec-WebSocket-Key");
+        return;
+    }
+
+    websocket_accept_key(key, accept);
+    sprintf(buffer, "HTTP/1.1 101 Switching Protocols\r\n" \
+            "Upgrade: websocket\r\n" \
+            "Connection: Upgrade\r\n" \
+            "Sec-WebSocket-Accept: %s\r\n" \
+            "\r\n", accept);
+
+    if(http_write(context_fd, buffer, strlen(buffer)) < 0)
+        return;
+
+    DBG("WebSocket established, sending frames now\n");
+
+    events_start(pglobal);
+    sequence = frames_current(input_number);
+
+    while(!pglobal->stop) {
+
+        /* process pending messages, while paused just wait for them */
+        for(;;) {
+            FD_ZERO(&fds);
+            FD_SET(context_fd->fd, &fds);
+            timeout.tv_sec = paused ? 1 : 0;
+            timeout.tv_usec = 0;
+
+            if(http_pending(context_fd) == 0 &&
+               select(context_fd->fd + 1, &fds, NULL, NULL, &timeout) <= 0)
+                break;
+
+            if(websocket_message(context_fd, &reader, input_number, &paused, &interval) < 0)
+                return;
+        }
+
+        if(paused)
+            continue;
+
+        /* wait for fresh frames, all clients of the input share one copy */
+        if((frame = frames_wait(input_number, sequence, 1)) == NULL)
+            continue;
+        sequence = frame->sequence;
+
+        /* skip frames to honour the requested framerate, allow 10% of jitter */
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - last.tv_sec) * 1000000L + (now.tv_usec - last.tv_usec);
+        if(interval > 0 && elapsed < interval - interval / 10) {
+            frames_release(frame);
+            continue;
+        }
+
+        /* over the bandwidth budget, skip this frame */
+        if(!allow_frame(context_fd, frame->size)) {
+            frames_release(frame);
+            continue;
+        }
+        last = now;
+
+        DBG("got frame (size: %d kB)\n", frame->size / 1024);
+
+        #ifdef MANAGMENT
+        update_client_timestamp(context_fd->client);
+        #endif
+
+        if(websocket_send(context_fd, WS_OP_BINARY, frame->data, frame->size) < 0) {
+            frames_release(frame);
+            break;
+        }
+        frames_release(frame);
+    }
 }
 
 #ifdef WXP_COMPAT
@@ -544,10 +1507,9 @@ Return Value: -
 ******************************************************************************/
 void send_stream_wxp(cfd *context_fd, int input_number)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
-    int frame_size = 0, max_frame_size = 0;
+    shared_frame *frame;
+    unsigned long sequence;
     char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
 
     DBG("preparing header\n");
 
@@ -573,70 +1535,59 @@ void send_stream_wxp(cfd *context_fd, int input_number)
                     curDateBuffer,
                     expDateBuffer);
 
-    if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
-        free(frame);
+    if(http_write(context_fd, buffer, strlen(buffer)) < 0)
         return;
-    }
 
     DBG("Headers send, sending stream now\n");
 
-    while(!pglobal->stop) {
-
-        /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
-
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+    events_start(pglobal);
+    sequence = frames_current(input_number);
 
-        /* check if framebuffer is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+    while(!pglobal->stop) {
 
-            max_frame_size = frame_size + TEN_K;
-            if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                send_error(context_fd->fd, 500, "not enough memory");
-                return;
-            }
+        /* wait for fresh frames, all clients of the input share one copy */
+        if((frame = frames_wait(input_number, sequence, 1)) == NULL)
+            continue;
+        sequence = frame->sequence;
 
-            frame = tmp;
+        /* over the bandwidth budget, skip this frame */
+        if(!allow_frame(context_fd, frame->size)) {
+            frames_release(frame);
+            continue;
         }
 
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
-
         #ifdef MANAGMENT
         update_client_timestamp(context_fd->client);
         #endif
 
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-        DBG("got frame (size: %d kB)\n", frame_size / 1024);
-
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        DBG("got frame (size: %d kB)\n", frame->size / 1024);
 
         memset(buffer, 0, 50*sizeof(char));
-        sprintf(buffer, "mjpeg %07d12345", frame_size);
+        sprintf(buffer, "mjpeg %07d12345", frame->size);
         DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, 50) < 0) break;
+        if(http_write(context_fd, buffer, 50) < 0) {
+            frames_release(frame);
+            break;
+        }
 
         DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
+        if(http_write(context_fd, frame->data, frame->size) < 0) {
+            frames_release(frame);
+            break;
+        }
+        frames_release(frame);
     }
-
-    free(frame);
 }
 #endif
 
 /******************************************************************************
 Description.: Send error messages and headers.
-Input Value.: * fd.....: is the filedescriptor to send the message to
+Input Value.: * context_fd: is the connection to send the message to
               * which..: HTTP error code, most popular is 404
               * message: append this string to the displayed response
 Return Value: -
 ******************************************************************************/
-void send_error(int fd, int which, char *message)
+void send_error(cfd *context_fd, int which, char *message)
 {
     char buffer[BUFFER_SIZE] = {0};
 
@@ -685,7 +1636,7 @@ void send_error(int fd, int which, char *message)
                 "%s", message);
     }
 
-    if(write(fd, buffer, strlen(buffer)) < 0) {
+    if(http_write(context_fd, buffer, strlen(buffer)) < 0) {
         DBG("write failed, done anyway\n");
     }
 }
@@ -695,16 +1646,23 @@ Description.: Send HTTP header and copy the content of a file. To keep things
               simple, just a single folder gets searched for the file. Just
               files with known extension and supported mimetype get served.
               If no parameter was given, the file "index.html" will be copied.
-Input Value.: * fd.......: filedescriptor to send data to
+Input Value.: * context_fd: connection to send data to
               * id.......: specifies which server-context is the right one
               * parameter: string that consists of the filename
+              * accept_encoding: ENCODING_* flags of the client, if one
+                         of them matches a precompressed variant of a
+                         compressible file that variant gets served
 Return Value: -
 ******************************************************************************/
-void send_file(int id, int fd, char *parameter)
+void send_file(int id, cfd *context_fd, char *parameter, int accept_encoding)
 {
     char buffer[BUFFER_SIZE] = {0};
     char *extension, *mimetype = NULL;
-    int i, lfd;
+    const char *encoding = NULL;
+    char compressible = 0;
+    int i, lfd = -1;
+    size_t path_length;
+    struct stat stats;
     config conf = servers[id].conf;
 
     /* in case no parameter was given */
@@ -721,7 +1679,7 @@ void send_file(int id, int fd, char *parameter)
     }
 
     if(lastDot == 0) {
-        send_error(fd, 400, "No file extension found");
+        send_error(context_fd, 400, "No file extension found");
         return;
     } else {
         extension = parameter + lastDot;
@@ -732,13 +1690,14 @@ void send_file(int id, int fd, char *parameter)
     for(i = 0; i < LENGTH_OF(mimetypes); i++) {
         if(strcmp(mimetypes[i].dot_extension, extension) == 0) {
             mimetype = (char *)mimetypes[i].mimetype;
+            compressible = mimetypes[i].compressible;
             break;
         }
     }
 
     /* in case of unknown mimetype or extension leave */
     if(mimetype == NULL) {
-        send_error(fd, 404, "MIME-TYPE not known");
+        send_error(context_fd, 404, "MIME-TYPE not known");
         return;
     }
 
@@ -748,25 +1707,67 @@ void send_file(int id, int fd, char *parameter)
     /* build the absolute path to the file */
     strncat(buffer, conf.www_folder, sizeof(buffer) - 1);
     strncat(buffer, parameter, sizeof(buffer) - strlen(buffer) - 1);
+    path_length = strlen(buffer);
+
+    /* prefer a precompressed variant (e.g. "style.css.gz") if the client accepts it */
+    for(i = 0; compressible && i < LENGTH_OF(encodings); i++) {
+        if(!(accept_encoding & encodings[i].flag) ||
+           path_length + strlen(encodings[i].dot_extension) >= sizeof(buffer))
+            continue;
+
+        strcpy(buffer + path_length, encodings[i].dot_extension);
+        if((lfd = open(buffer, O_RDONLY)) >= 0) {
+            encoding = encodings[i].token;
+            break;
+        }
+    }
+    buffer[path_length] = '\0';
 
     /* try to open that file */
-    if((lfd = open(buffer, O_RDONLY)) < 0) {
+    if(lfd < 0 && (lfd = open(buffer, O_RDONLY)) < 0) {
         DBG("file %s not accessible\n", buffer);
-        send_error(fd, 404, "Could not open file");
+        send_error(context_fd, 404, "Could not open file");
+        return;
+    }
+    DBG("opened file: %s (encoding: %s)\n", buffer, (encoding == NULL) ? "identity" : encoding);
+
+    if(fstat(lfd, &stats) < 0) {
+        close(lfd);
+        send_error(context_fd, 500, "Could not stat file");
         return;
     }
-    DBG("opened file: %s\n", buffer);
 
     /* prepare HTTP header */
     sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
             "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", mimetype);
+            "Content-Length: %lld\r\n" \
+            STD_HEADER, mimetype, (long long)stats.st_size);
+    if(encoding != NULL)
+        sprintf(buffer + strlen(buffer), "Content-Encoding: %s\r\n", encoding);
+    if(compressible)
+        strcat(buffer, "Vary: Accept-Encoding\r\n");
+    strcat(buffer, "\r\n");
     i = strlen(buffer);
 
+    #ifdef USE_KTLS
+    /* the kernel encrypts, so the file can go to the socket without being read */
+    if(context_fd->ssl != NULL && BIO_get_ktls_send(SSL_get_wbio(context_fd->ssl))) {
+        off_t offset = 0;
+        ossl_ssize_t rc = 0;
+
+        if(http_write(context_fd, buffer, i) >= 0) {
+            while(offset < stats.st_size &&
+                  (rc = SSL_sendfile(context_fd->ssl, lfd, offset, stats.st_size - offset, 0)) > 0)
+                offset += rc;
+        }
+        close(lfd);
+        return;
+    }
+    #endif
+
     /* first transmit HTTP-header, afterwards transmit content of file */
     do {
-        if(write(fd, buffer, i) < 0) {
+        if(http_write(context_fd, buffer, i) < 0) {
             close(lfd);
             return;
         }
@@ -778,13 +1779,13 @@ void send_file(int id, int fd, char *parameter)
 
 /******************************************************************************
 Description.: Executes the specified CGI file if exists
-Input Value.: * fd...........: filedescriptor to send data to
+Input Value.: * context_fd...: connection to send data to
               * id...........: specifies which server-context is the right one
               * parameter....: the requested file name
               * query_string.: query parameters
 Return Value: -
 ******************************************************************************/
-void execute_cgi(int id, int fd, char *parameter, char *query_string)
+void execute_cgi(int id, cfd *context_fd, char *parameter, char *query_string)
 {
     int lfd = 0, i;
     int buffer_length = 0;
@@ -799,7 +1800,7 @@ void execute_cgi(int id, int fd, char *parameter, char *query_string)
 
     if((lfd = open(fn_buffer, O_RDONLY)) < 0) {
         DBG("file %s not accessible\n", fn_buffer);
-        send_error(fd, 404, "Could not open file");
+        send_error(context_fd, 404, "Could not open file");
         return;
     }
 
@@ -826,7 +1827,7 @@ void execute_cgi(int id, int fd, char *parameter, char *query_string)
 
     sprintf(buffer,
             enviroment,
-            conf.port,
+            context_fd->listener->port,
             parameter,
             query_string,
             fn_buffer);
@@ -834,12 +1835,12 @@ void execute_cgi(int id, int fd, char *parameter, char *query_string)
     f = popen(buffer, "r");
     if(f == NULL) {
         DBG("Unable to execute the requested CGI script\n");
-        send_error(fd, 403, "CGI script cannot be executed");
+        send_error(context_fd, 403, "CGI script cannot be executed");
         return;
     }
 
     while((i = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-        if (write(fd, buffer, i) < 0) {
+        if (http_write(context_fd, buffer, i) < 0) {
             fclose(f);
             return;
         }
@@ -848,13 +1849,13 @@ void execute_cgi(int id, int fd, char *parameter, char *query_string)
 
 
 /******************************************************************************
-Description.: Perform a command specified by parameter. Send response to fd.
-Input Value.: * fd.......: filedescriptor to send HTTP response to.
+Description.: Perform a command specified by parameter. Send response to context_fd.
+Input Value.: * context_fd: connection to send HTTP response to.
               * parameter: contains the command and value as string.
               * id.......: specifies which server-context to choose.
 Return Value: -
 ******************************************************************************/
-void command(int id, int fd, char *parameter)
+void command(int id, cfd *context_fd, char *parameter)
 {
     char buffer[BUFFER_SIZE] = {0};
     char *command = NULL, *svalue = NULL, *value, *command_id_string;
@@ -865,7 +1866,7 @@ void command(int id, int fd, char *parameter)
     /* sanity check of parameter-string */
     if(parameter == NULL || strlen(parameter) >= 255 || strlen(parameter) == 0) {
         DBG("parameter string looks bad\n");
-        send_error(fd, 400, "Parameter-string of command does not look valid.");
+        send_error(context_fd, 400, "Parameter-string of command does not look valid.");
         return;
     }
 
@@ -882,7 +1883,7 @@ void command(int id, int fd, char *parameter)
     /* search for required variable "command" */
     if((command = strstr(parameter, "id=")) == NULL) {
         DBG("no command id specified\n");
-        send_error(fd, 400, "no GET variable \"id=...\" found, it is required to specify which command id to execute");
+        send_error(context_fd, 400, "no GET variable \"id=...\" found, it is required to specify which command id to execute");
         return;
     }
 
@@ -890,7 +1891,7 @@ void command(int id, int fd, char *parameter)
     command += strlen("id=");
     len = strspn(command, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_1234567890");
     if((command = strndup(command, len)) == NULL) {
-        send_error(fd, 500, "could not allocate memory");
+        send_error(context_fd, 500, "could not allocate memory");
         LOG("could not allocate memory\n");
         return;
     }
@@ -900,7 +1901,7 @@ void command(int id, int fd, char *parameter)
     len = strspn(command_id_string, "-1234567890");
     if((svalue = strndup(command_id_string, len)) == NULL) {
         if(command != NULL) free(command);
-        send_error(fd, 500, "could not allocate memory");
+        send_error(context_fd, 500, "could not allocate memory");
         LOG("could not allocate memory\n");
         return;
     }
@@ -914,7 +1915,7 @@ void command(int id, int fd, char *parameter)
         len = strspn(value, "-1234567890");
         if((svalue = strndup(value, len)) == NULL) {
             if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
+            send_error(context_fd, 500, "could not allocate memory");
             LOG("could not allocate memory\n");
             return;
         }
@@ -928,7 +1929,7 @@ void command(int id, int fd, char *parameter)
         len = strspn(value, "-1234567890");
         if((svalue = strndup(value, len)) == NULL) {
             if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
+            send_error(context_fd, 500, "could not allocate memory");
             LOG("could not allocate memory\n");
             return;
         }
@@ -942,7 +1943,7 @@ void command(int id, int fd, char *parameter)
         len = strspn(value, "-1234567890");
         if((svalue = strndup(value, len)) == NULL) {
             if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
+            send_error(context_fd, 500, "could not allocate memory");
             LOG("could not allocate memory\n");
             return;
         }
@@ -968,7 +1969,7 @@ void command(int id, int fd, char *parameter)
         len = strspn(value, "-1234567890");
         if((svalue = strndup(value, len)) == NULL) {
             if(command != NULL) free(command);
-            send_error(fd, 500, "could not allocate memory");
+            send_error(context_fd, 500, "could not allocate memory");
             LOG("could not allocate memory\n");
             return;
         }
@@ -980,17 +1981,19 @@ void command(int id, int fd, char *parameter)
 
     switch(dest) {
     case Dest_Input:
-        if(plugin_no < pglobal->incnt) {
+        if(plugin_no >= 0 && plugin_no < pglobal->incnt && pglobal->in[plugin_no].cmd != NULL) {
             res = pglobal->in[plugin_no].cmd(plugin_no, command_id, group, ivalue, value);
         } else {
-            DBG("Invalid plugin number: %d because only %d input plugins loaded", plugin_no,  pglobal->incnt-1);
+            DBG("Invalid plugin number: %d because only %d input plugins loaded or it takes no commands", plugin_no,  pglobal->incnt-1);
+            res = -1;
         }
         break;
     case Dest_Output:
-        if(plugin_no < pglobal->outcnt) {
+        if(plugin_no >= 0 && plugin_no < pglobal->outcnt && pglobal->out[plugin_no].cmd != NULL) {
             res = pglobal->out[plugin_no].cmd(plugin_no, command_id, group, ivalue, value);
         } else {
-            DBG("Invalid plugin number: %d because only %d output plugins loaded", plugin_no,  pglobal->incnt-1);
+            DBG("Invalid plugin number: %d because only %d output plugins loaded or it takes no commands", plugin_no,  pglobal->outcnt-1);
+            res = -1;
         }
         break;
     case Dest_Program:
@@ -999,6 +2002,9 @@ void command(int id, int fd, char *parameter)
         fprintf(stderr, "Illegal command destination: %d\n", dest);
     }
 
+    if(res == 0 && (dest == Dest_Input || dest == Dest_Output))
+        control_changed(dest, plugin_no, command_id, group, ivalue);
+
     /* Send HTTP-response */
     sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
             "Content-type: text/plain\r\n" \
@@ -1006,7 +2012,7 @@ void command(int id, int fd, char *parameter)
             "\r\n" \
             "%s: %d", command, res);
 
-    if(write(fd, buffer, strlen(buffer)) < 0) {
+    if(http_write(context_fd, buffer, strlen(buffer)) < 0) {
         DBG("write failed, done anyway\n");
     }
 
@@ -1014,6 +2020,24 @@ void command(int id, int fd, char *parameter)
     if(svalue != NULL) free(svalue);
 }
 
+/******************************************************************************
+Description.: decide if the client wants to keep the connection open,
+              HTTP/1.1 does so unless told otherwise, HTTP/1.0 only if asked
+Input Value.: the parsed request
+Return Value: 1 for a persistent connection, 0 otherwise
+******************************************************************************/
+static int wants_keep_alive(request *req)
+{
+    if(req->connection != NULL) {
+        if(strcasestr(req->connection, "close") != NULL)
+            return 0;
+        if(strcasestr(req->connection, "keep-alive") != NULL)
+            return 1;
+    }
+
+    return req->version != NULL && strcmp(req->version, "HTTP/1.1") == 0;
+}
+
 /******************************************************************************
 Description.: Serve a connected TCP-client. This thread function is called
               for each connect of a HTTP client like a webbrowser. It determines
@@ -1027,10 +2051,7 @@ Return Value: always NULL
 /* thread for clients that connected to this server */
 void *client_thread(void *arg)
 {
-    int cnt;
-    char query_suffixed = 0;
-    int input_number = 0;
-    char buffer[BUFFER_SIZE] = {0}, *pb = buffer;
+    int length, keep_alive, input, timeout = 5;
     iobuffer iobuf;
     request req;
     cfd lcfd; /* local-connected-file-descriptor */
@@ -1042,376 +2063,231 @@ void *client_thread(void *arg)
     } else
         return NULL;
 
-    /* initializes the structures */
-    init_iobuffer(&iobuf);
-    init_request(&req);
-
-    /* What does the client want to receive? Read the request. */
-    memset(buffer, 0, sizeof(buffer));
-    if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-        close(lcfd.fd);
+    #ifdef USE_OPENSSL
+    if(lcfd.pc->ssl_ctx != NULL && tls_accept(&lcfd, 5) == -1) {
+        http_close(&lcfd);
         return NULL;
     }
-
-    req.query_string = NULL;
-
-    /* determine what to deliver */
-    if(strstr(buffer, "GET /?action=snapshot") != NULL) {
-        req.type = A_SNAPSHOT;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #ifdef WXP_COMPAT
-    } else if((strstr(buffer, "GET /cam") != NULL) && (strstr(buffer, ".jpg") != NULL)) {
-        req.type = A_SNAPSHOT_WXP;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #endif
-    } else if(strstr(buffer, "POST /stream") != NULL) {
-        req.type = A_STREAM;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    } else if(strstr(buffer, "GET /?action=stream") != NULL) {
-        req.type = A_STREAM;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #ifdef WXP_COMPAT
-    } else if((strstr(buffer, "GET /cam") != NULL) && (strstr(buffer, ".mjpg") != NULL)) {
-        req.type = A_STREAM_WXP;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
     #endif
-    } else if(strstr(buffer, "GET /?action=take") != NULL) {
-        int len;
-        req.type = A_TAKE;
-        query_suffixed = 255;
 
-        /* advance by the length of known string */
-        if((pb = strstr(buffer, "GET /?action=take")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            query_suffixed = 0;
-            return NULL;
-        }
-        pb += strlen("GET /?action=take"); // a pb points to thestring after the first & after command
+    /* initializes the structures */
+    init_iobuffer(&iobuf);
 
-        /* only accept certain characters */
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 0), 100);
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
-        }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
+    /* a persistent connection continues with the next request */
+    do {
+        init_request(&req);
+        keep_alive = 0;
 
-        if(unescape(req.parameter) == -1) {
-            free(req.parameter);
-            send_error(lcfd.fd, 500, "could not properly unescape command parameter string");
-            LOG("could not properly unescape command parameter string\n");
-            close(lcfd.fd);
+        /* What does the client want to receive? Read the request. */
+        if((length = read_request(&lcfd, &iobuf, timeout)) == -1) {
+            http_close(&lcfd);
             return NULL;
         }
-    } else if((strstr(buffer, "GET /input") != NULL) && (strstr(buffer, ".json") != NULL)) {
-        req.type = A_INPUT_JSON;
-        query_suffixed = 255;
-    } else if((strstr(buffer, "GET /output") != NULL) && (strstr(buffer, ".json") != NULL)) {
-        req.type = A_OUTPUT_JSON;
-        query_suffixed = 255;
-    } else if(strstr(buffer, "GET /program.json") != NULL) {
-        req.type = A_PROGRAM_JSON;
-    #ifdef MANAGMENT
-    } else if(strstr(buffer, "GET /clients.json") != NULL) {
-        req.type = A_CLIENTS_JSON;
-    #endif
-    } else if(strstr(buffer, "GET /?action=command") != NULL) {
-        int len;
-        req.type = A_COMMAND;
 
-        /* advance by the length of known string */
-        if((pb = strstr(buffer, "GET /?action=command")) == NULL) {
+        /* determine what to deliver */
+        if(parse_request(iobuf.buffer, length, &req, &lcfd.pc->conf) == -1 || req.type == A_UNKNOWN) {
             DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
+            send_error(&lcfd, 400, "Malformed HTTP request");
+            http_close(&lcfd);
             return NULL;
         }
-        pb += strlen("GET /?action=command"); // a pb points to thestring after the first & after command
 
-        /* only accept certain characters */
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 0), 100);
+        /*
+         * path prefixes and ports can be bound to an input, it is used unless
+         * the request names one, the path prefix is more specific
+         */
+        input = (req.path_input >= 0) ? req.path_input : lcfd.listener->input;
+        if(!req.numbered && input >= 0 &&
+           (req.type == A_SNAPSHOT || req.type == A_STREAM || req.type == A_TAKE ||
+            req.type == A_INPUT_JSON || req.type == A_WEBSOCKET))
+            req.input_number = input;
 
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
+        #ifdef MANAGMENT
+        /* polling for the next frame is limited by the framerate already */
+        if(((req.type == A_SNAPSHOT && strstr(req.parameter, "&after=") == NULL) ||
+            req.type == A_SNAPSHOT_WXP ||
+            req.type == A_STREAM || req.type == A_STREAM_WXP ||
+            req.type == A_WEBSOCKET) &&
+           check_client_status(lcfd.client)) {
+            req.type = A_UNKNOWN;
+            __atomic_add_fetch(&lcfd.client->last_take_time, piggy_fine * 1000000LL, __ATOMIC_RELAXED);
+            send_error(&lcfd, 403, "frame already sent");
         }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
+        #endif
 
-        if(unescape(req.parameter) == -1) {
-            free(req.parameter);
-            send_error(lcfd.fd, 500, "could not properly unescape command parameter string");
+        if((req.type == A_COMMAND || req.type == A_TAKE) && unescape(req.parameter) == -1) {
+            send_error(&lcfd, 500, "could not properly unescape command parameter string");
             LOG("could not properly unescape command parameter string\n");
-            close(lcfd.fd);
-            return NULL;
-        }
-
-        DBG("command parameter (len: %d): \"%s\"\n", len, req.parameter);
-    } else {
-        int len;
-
-        DBG("try to serve a file\n");
-        req.type = A_FILE;
-
-        if((pb = strstr(buffer, "GET /")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
+            http_close(&lcfd);
             return NULL;
         }
 
-        pb += strlen("GET /");
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890"), 0), 100);
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
-        }
-
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
-
-        if (strstr(pb, ".cgi") != NULL) {
-            req.type = A_CGI;
-            pb = strchr(pb, '?');
-            if (pb != NULL) {
-                pb++; // skip the ?
-                len = strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890=&");
-                req.query_string = malloc(len + 1);
-                if (req.query_string == NULL)
-                    exit(EXIT_FAILURE);
-                strncpy(req.query_string, pb, len);
-            } else {
-                req.query_string = malloc(2);
-                if (req.query_string == NULL)
-                    exit(EXIT_FAILURE);
-                sprintf(req.query_string, " ");
+        /* check for username and password if parameter -c was given */
+        if(lcfd.pc->conf.credentials != NULL) {
+            if(req.credentials == NULL || strcmp(lcfd.pc->conf.credentials, req.credentials) != 0) {
+                DBG("access denied\n");
+                send_error(&lcfd, 401, "username and password do not match to configuration");
+                http_close(&lcfd);
+                return NULL;
             }
-        }
-        DBG("parameter (len: %d): \"%s\"\n", len, req.parameter);
-    }
-
-    /*
-     * Since when we are working with multiple input plugins
-     * there are some url which could have a _[plugin number suffix]
-     * For compatibility reasons it could be left in that case the output will be
-     * generated from the 0. input plugin
-     */
-    if(query_suffixed) {
-        char *sch = strchr(buffer, '_');
-        if(sch != NULL) {  // there is an _ in the url so the input number should be present
-            DBG("Suffix character: %s\n", sch + 1); // FIXME if more than 10 input plugin is added
-            char numStr[3];
-            memset(numStr, 0, 3);
-            strncpy(numStr, sch + 1, 1);
-            input_number = atoi(numStr);
-
-            if ((req.type == A_SNAPSHOT_WXP) || (req.type == A_STREAM_WXP)) { // webcamxp adds offset to the camera number
-                input_number--;
-            }
-        }
-        DBG("plugin_no: %d\n", input_number);
-    }
-
-    /*
-     * parse the rest of the HTTP-request
-     * the end of the request-header is marked by a single, empty line with "\r\n"
-     */
-    do {
-        memset(buffer, 0, sizeof(buffer));
-
-        if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-            free_request(&req);
-            close(lcfd.fd);
-            return NULL;
+            DBG("access granted\n");
         }
 
-        if(strcasestr(buffer, "User-Agent: ") != NULL) {
-            req.client = strdup(buffer + strlen("User-Agent: "));
-        } else if(strcasestr(buffer, "Authorization: Basic ") != NULL) {
-            req.credentials = strdup(buffer + strlen("Authorization: Basic "));
-            decodeBase64(req.credentials);
-            DBG("username:password: %s\n", req.credentials);
-        }
-
-    } while(cnt > 2 && !(buffer[0] == '\r' && buffer[1] == '\n'));
-
-    /* check for username and password if parameter -c was given */
-    if(lcfd.pc->conf.credentials != NULL) {
-        if(req.credentials == NULL || strcmp(lcfd.pc->conf.credentials, req.credentials) != 0) {
-            DBG("access denied\n");
-            send_error(lcfd.fd, 401, "username and password do not match to configuration");
-            close(lcfd.fd);
-            free_request(&req);
-            return NULL;
-        }
-        DBG("access granted\n");
-    }
-
-    /* now it's time to answer */
-    if (query_suffixed) {
-        if (req.type == A_OUTPUT_JSON) {
-            if(!(input_number < pglobal->outcnt)) {
-                DBG("Output number: %d out of range (valid: 0..%d)\n", input_number, pglobal->outcnt-1);
-                send_error(lcfd.fd, 404, "Invalid output plugin number");
+        /*
+         * Since when we are working with multiple input plugins
+         * there are some url which could have a _[plugin number suffix]
+         * For compatibility reasons it could be left in that case the output will be
+         * generated from the 0. input plugin
+         */
+        switch(req.type) {
+        case A_OUTPUT_JSON:
+            if(req.input_number < 0 || !(req.input_number < pglobal->outcnt)) {
+                DBG("Output number: %d out of range (valid: 0..%d)\n", req.input_number, pglobal->outcnt-1);
+                send_error(&lcfd, 404, "Invalid output plugin number");
                 req.type = A_UNKNOWN;
             }
-        } else {
-            if(!(input_number < pglobal->incnt)) {
-                DBG("Input number: %d out of range (valid: 0..%d)\n", input_number, pglobal->incnt-1);
-                send_error(lcfd.fd, 404, "Invalid input plugin number");
+            break;
+        case A_SNAPSHOT:
+        case A_SNAPSHOT_WXP:
+        case A_STREAM:
+        case A_STREAM_WXP:
+        case A_TAKE:
+        case A_INPUT_JSON:
+        case A_WEBSOCKET:
+            if(req.input_number < 0 || !(req.input_number < pglobal->incnt)) {
+                DBG("Input number: %d out of range (valid: 0..%d)\n", req.input_number, pglobal->incnt-1);
+                send_error(&lcfd, 404, "Invalid input plugin number");
                 req.type = A_UNKNOWN;
             }
+            break;
+        default:
+            break;
         }
-    }
 
-    switch(req.type) {
-    case A_SNAPSHOT_WXP:
-    case A_SNAPSHOT:
-        DBG("Request for snapshot from input: %d\n", input_number);
-        send_snapshot(&lcfd, input_number);
-        break;
-    case A_STREAM:
-        DBG("Request for stream from input: %d\n", input_number);
-        send_stream(&lcfd, input_number);
-        break;
-    #ifdef WXP_COMPAT
-    case A_STREAM_WXP:
-        DBG("Request for WXP compat stream from input: %d\n", input_number);
-        send_stream_wxp(&lcfd, input_number);
-        break;
-    #endif
-    case A_COMMAND:
-        if(lcfd.pc->conf.nocommands) {
-            send_error(lcfd.fd, 501, "this server is configured to not accept commands");
+        /* now it's time to answer */
+        switch(req.type) {
+        case A_SNAPSHOT:
+            if(strstr(req.parameter, "&after=") != NULL) {
+                DBG("Request for the next frame from input: %d\n", req.input_number);
+                keep_alive = send_next_frame(&lcfd, req.input_number, req.parameter, wants_keep_alive(&req)) == 0;
+                break;
+            }
+            /* fall through */
+        case A_SNAPSHOT_WXP:
+            DBG("Request for snapshot from input: %d\n", req.input_number);
+            send_snapshot(&lcfd, req.input_number);
+            break;
+        case A_STREAM:
+            DBG("Request for stream from input: %d\n", req.input_number);
+            send_stream(&lcfd, req.input_number);
+            break;
+        case A_WEBSOCKET:
+            DBG("Request for WebSocket stream from input: %d\n", req.input_number);
+            if(req.upgrade == NULL || strcasecmp(req.upgrade, "websocket") != 0)
+                send_error(&lcfd, 400, "WebSocket endpoint requires an Upgrade: websocket request");
+            else
+                send_websocket(&lcfd, req.input_number, req.websocket_key);
+            break;
+        case A_EVENTS:
+            DBG("Request for the event stream\n");
+            send_events(&lcfd, req.last_event_id);
             break;
-        }
-        command(lcfd.pc->id, lcfd.fd, req.parameter);
-        break;
-    case A_INPUT_JSON:
-        DBG("Request for the Input plugin descriptor JSON file\n");
-        send_input_JSON(lcfd.fd, input_number);
-        break;
-    case A_OUTPUT_JSON:
-        DBG("Request for the Output plugin descriptor JSON file\n");
-        send_output_JSON(lcfd.fd, input_number);
-        break;
-    case A_PROGRAM_JSON:
-        DBG("Request for the program descriptor JSON file\n");
-        send_program_JSON(lcfd.fd);
-        break;
-    #ifdef MANAGMENT
-    case A_CLIENTS_JSON:
-        DBG("Request for the clients JSON file\n");
-        send_clients_JSON(lcfd.fd);
-        break;
-    #endif
-    case A_FILE:
-        if(lcfd.pc->conf.www_folder == NULL)
-            send_error(lcfd.fd, 501, "no www-folder configured");
-        else
-            send_file(lcfd.pc->id, lcfd.fd, req.parameter);
-        break;
-    /*
-        With the take argument we try to save the current image to file before we transmit it to the user.
-        This is done trough the output_file plugin.
-        If it not loaded, or the file could not be saved then we won't transmit the frame.
-    */
-    case A_TAKE: {
-        int i, ret = 0, found = 0;
-        for (i = 0; i<pglobal->outcnt; i++) {
-            if (pglobal->out[i].name != NULL) {
-                if (strstr(pglobal->out[i].name, "FILE output plugin")) {
-                    found = 255;
-                    DBG("output_file found id: %d\n", i);
-                    char *filename = NULL;
-                    char *filenamearg = NULL;
-                    int len = 0;
-                    DBG("Buffer: %s \n", req.parameter);
-                    if((filename = strstr(req.parameter, "filename=")) != NULL) {
-                        filename += strlen("filename=");
-                        char *fn = strchr(filename, '&');
-                        if (fn == NULL)
-                            len = strlen(filename);
-                        else
-                            len = (int)(fn - filename);
-                        filenamearg = (char*)calloc(len, sizeof(char));
-                        memcpy(filenamearg, filename, len);
-                        DBG("Filename = %s\n", filenamearg);
-                        //int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int value, char *valueStr)
-                        ret = pglobal->out[i].cmd(i, OUT_FILE_CMD_TAKE, IN_CMD_GENERIC, 0, filenamearg);
-                    } else {
-                        DBG("filename is not specified int the URL\n");
-                        send_error(lcfd.fd, 404, "The &filename= must present for the take command in the URL");
+        #ifdef WXP_COMPAT
+        case A_STREAM_WXP:
+            DBG("Request for WXP compat stream from input: %d\n", req.input_number);
+            send_stream_wxp(&lcfd, req.input_number);
+            break;
+        #endif
+        case A_COMMAND:
+            if(lcfd.pc->conf.nocommands) {
+                send_error(&lcfd, 501, "this server is configured to not accept commands");
+                break;
+            }
+            command(lcfd.pc->id, &lcfd, req.parameter);
+            break;
+        case A_INPUT_JSON:
+            DBG("Request for the Input plugin descriptor JSON file\n");
+            send_input_JSON(&lcfd, req.input_number);
+            break;
+        case A_OUTPUT_JSON:
+            DBG("Request for the Output plugin descriptor JSON file\n");
+            send_output_JSON(&lcfd, req.input_number);
+            break;
+        case A_PROGRAM_JSON:
+            DBG("Request for the program descriptor JSON file\n");
+            send_program_JSON(&lcfd);
+            break;
+        #ifdef MANAGMENT
+        case A_CLIENTS_JSON:
+            DBG("Request for the clients JSON file\n");
+            send_clients_JSON(&lcfd);
+            break;
+        #endif
+        case A_FILE:
+            if(lcfd.pc->conf.www_folder == NULL)
+                send_error(&lcfd, 501, "no www-folder configured");
+            else
+                send_file(lcfd.pc->id, &lcfd, req.parameter, req.accept_encoding);
+            break;
+        /*
+            With the take argument we try to save the current image to file before we transmit it to the user.
+            This is done trough the output_file plugin.
+            If it not loaded, or the file could not be saved then we won't transmit the frame.
+        */
+        case A_TAKE: {
+            int i, ret = 0, found = 0;
+            for (i = 0; i<pglobal->outcnt; i++) {
+                if (pglobal->out[i].name != NULL) {
+                    if (strstr(pglobal->out[i].name, "FILE output plugin")) {
+                        found = 255;
+                        DBG("output_file found id: %d\n", i);
+                        char *filename = NULL;
+                        DBG("Buffer: %s \n", req.parameter);
+                        if((filename = strstr(req.parameter, "filename=")) != NULL) {
+                            /* the parameter lives in the request buffer, terminate the filename in place */
+                            filename += strlen("filename=");
+                            filename[strcspn(filename, "&")] = '\0';
+                            DBG("Filename = %s\n", filename);
+                            //int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int value, char *valueStr)
+                            ret = pglobal->out[i].cmd(i, OUT_FILE_CMD_TAKE, IN_CMD_GENERIC, 0, filename);
+                        } else {
+                            DBG("filename is not specified int the URL\n");
+                            send_error(&lcfd, 404, "The &filename= must present for the take command in the URL");
+                        }
+                        break;
                     }
-                    break;
                 }
             }
-        }
 
-        if (found == 0) {
-            LOG("FILE CHANGE TEST output plugin not loaded\n");
-            send_error(lcfd.fd, 404, "FILE output plugin not loaded, taking snapshot not possible");
-        } else {
-            if (ret == 0) {
-                send_snapshot(&lcfd, input_number);
+            if (found == 0) {
+                LOG("FILE CHANGE TEST output plugin not loaded\n");
+                send_error(&lcfd, 404, "FILE output plugin not loaded, taking snapshot not possible");
             } else {
-                send_error(lcfd.fd, 404, "Taking snapshot failed!");
+                if (ret == 0) {
+                    send_snapshot(&lcfd, req.input_number);
+                } else {
+                    send_error(&lcfd, 404, "Taking snapshot failed!");
+                }
             }
+            } break;
+        case A_CGI:
+            DBG("cgi script: %s requested\n", req.parameter);
+            execute_cgi(lcfd.pc->id, &lcfd, req.parameter, req.query_string);
+            break;
+        default:
+            DBG("unknown request\n");
         }
-        } break;
-    case A_CGI:
-        DBG("cgi script: %s requested\n", req.parameter);
-        execute_cgi(lcfd.pc->id, lcfd.fd, req.parameter, req.query_string);
-        break;
-    default:
-        DBG("unknown request\n");
-    }
 
-    close(lcfd.fd);
-    free_request(&req);
+        /* keep the bytes of a pipelined request */
+        if(keep_alive) {
+            iobuf.level -= length;
+            memmove(iobuf.buffer, iobuf.buffer + length, iobuf.level + 1);
+            iobuf.scanned = 0;
+            timeout = KEEP_ALIVE_TIMEOUT;
+        }
+    } while(keep_alive && !pglobal->stop);
+
+    http_close(&lcfd);
 
     DBG("leaving HTTP client thread\n");
     return NULL;
@@ -1449,9 +2325,9 @@ void *server_thread(void *arg)
     socklen_t addr_len = sizeof(struct sockaddr_storage);
     fd_set selectfds;
     int max_fds = 0;
-    char name[NI_MAXHOST];
+    char name[NI_MAXHOST] = "";
     int err;
-    int i;
+    int i, port, first;
 
     context *pcontext = arg;
     pglobal = pcontext->pglobal;
@@ -1464,84 +2340,78 @@ void *server_thread(void *arg)
     hints.ai_flags = AI_PASSIVE;
     hints.ai_socktype = SOCK_STREAM;
 
-    snprintf(name, sizeof(name), "%d", ntohs(pcontext->conf.port));
-    if((err = getaddrinfo(pcontext->conf.hostname, name, &hints, &aip)) != 0) {
-        perror(gai_strerror(err));
-        exit(EXIT_FAILURE);
-    }
-
     for(i = 0; i < MAX_SD_LEN; i++)
         pcontext->sd[i] = -1;
 
-    #ifdef MANAGMENT
-    if (pthread_mutex_init(&client_infos.mutex, NULL)) {
-        perror("Mutex initialization failed");
-        exit(EXIT_FAILURE);
-    }
-
-    client_infos.client_count = 0;
-    client_infos.infos = NULL;
-    #endif
+    pthread_mutex_init(&pcontext->bucket.mutex, NULL);
+    pcontext->bucket.tokens = 0;
+    pcontext->bucket.last.tv_sec = 0;
+    pcontext->bucket.last.tv_nsec = 0;
 
-    /* open sockets for server (1 socket / address family) */
+    /* open sockets for server (1 socket / address family and port), this thread accepts on all */
     i = 0;
-    for(aip2 = aip; aip2 != NULL; aip2 = aip2->ai_next) {
-        if((pcontext->sd[i] = socket(aip2->ai_family, aip2->ai_socktype, 0)) < 0) {
-            continue;
+    for(port = 0; port < pcontext->conf.port_count; port++) {
+        snprintf(name, sizeof(name), "%d", pcontext->conf.ports[port].port);
+        if((err = getaddrinfo(pcontext->conf.hostname, name, &hints, &aip)) != 0) {
+            perror(gai_strerror(err));
+            exit(EXIT_FAILURE);
         }
 
-        /* ignore "socket already in use" errors */
-        on = 1;
-        if(setsockopt(pcontext->sd[i], SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
-            perror("setsockopt(SO_REUSEADDR) failed\n");
-        }
+        first = i;
+        for(aip2 = aip; aip2 != NULL && i < MAX_SD_LEN; aip2 = aip2->ai_next) {
+            if((pcontext->sd[i] = socket(aip2->ai_family, aip2->ai_socktype, 0)) < 0) {
+                continue;
+            }
 
-        /* IPv6 socket should listen to IPv6 only, otherwise we will get "socket already in use" */
-        on = 1;
-        if(aip2->ai_family == AF_INET6 && setsockopt(pcontext->sd[i], IPPROTO_IPV6, IPV6_V6ONLY,
-                (const void *)&on , sizeof(on)) < 0) {
-            perror("setsockopt(IPV6_V6ONLY) failed\n");
-        }
+            /* ignore "socket already in use" errors */
+            on = 1;
+            if(setsockopt(pcontext->sd[i], SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+                perror("setsockopt(SO_REUSEADDR) failed\n");
+            }
 
-        /* perhaps we will use this keep-alive feature oneday */
-        /* setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)); */
+            /* IPv6 socket should listen to IPv6 only, otherwise we will get "socket already in use" */
+            on = 1;
+            if(aip2->ai_family == AF_INET6 && setsockopt(pcontext->sd[i], IPPROTO_IPV6, IPV6_V6ONLY,
+                    (const void *)&on , sizeof(on)) < 0) {
+                perror("setsockopt(IPV6_V6ONLY) failed\n");
+            }
 
-        if(bind(pcontext->sd[i], aip2->ai_addr, aip2->ai_addrlen) < 0) {
-            perror("bind");
-            pcontext->sd[i] = -1;
-            continue;
-        }
+            /* perhaps we will use this keep-alive feature oneday */
+            /* setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)); */
 
-        if(listen(pcontext->sd[i], 10) < 0) {
-            perror("listen");
-            pcontext->sd[i] = -1;
-        } else {
-            i++;
-            if(i >= MAX_SD_LEN) {
-                OPRINT("%s(): maximum number of server sockets exceeded", __FUNCTION__);
-                i--;
-                break;
+            if(bind(pcontext->sd[i], aip2->ai_addr, aip2->ai_addrlen) < 0) {
+                perror("bind");
+                close(pcontext->sd[i]);
+                pcontext->sd[i] = -1;
+                continue;
+            }
+
+            if(listen(pcontext->sd[i], 10) < 0) {
+                perror("listen");
+                close(pcontext->sd[i]);
+                pcontext->sd[i] = -1;
+            } else {
+                pcontext->sd_listener[i] = &pcontext->conf.ports[port];
+                i++;
             }
         }
-    }
 
-    pcontext->sd_len = i;
+        if(aip2 != NULL)
+            OPRINT("%s(): maximum number of server sockets exceeded\n", __FUNCTION__);
+        freeaddrinfo(aip);
 
-    if(pcontext->sd_len < 1) {
-        OPRINT("%s(): bind(%d) failed\n", __FUNCTION__, htons(pcontext->conf.port));
-        closelog();
-        exit(EXIT_FAILURE);
+        if(i == first) {
+            OPRINT("%s(): bind(%d) failed\n", __FUNCTION__, pcontext->conf.ports[port].port);
+            closelog();
+            exit(EXIT_FAILURE);
+        }
     }
 
+    pcontext->sd_len = i;
+
     /* create a child for every client that connects */
     while(!pglobal->stop) {
-        //int *pfd = (int *)malloc(sizeof(int));
-        cfd *pcfd = malloc(sizeof(cfd));
-
-        if(pcfd == NULL) {
-            fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
-            exit(EXIT_FAILURE);
-        }
+        cfd *pcfd;
 
         DBG("waiting for clients to connect\n");
 
@@ -1565,10 +2435,21 @@ void *server_thread(void *arg)
             }
         } while(err <= 0);
 
-        for(i = 0; i < max_fds + 1; i++) {
+        for(i = 0; i < MAX_SD_LEN; i++) {
             if(pcontext->sd[i] != -1 && FD_ISSET(pcontext->sd[i], &selectfds)) {
+                /* each connection gets its own, several sockets may be ready at once */
+                if((pcfd = malloc(sizeof(cfd))) == NULL) {
+                    fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                addr_len = sizeof(client_addr);
                 pcfd->fd = accept(pcontext->sd[i], (struct sockaddr *)&client_addr, &addr_len);
                 pcfd->pc = pcontext;
+                pcfd->listener = pcontext->sd_listener[i];
+                #ifdef USE_OPENSSL
+                pcfd->ssl = NULL;
+                #endif
 
                 /* start new thread that will handle this TCP connected client */
                 DBG("create thread to handle client that just established a connection\n");
@@ -1577,12 +2458,16 @@ void *server_thread(void *arg)
                     DBG("serving client: %s\n", name);
                 }
 
+                pcfd->client = NULL;
                 #if defined(MANAGMENT)
                 pcfd->client = add_client(name);
                 #endif
+                if(pcfd->client == NULL && pcontext->conf.client_rate > 0)
+                    pcfd->client = add_client(name);
 
                 if(pthread_create(&client, NULL, &client_thread, pcfd) != 0) {
                     DBG("could not launch another client thread\n");
+                    release_client(pcfd->client);
                     close(pcfd->fd);
                     free(pcfd);
                     continue;
@@ -1598,298 +2483,454 @@ void *server_thread(void *arg)
     return NULL;
 }
 
+/*
+ * the JSON documents are rendered once, including the HTTP header, and
+ * shared by all clients until a control value of the plugin changes
+ */
+static pthread_mutex_t json_lock = PTHREAD_MUTEX_INITIALIZER;
+static json_cache input_json[MAX_INPUT_PLUGINS];
+static json_cache output_json[MAX_OUTPUT_PLUGINS];
+static json_cache program_json;
+
 /******************************************************************************
-Description.: Send a JSON file which is contains information about the input plugin's
-              acceptable parameters
-Input Value.: fildescriptor fd to send the answer to
+Description.: append formatted text to a string buffer, the buffer grows
+              as necessary. After an allocation failure the buffer is marked
+              as failed and all further text is ignored.
+Input Value.: * sb.....: the string buffer, zero initialized before first use
+              * format.: printf format
 Return Value: -
 ******************************************************************************/
-void send_input_JSON(int fd, int input_number)
+void strbuf_printf(strbuf *sb, const char *format, ...)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    int i;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
+    va_list ap;
+    size_t size;
+    char *tmp;
+    int length;
 
-    DBG("Serving the input plugin %d descriptor JSON file\n", input_number);
+    if(sb->failed)
+        return;
 
+    va_start(ap, format);
+    length = vsnprintf(sb->data + sb->length, sb->size - sb->length, format, ap);
+    va_end(ap);
 
-    sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"controls\": [\n");
-    if(pglobal->in[input_number].in_parameters != NULL) {
-        for(i = 0; i < pglobal->in[input_number].parametercount; i++) {
-
-            char *menuString = NULL;
-            if(pglobal->in[input_number].in_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                if(pglobal->in[input_number].in_parameters[i].menuitems != NULL) {
-                    int j, k = 1;
-                    for(j = pglobal->in[input_number].in_parameters[i].ctrl.minimum; j <= pglobal->in[input_number].in_parameters[i].ctrl.maximum; j++) {
-                        char *tempName = NULL; // temporary storage for name sanity checking
-
-                        int prevSize = 0;
-                        int itemLength = strlen((char*)&pglobal->in[input_number].in_parameters[i].menuitems[j].name);
-                        tempName = (char*)calloc(itemLength + 1, sizeof(char));  // allocate space for the sanity checking
-                        if (tempName == NULL) {
-                            DBG("Realloc/calloc failed: %s\n", strerror(errno));
-                            return;
-                        }
+    if(length < 0) {
+        sb->failed = 1;
+        return;
+    }
 
-                        check_JSON_string((char*)&pglobal->in[input_number].in_parameters[i].menuitems[j].name, tempName); // sanity check the string after non printable characters
+    if(sb->length + length < sb->size) {
+        sb->length += length;
+        return;
+    }
 
-                        itemLength += strlen("\"\": \"\"");
+    /* grow by doubling so building a document stays linear */
+    size = (sb->size == 0) ? BUFFER_SIZE : sb->size;
+    while(size <= sb->length + length)
+        size *= 2;
 
-                        if (menuString == NULL) {
-                            menuString = calloc(itemLength + 5, sizeof(char));
-                        } else {
-                            menuString = realloc(menuString, (strlen(menuString) + itemLength + 5) * (sizeof(char)));
-                        }
+    if((tmp = realloc(sb->data, size)) == NULL) {
+        sb->failed = 1;
+        return;
+    }
+    sb->data = tmp;
+    sb->size = size;
 
-                        if (menuString == NULL) {
-                            DBG("Realloc/calloc failed: %s\n", strerror(errno));
-                            return;
-                        }
-                        prevSize = strlen(menuString);
+    va_start(ap, format);
+    vsnprintf(sb->data + sb->length, sb->size - sb->length, format, ap);
+    va_end(ap);
+    sb->length += length;
+}
 
-                        if(j != pglobal->in[input_number].in_parameters[i].ctrl.maximum) {
-                            sprintf(menuString + prevSize, "\"%d\": \"%s\", ", j , tempName);
-                        } else {
-                            sprintf(menuString + prevSize, "\"%d\": \"%s\"", j , tempName);
-                        }
-                        k++;
-                        free(tempName);
-                    }
-                }
-            }
+/******************************************************************************
+Description.: cheap checksum of everything in the input plugin's JSON that may
+              change at runtime, it detects changes that were not made through
+              this server without formatting the document
+Input Value.: input_number is the number of the input plugin
+Return Value: checksum
+******************************************************************************/
+static unsigned long input_JSON_fingerprint(int input_number)
+{
+    input *in = &pglobal->in[input_number];
+    unsigned long hash = 5381;
+    int i;
 
-            sprintf(buffer + strlen(buffer),
-                    "{\n"
-                    "\"name\": \"%s\",\n"
-                    "\"id\": \"%d\",\n"
-                    "\"type\": \"%d\",\n"
-                    "\"min\": \"%d\",\n"
-                    "\"max\": \"%d\",\n"
-                    "\"step\": \"%d\",\n"
-                    "\"default\": \"%d\",\n"
-                    "\"value\": \"%d\",\n"
-                    "\"dest\": \"0\",\n"
-                    "\"flags\": \"%d\",\n"
-                    "\"group\": \"%d\"",
-                    pglobal->in[input_number].in_parameters[i].ctrl.name,
-                    pglobal->in[input_number].in_parameters[i].ctrl.id,
-                    pglobal->in[input_number].in_parameters[i].ctrl.type,
-                    pglobal->in[input_number].in_parameters[i].ctrl.minimum,
-                    pglobal->in[input_number].in_parameters[i].ctrl.maximum,
-                    pglobal->in[input_number].in_parameters[i].ctrl.step,
-                    pglobal->in[input_number].in_parameters[i].ctrl.default_value,
-                    pglobal->in[input_number].in_parameters[i].value,
-                    // 0 is the code of the input plugin
-                    pglobal->in[input_number].in_parameters[i].ctrl.flags,
-                    pglobal->in[input_number].in_parameters[i].group
-                   );
-
-            // append the menu object to the menu typecontrols
-            if(pglobal->in[input_number].in_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                sprintf(buffer + strlen(buffer),
-                        ",\n"
-                        "\"menu\": {%s}\n"
-                        "}",
-                        menuString);
-            } else {
-                sprintf(buffer + strlen(buffer),
-                        "\n"
-                        "}");
-            }
+    hash = hash * 33 + in->parametercount;
+    hash = hash * 33 + in->formatCount;
+    hash = hash * 33 + in->currentFormat;
+    for(i = 0; in->in_parameters != NULL && i < in->parametercount; i++)
+        hash = hash * 33 + in->in_parameters[i].value;
+    for(i = 0; in->in_formats != NULL && i < in->formatCount; i++)
+        hash = hash * 33 + in->in_formats[i].currentResolution;
 
-            if(i != (pglobal->in[input_number].parametercount - 1)) {
-                sprintf(buffer + strlen(buffer), ",\n");
-            }
-            free(menuString);
+    return hash;
+}
+
+/******************************************************************************
+Description.: cheap checksum of the output plugin's control values
+Input Value.: output_number is the number of the output plugin
+Return Value: checksum
+******************************************************************************/
+static unsigned long output_JSON_fingerprint(int output_number)
+{
+    output *out = &pglobal->out[output_number];
+    unsigned long hash = 5381;
+    int i;
+
+    hash = hash * 33 + out->parametercount;
+    for(i = 0; out->out_parameters != NULL && i < out->parametercount; i++)
+        hash = hash * 33 + out->out_parameters[i].value;
+
+    return hash;
+}
+
+/******************************************************************************
+Description.: append the "menu" object of a menu control
+Input Value.: * sb.....: string buffer to append to
+              * control: the menu control
+              * check..: replace non printable characters of the item names
+Return Value: -
+******************************************************************************/
+static void append_JSON_menu(strbuf *sb, control *control, int check)
+{
+    char name[sizeof(control->menuitems[0].name) + 1];
+    int j;
+
+    strbuf_printf(sb, ",\n\"menu\": {");
+    if(control->menuitems != NULL) {
+        for(j = control->ctrl.minimum; j <= control->ctrl.maximum; j++) {
+            memset(name, 0, sizeof(name));
+            if(check)
+                check_JSON_string((char *)control->menuitems[j].name, name);
+            else
+                strncpy(name, (char *)control->menuitems[j].name, sizeof(name) - 1);
+
+            strbuf_printf(sb, "\"%d\": \"%s\"%s", j, name,
+                          (j != control->ctrl.maximum) ? ", " : "");
         }
-    } else {
-        DBG("The input plugin has no paramters\n");
     }
-    sprintf(buffer + strlen(buffer),
-            "\n],\n"
-            /*"},\n"*/);
-
-    sprintf(buffer + strlen(buffer),
-            //"{\n"
-            "\"formats\": [\n");
-    if(pglobal->in[input_number].in_formats != NULL) {
-        for(i = 0; i < pglobal->in[input_number].formatCount; i++) {
-            char *resolutionsString = NULL;
-            int resolutionsStringLength = 0;
-            int j = 0;
-            for(j = 0; j < pglobal->in[input_number].in_formats[i].resolutionCount; j++) {
-                char buffer_num[6];
-                memset(buffer_num, '\0', 6);
-                // JSON format example:
-                // {"0": "320x240", "1": "640x480", "2": "960x720"}
-                sprintf(buffer_num, "%d", j);
-                resolutionsStringLength += strlen(buffer_num);
-                sprintf(buffer_num, "%d", pglobal->in[input_number].in_formats[i].supportedResolutions[j].width);
-                resolutionsStringLength += strlen(buffer_num);
-                sprintf(buffer_num, "%d", pglobal->in[input_number].in_formats[i].supportedResolutions[j].height);
-                resolutionsStringLength += strlen(buffer_num);
-                if(j != (pglobal->in[input_number].in_formats[i].resolutionCount - 1)) {
-                    resolutionsStringLength += (strlen("\"\": \"x\", ") + 5);
-                    if (resolutionsString == NULL)
-                        resolutionsString = calloc(resolutionsStringLength, sizeof(char*));
-                    else
-                        resolutionsString = realloc(resolutionsString, resolutionsStringLength * sizeof(char*));
-                    if (resolutionsString == NULL) {
-                        DBG("Realloc/calloc failed\n");
-                        return;
-                    }
+    strbuf_printf(sb, "}\n");
+}
 
-                    sprintf(resolutionsString + strlen(resolutionsString),
-                            "\"%d\": \"%dx%d\", ",
-                            j,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].width,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].height);
-                } else {
-                    resolutionsStringLength += (strlen("\"\": \"x\"")+5);
-                    if (resolutionsString == NULL)
-                        resolutionsString = calloc(resolutionsStringLength, sizeof(char*));
-                    else
-                        resolutionsString = realloc(resolutionsString, resolutionsStringLength * sizeof(char*));
-                    if (resolutionsString == NULL) {
-                        DBG("Realloc/calloc failed\n");
-                        return;
-                    }
-                    sprintf(resolutionsString + strlen(resolutionsString),
-                            "\"%d\": \"%dx%d\"",
-                            j,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].width,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].height);
-                }
-            }
+/******************************************************************************
+Description.: append the JSON object of one control
+Input Value.: * sb.....: string buffer to append to
+              * control: the control
+              * dest...: 0 for input plugin controls, 1 for output plugins
+Return Value: -
+******************************************************************************/
+static void append_JSON_control(strbuf *sb, control *control, int dest)
+{
+    strbuf_printf(sb,
+                  "{\n"
+                  "\"name\": \"%s\",\n"
+                  "\"id\": \"%d\",\n"
+                  "\"type\": \"%d\",\n"
+                  "\"min\": \"%d\",\n"
+                  "\"max\": \"%d\",\n"
+                  "\"step\": \"%d\",\n"
+                  "\"default\": \"%d\",\n"
+                  "\"value\": \"%d\",\n"
+                  "\"dest\": \"%d\",\n"
+                  "\"flags\": \"%d\",\n"
+                  "\"group\": \"%d\"",
+                  control->ctrl.name,
+                  control->ctrl.id,
+                  control->ctrl.type,
+                  control->ctrl.minimum,
+                  control->ctrl.maximum,
+                  control->ctrl.step,
+                  control->ctrl.default_value,
+                  control->value,
+                  dest,
+                  control->ctrl.flags,
+                  control->group);
+
+    /* only the input plugins' menu items get checked, as before */
+    if(control->ctrl.type == V4L2_CTRL_TYPE_MENU)
+        append_JSON_menu(sb, control, dest == 0);
+    else
+        strbuf_printf(sb, "\n");
+
+    strbuf_printf(sb, "}");
+}
 
-            sprintf(buffer + strlen(buffer),
-                    "{\n"
-                    "\"id\": \"%d\",\n"
-                    "\"name\": \"%s\",\n"
+/******************************************************************************
+Description.: build the JSON document with the input plugin's acceptable
+              parameters and formats
+Input Value.: * sb..........: string buffer to append to
+              * input_number: number of the input plugin
+Return Value: -
+******************************************************************************/
+static void build_input_JSON(strbuf *sb, int input_number)
+{
+    input *in = &pglobal->in[input_number];
+    int i, j;
+
+    strbuf_printf(sb,
+                  "{\n"
+                  "\"controls\": [\n");
+    if(in->in_parameters != NULL) {
+        for(i = 0; i < in->parametercount; i++) {
+            append_JSON_control(sb, &in->in_parameters[i], 0);
+            if(i != (in->parametercount - 1))
+                strbuf_printf(sb, ",\n");
+        }
+    } else {
+        DBG("The input plugin has no paramters\n");
+    }
+    strbuf_printf(sb,
+                  "\n],\n"
+                  "\"formats\": [\n");
+
+    if(in->in_formats != NULL) {
+        for(i = 0; i < in->formatCount; i++) {
+            strbuf_printf(sb,
+                          "{\n"
+                          "\"id\": \"%d\",\n"
+                          "\"name\": \"%s\",\n"
 #ifdef V4L2_FMT_FLAG_COMPRESSED
-                    "\"compressed\": \"%s\",\n"
+                          "\"compressed\": \"%s\",\n"
 #endif
 #ifdef V4L2_FMT_FLAG_EMULATED
-                    "\"emulated\": \"%s\",\n"
+                          "\"emulated\": \"%s\",\n"
 #endif
-                    "\"current\": \"%s\",\n"
-                    "\"resolutions\": {%s}\n"
-                    ,
-                    pglobal->in[input_number].in_formats[i].format.index,
-                    pglobal->in[input_number].in_formats[i].format.description,
+                          "\"current\": \"%s\",\n"
+                          "\"resolutions\": {",
+                          in->in_formats[i].format.index,
+                          in->in_formats[i].format.description,
 #ifdef V4L2_FMT_FLAG_COMPRESSED
-                    pglobal->in[input_number].in_formats[i].format.flags & V4L2_FMT_FLAG_COMPRESSED ? "true" : "false",
+                          in->in_formats[i].format.flags & V4L2_FMT_FLAG_COMPRESSED ? "true" : "false",
 #endif
 #ifdef V4L2_FMT_FLAG_EMULATED
-                    pglobal->in[input_number].in_formats[i].format.flags & V4L2_FMT_FLAG_EMULATED ? "true" : "false",
+                          in->in_formats[i].format.flags & V4L2_FMT_FLAG_EMULATED ? "true" : "false",
 #endif
-                    pglobal->in[input_number].in_formats[i].currentResolution != -1 ? "true" : "false",
-                    resolutionsString
-                   );
-
-            if(pglobal->in[input_number].in_formats[i].currentResolution != -1) {
-                sprintf(buffer + strlen(buffer),
-                        ",\n\"currentResolution\": \"%d\"\n",
-                        pglobal->in[input_number].in_formats[i].currentResolution
-                       );
+                          in->in_formats[i].currentResolution != -1 ? "true" : "false");
+
+            // JSON format example:
+            // {"0": "320x240", "1": "640x480", "2": "960x720"}
+            for(j = 0; j < in->in_formats[i].resolutionCount; j++) {
+                strbuf_printf(sb, "\"%d\": \"%dx%d\"%s", j,
+                              in->in_formats[i].supportedResolutions[j].width,
+                              in->in_formats[i].supportedResolutions[j].height,
+                              (j != (in->in_formats[i].resolutionCount - 1)) ? ", " : "");
             }
+            strbuf_printf(sb, "}\n");
 
-            if(i != (pglobal->in[input_number].formatCount - 1)) {
-                sprintf(buffer + strlen(buffer), "},\n");
-            } else {
-                sprintf(buffer + strlen(buffer), "}\n");
+            if(in->in_formats[i].currentResolution != -1) {
+                strbuf_printf(sb,
+                              ",\n\"currentResolution\": \"%d\"\n",
+                              in->in_formats[i].currentResolution);
             }
 
-            free(resolutionsString);
+            if(i != (in->formatCount - 1))
+                strbuf_printf(sb, "},\n");
+            else
+                strbuf_printf(sb, "}\n");
         }
     }
-    sprintf(buffer + strlen(buffer),
-            "\n]\n"
-            "}\n");
-    i = strlen(buffer);
+    strbuf_printf(sb,
+                  "\n]\n"
+                  "}\n");
+}
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the control JSON file\n");
+/******************************************************************************
+Description.: build the JSON document with the output plugin's acceptable
+              parameters
+Input Value.: * sb...........: string buffer to append to
+              * output_number: number of the output plugin
+Return Value: -
+******************************************************************************/
+static void build_output_JSON(strbuf *sb, int output_number)
+{
+    output *out = &pglobal->out[output_number];
+    int i;
+
+    strbuf_printf(sb,
+                  "{\n"
+                  "\"controls\": [\n");
+    if(out->out_parameters != NULL) {
+        for(i = 0; i < out->parametercount; i++) {
+            append_JSON_control(sb, &out->out_parameters[i], 1);
+            if(i != (out->parametercount - 1))
+                strbuf_printf(sb, ",\n");
+        }
+    } else {
+        DBG("The output plugin %d has no paramters\n", output_number);
     }
+    strbuf_printf(sb,
+                  "\n]\n"
+                  "}\n");
 }
 
-
-void send_program_JSON(int fd)
+/******************************************************************************
+Description.: build the JSON document describing the loaded plugins
+Input Value.: * sb.....: string buffer to append to
+              * unused.: -
+Return Value: -
+******************************************************************************/
+static void build_program_JSON(strbuf *sb, int unused)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    int i, k;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
-
-    DBG("Serving the program descriptor JSON file\n");
+    int k;
 
+    (void)unused;
 
-    sprintf(buffer + strlen(buffer),
-            "{\n"
-            /*"\"program\": [\n"
-            "{\n"*/
-            "\"inputs\":[\n");
+    strbuf_printf(sb,
+                  "{\n"
+                  "\"inputs\":[\n");
     for(k = 0; k < pglobal->incnt; k++) {
-        sprintf(buffer + strlen(buffer),
-                "{\n"
-                "\"id\": \"%d\",\n"
-                "\"name\": \"%s\",\n"
-                "\"plugin\": \"%s\",\n"
-                "\"args\": \"%s\"\n"
-                "}",
-                pglobal->in[k].param.id,
-                pglobal->in[k].name,
-                pglobal->in[k].plugin,
-                pglobal->in[k].param.parameters);
-        if(k != (pglobal->incnt - 1))
-            sprintf(buffer + strlen(buffer), ", \n");
-        else
-            sprintf(buffer + strlen(buffer), "\n");
-    }
-    sprintf(buffer + strlen(buffer),
-            /*"]\n"
-            "}\n"
-            "]\n"*/
-            "],\n");
-    sprintf(buffer + strlen(buffer),
-            "\"outputs\":[\n");
+        strbuf_printf(sb,
+                      "{\n"
+                      "\"id\": \"%d\",\n"
+                      "\"name\": \"%s\",\n"
+                      "\"plugin\": \"%s\",\n"
+                      "\"args\": \"%s\"\n"
+                      "}%s\n",
+                      pglobal->in[k].param.id,
+                      pglobal->in[k].name,
+                      pglobal->in[k].plugin,
+                      pglobal->in[k].param.parameters,
+                      (k != (pglobal->incnt - 1)) ? ", " : "");
+    }
+    strbuf_printf(sb,
+                  "],\n"
+                  "\"outputs\":[\n");
     for(k = 0; k < pglobal->outcnt; k++) {
-        sprintf(buffer + strlen(buffer),
-                "{\n"
-                "\"id\": \"%d\",\n"
-                "\"name\": \"%s\",\n"
-                "\"plugin\": \"%s\",\n"
-                "\"args\": \"%s\"\n"
-                "}",
-                pglobal->out[k].param.id,
-                pglobal->out[k].name,
-                pglobal->out[k].plugin,
-                pglobal->out[k].param.parameters);
-        if(k != (pglobal->outcnt - 1))
-            sprintf(buffer + strlen(buffer), ", \n");
-        else
-            sprintf(buffer + strlen(buffer), "\n");
+        strbuf_printf(sb,
+                      "{\n"
+                      "\"id\": \"%d\",\n"
+                      "\"name\": \"%s\",\n"
+                      "\"plugin\": \"%s\",\n"
+                      "\"args\": \"%s\"\n"
+                      "}%s\n",
+                      pglobal->out[k].param.id,
+                      pglobal->out[k].name,
+                      pglobal->out[k].plugin,
+                      pglobal->out[k].param.parameters,
+                      (k != (pglobal->outcnt - 1)) ? ", " : "");
     }
-    sprintf(buffer + strlen(buffer),
-            /*"]\n"
-            "}\n"
-            "]\n"*/
-            "]}\n");
-    i = strlen(buffer);
+    strbuf_printf(sb, "]}\n");
+}
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the program JSON file\n");
+/******************************************************************************
+Description.: drop a reference to a rendered document, json_lock must be held
+Input Value.: document to release, may be NULL
+Return Value: -
+******************************************************************************/
+static void release_JSON_document(json_document *document)
+{
+    if(document != NULL && --document->references == 0)
+        free(document);
+}
+
+/******************************************************************************
+Description.: Send a cached JSON document, it is rendered again only if it
+              was invalidated or its fingerprint changed.
+Input Value.: * context_fd.: connection to send the answer to
+              * cache......: cache entry of the document
+              * fingerprint: current fingerprint of the document's source data
+              * build......: function to render the document body
+              * number.....: plugin number passed to build
+Return Value: -
+******************************************************************************/
+static void send_cached_JSON(cfd *context_fd, json_cache *cache, unsigned long fingerprint,
+                             void (*build)(strbuf *, int), int number)
+{
+    char header[BUFFER_SIZE];
+    json_document *document;
+    strbuf body = {0};
+    int length;
+
+    pthread_mutex_lock(&json_lock);
+    if(cache->document == NULL || cache->fingerprint != fingerprint) {
+        DBG("rendering JSON document\n");
+        build(&body, number);
+
+        length = snprintf(header, sizeof(header),
+                          "HTTP/1.0 200 OK\r\n" \
+                          "Content-type: %s\r\n" \
+                          "Content-Length: %lu\r\n" \
+                          STD_HEADER \
+                          "\r\n", "application/x-javascript", (unsigned long)body.length);
+
+        if(body.failed || (document = malloc(sizeof(json_document) + length + body.length)) == NULL) {
+            pthread_mutex_unlock(&json_lock);
+            free(body.data);
+            send_error(context_fd, 500, "not enough memory");
+            return;
+        }
+
+        document->references = 1;
+        document->length = length + body.length;
+        memcpy(document->data, header, length);
+        memcpy(document->data + length, body.data, body.length);
+        free(body.data);
+
+        release_JSON_document(cache->document);
+        cache->document = document;
+        cache->fingerprint = fingerprint;
+    }
+    document = cache->document;
+    document->references++;
+    pthread_mutex_unlock(&json_lock);
+
+    if(http_write(context_fd, document->data, document->length) < 0) {
+        DBG("unable to serve the JSON file\n");
     }
+
+    pthread_mutex_lock(&json_lock);
+    release_JSON_document(document);
+    pthread_mutex_unlock(&json_lock);
+}
+
+/******************************************************************************
+Description.: Discard the cached JSON document of a plugin after one of its
+              controls was changed.
+Input Value.: * dest...: Dest_Input or Dest_Output
+              * plugin.: number of the plugin
+Return Value: -
+******************************************************************************/
+void invalidate_JSON(int dest, int plugin)
+{
+    json_cache *cache = NULL;
+
+    if(dest == Dest_Input && plugin >= 0 && plugin < MAX_INPUT_PLUGINS)
+        cache = &input_json[plugin];
+    else if(dest == Dest_Output && plugin >= 0 && plugin < MAX_OUTPUT_PLUGINS)
+        cache = &output_json[plugin];
+
+    if(cache == NULL)
+        return;
+
+    pthread_mutex_lock(&json_lock);
+    release_JSON_document(cache->document);
+    cache->document = NULL;
+    pthread_mutex_unlock(&json_lock);
+}
+
+/******************************************************************************
+Description.: Send a JSON file which is contains information about the input plugin's
+              acceptable parameters
+Input Value.: fildescriptor fd to send the answer to
+Return Value: -
+******************************************************************************/
+void send_input_JSON(cfd *context_fd, int input_number)
+{
+    DBG("Serving the input plugin %d descriptor JSON file\n", input_number);
+    send_cached_JSON(context_fd, &input_json[input_number], input_JSON_fingerprint(input_number),
+                     build_input_JSON, input_number);
+}
+
+/******************************************************************************
+Description.: Send a JSON file which contains information about the loaded
+              plugins, it does not change while the program runs
+Input Value.: fildescriptor fd to send the answer to
+Return Value: -
+******************************************************************************/
+void send_program_JSON(cfd *context_fd)
+{
+    DBG("Serving the program descriptor JSON file\n");
+    send_cached_JSON(context_fd, &program_json, 0, build_program_JSON, 0);
 }
 
 /******************************************************************************
@@ -1917,151 +2958,79 @@ Description.: Send a JSON file which is contains information about the output pl
 Input Value.: fildescriptor fd to send the answer to
 Return Value: -
 ******************************************************************************/
-void send_output_JSON(int fd, int input_number)
+void send_output_JSON(cfd *context_fd, int input_number)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    int i;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
-
     DBG("Serving the output plugin %d descriptor JSON file\n", input_number);
-
-    sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"controls\": [\n");
-    if(pglobal->out[input_number].out_parameters != NULL) {
-        for(i = 0; i < pglobal->out[input_number].parametercount; i++) {
-            char *menuString = calloc(0, 0);
-            if(pglobal->out[input_number].out_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                if(pglobal->out[input_number].out_parameters[i].menuitems != NULL) {
-                    int j, k = 1;
-                    for(j = pglobal->out[input_number].out_parameters[i].ctrl.minimum; j <= pglobal->out[input_number].out_parameters[i].ctrl.maximum; j++) {
-                        int prevSize = strlen(menuString);
-                        int itemLength = strlen((char*)&pglobal->out[input_number].out_parameters[i].menuitems[j].name)  + strlen("\"\": \"\"");
-                        if (menuString == NULL) {
-                            menuString = calloc(itemLength, sizeof(char));
-                        } else {
-                            menuString = realloc(menuString, (strlen(menuString) + itemLength) * (sizeof(char)));
-                        }
-
-                        if (menuString == NULL) {
-                            DBG("Realloc/calloc failed: %s\n", strerror(errno));
-                            return;
-                        }
-
-                        if(j != pglobal->out[input_number].out_parameters[i].ctrl.maximum) {
-                            sprintf(menuString + prevSize, "\"%d\": \"%s\", ", j , (char*)&pglobal->out[input_number].out_parameters[i].menuitems[j].name);
-                        } else {
-                            sprintf(menuString + prevSize, "\"%d\": \"%s\"", j , (char*)&pglobal->out[input_number].out_parameters[i].menuitems[j].name);
-                        }
-                        k++;
-                    }
-                }
-            }
-
-            sprintf(buffer + strlen(buffer),
-                    "{\n"
-                    "\"name\": \"%s\",\n"
-                    "\"id\": \"%d\",\n"
-                    "\"type\": \"%d\",\n"
-                    "\"min\": \"%d\",\n"
-                    "\"max\": \"%d\",\n"
-                    "\"step\": \"%d\",\n"
-                    "\"default\": \"%d\",\n"
-                    "\"value\": \"%d\",\n"
-                    "\"dest\": \"1\",\n"
-                    "\"flags\": \"%d\",\n"
-                    "\"group\": \"%d\"",
-                    pglobal->out[input_number].out_parameters[i].ctrl.name,
-                    pglobal->out[input_number].out_parameters[i].ctrl.id,
-                    pglobal->out[input_number].out_parameters[i].ctrl.type,
-                    pglobal->out[input_number].out_parameters[i].ctrl.minimum,
-                    pglobal->out[input_number].out_parameters[i].ctrl.maximum,
-                    pglobal->out[input_number].out_parameters[i].ctrl.step,
-                    pglobal->out[input_number].out_parameters[i].ctrl.default_value,
-                    pglobal->out[input_number].out_parameters[i].value,
-                    // 1 is the code of the output plugin
-                    pglobal->out[input_number].out_parameters[i].ctrl.flags,
-                    pglobal->out[input_number].out_parameters[i].group
-                   );
-
-            if(pglobal->out[input_number].out_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                sprintf(buffer + strlen(buffer),
-                        ",\n"
-                        "\"menu\": {%s}\n"
-                        "}",
-                        menuString);
-            } else {
-                sprintf(buffer + strlen(buffer),
-                        "\n"
-                        "}");
-            }
-
-            if(i != (pglobal->out[input_number].parametercount - 1)) {
-                sprintf(buffer + strlen(buffer), ",\n");
-            }
-            free(menuString);
-        }
-    } else {
-        DBG("The output plugin %d has no paramters\n", input_number);
-    }
-    sprintf(buffer + strlen(buffer),
-            "\n]\n"
-            /*"},\n"*/);
-
-    sprintf(buffer + strlen(buffer),
-            "}\n");
-    i = strlen(buffer);
-
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the control JSON file\n");
-    }
+    send_cached_JSON(context_fd, &output_json[input_number], output_JSON_fingerprint(input_number),
+                     build_output_JSON, input_number);
 }
 
 #ifdef MANAGMENT
-void send_clients_JSON(int fd)
+/******************************************************************************
+Description.: Send a JSON file with the known clients and their statistics
+Input Value.: connection to send the answer to
+Return Value: -
+******************************************************************************/
+void send_clients_JSON(cfd *context_fd)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    unsigned long i = 0 ;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
+    char header[BUFFER_SIZE];
+    strbuf body = {0};
+    client_info *client;
+    int i, first = 1;
 
     DBG("Serving the clients JSON file\n");
 
-    sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"clients\": [\n");
-
-    for (; i<client_infos.client_count; i++) {
-        sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"address\": \"%s\",\n"
-            "\"timestamp\": %ld\n"
-            "}\n",
-            client_infos.infos[i]->address,
-            (unsigned long)client_infos.infos[i]->last_take_time.tv_sec);
-
-        if(i != (client_infos.client_count - 1)) {
-            sprintf(buffer + strlen(buffer), ",\n");
+    strbuf_printf(&body,
+                  "{\n"
+                  "\"clients\": [\n");
+
+    /* the table lock keeps the entries in place, the statistics need none */
+    pthread_mutex_lock(&client_infos.mutex);
+    for(i = 0; i < CLIENT_HASH_SIZE; i++) {
+        for(client = client_infos.buckets[i]; client != NULL; client = client->next) {
+            strbuf_printf(&body,
+                          "%s{\n"
+                          "\"address\": \"%s\",\n"
+                          "\"timestamp\": %ld,\n"
+                          "\"connections\": %d,\n"
+                          "\"frames\": %lu,\n"
+                          "\"dropped\": %lu\n"
+                          "}\n",
+                          first ? "" : ",\n",
+                          client->address,
+                          (long)(__atomic_load_n(&client->last_take_time, __ATOMIC_RELAXED) / 1000000),
+                          client->references,
+                          __atomic_load_n(&client->frames, __ATOMIC_RELAXED),
+                          __atomic_load_n(&client->dropped_frames, __ATOMIC_RELAXED));
+            first = 0;
         }
     }
+    pthread_mutex_unlock(&client_infos.mutex);
 
-    sprintf(buffer + strlen(buffer),
-            "]");
+    strbuf_printf(&body,
+                  "]"
+                  "\n}\n");
 
-    sprintf(buffer + strlen(buffer),
-            "\n}\n");
-    i = strlen(buffer);
+    if(body.failed) {
+        free(body.data);
+        send_error(context_fd, 500, "not enough memory");
+        return;
+    }
+
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\n" \
+             "Content-type: %s\r\n" \
+             "Content-Length: %lu\r\n" \
+             STD_HEADER \
+             "\r\n", "application/x-javascript", (unsigned long)body.length);
 
     /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the control JSON file\n");
+    if(http_write(context_fd, header, strlen(header)) < 0 ||
+       http_write(context_fd, body.data, body.length) < 0) {
+        DBG("unable to serve the clients JSON file\n");
     }
+
+    free(body.data);
 }
 #endif
 
@@ -20,7 +20,17 @@
 #                                                                              #
 *******************************************************************************/
 
-#define IO_BUFFER 256
+#ifdef USE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* kernel TLS offload needs an OpenSSL that was built with kTLS support */
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+#define USE_KTLS
+#endif
+#endif
+
+#define IO_BUFFER 8192
 #define BUFFER_SIZE 1024
 
 /* the boundary is used for the M-JPEG stream, it separates the multipart stream of pictures */
@@ -43,12 +53,24 @@
  * Many browser seem to ignore, or at least not always obey those headers
  * since i observed caching of files from time to time.
  */
-#define STD_HEADER "Connection: close\r\n" \
-    "Server: MJPG-Streamer/0.2\r\n" \
+#define NO_CACHE_HEADER "Server: MJPG-Streamer/0.2\r\n" \
     "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
     "Pragma: no-cache\r\n" \
     "Expires: Mon, 3 Jan 2000 12:34:56 GMT\r\n"
 
+#define STD_HEADER "Connection: close\r\n" \
+    NO_CACHE_HEADER
+
+/*
+ * "?action=snapshot&after=<sequence>" waits this many seconds for a new frame
+ * unless the client asks for another "&timeout=<seconds>" up to the maximum
+ */
+#define NEXT_FRAME_TIMEOUT 10
+#define NEXT_FRAME_MAX_TIMEOUT 60
+
+/* seconds a kept-alive connection may stay idle between two requests */
+#define KEEP_ALIVE_TIMEOUT 15
+
 /*
  * Maximum number of server sockets (i.e. protocol families) to listen.
  */
@@ -63,21 +85,41 @@
 static const struct {
     const char *dot_extension;
     const char *mimetype;
+    char compressible;
 } mimetypes[] = {
-    { ".html", "text/html" },
-    { ".htm",  "text/html" },
-    { ".css",  "text/css" },
-    { ".js",   "text/javascript" },
-    { ".txt",  "text/plain" },
-    { ".jpg",  "image/jpeg" },
-    { ".jpeg", "image/jpeg" },
-    { ".png",  "image/png"},
-    { ".gif",  "image/gif" },
-    { ".ico",  "image/x-icon" },
-    { ".swf",  "application/x-shockwave-flash" },
-    { ".cab",  "application/x-shockwave-flash" },
-    { ".jar",  "application/java-archive" },
-    { ".json", "application/json" }
+    { ".html", "text/html", 1 },
+    { ".htm",  "text/html", 1 },
+    { ".css",  "text/css", 1 },
+    { ".js",   "text/javascript", 1 },
+    { ".txt",  "text/plain", 1 },
+    { ".jpg",  "image/jpeg", 0 },
+    { ".jpeg", "image/jpeg", 0 },
+    { ".png",  "image/png", 0 },
+    { ".gif",  "image/gif", 0 },
+    { ".ico",  "image/x-icon", 0 },
+    { ".swf",  "application/x-shockwave-flash", 0 },
+    { ".cab",  "application/x-shockwave-flash", 0 },
+    { ".jar",  "application/java-archive", 0 },
+    { ".json", "application/json", 1 }
+};
+
+/*
+ * Content codings the client accepts (from the Accept-Encoding header).
+ *
+ * For compressible files send_file() looks for a precompressed variant
+ * next to the original (e.g. jquery.js.br, jquery.js.gz) and serves it
+ * instead, the table is ordered by preference.
+ */
+#define ENCODING_GZIP   (1 << 0)
+#define ENCODING_BROTLI (1 << 1)
+
+static const struct {
+    int flag;
+    const char *token;
+    const char *dot_extension;
+} encodings[] = {
+    { ENCODING_BROTLI, "br",   ".br" },
+    { ENCODING_GZIP,   "gzip", ".gz" }
 };
 
 /* the webserver determines between these values for an answer */
@@ -94,6 +136,8 @@ typedef enum {
     A_INPUT_JSON,
     A_OUTPUT_JSON,
     A_PROGRAM_JSON,
+    A_WEBSOCKET,
+    A_EVENTS,
     #ifdef MANAGMENT
     A_CLIENTS_JSON
     #endif
@@ -102,59 +146,144 @@ typedef enum {
 /*
  * the client sends information with each request
  * this structure is used to store the important parts
+ *
+ * all strings point into the iobuffer the request was read to, they
+ * are only valid as long as that buffer and must not be freed
  */
 typedef struct {
     answer_t type;
+    int input_number;
+    int numbered;           /* input_number was given with the request */
+    int path_input;         /* input of the path prefix the request used, -1 if none */
+    char *method;
+    char *path;
+    char *version;
     char *parameter;
     char *client;
     char *credentials;
     char *query_string;
+    char *encoding;
+    int accept_encoding;
+    char *upgrade;
+    char *websocket_key;
+    char *last_event_id;
+    char *connection;
 } request;
 
-/* the iobuffer structure is used to read from the HTTP-client */
+/*
+ * the iobuffer structure is used to read from the HTTP-client
+ * it has to hold the complete request header
+ */
 typedef struct {
     int level;              /* how full is the buffer */
+    int scanned;            /* bytes already searched for the end of the header */
     char buffer[IO_BUFFER]; /* the data */
 } iobuffer;
 
-/* store configuration for each server instance */
+/* number of ports one server instance may listen on */
+#define MAX_PORTS 16
+
+/* a port and the input plugin requests without input number get there, -1 for the default */
 typedef struct {
     int port;
+    int input;
+} listener;
+
+/* number of path prefixes one server instance may map to inputs */
+#define MAX_PATHS 16
+
+/* requests below a path prefix like "/cam2" get the input plugin by default */
+typedef struct {
+    char *prefix;
+    int input;
+} path_prefix;
+
+/* store configuration for each server instance */
+typedef struct {
+    listener ports[MAX_PORTS];
+    int port_count;
+    path_prefix paths[MAX_PATHS];
+    int path_count;
     char *hostname;
     char *credentials;
     char *www_folder;
     char nocommands;
+    unsigned long rate;         /* bytes per second for all stream clients, 0 is unlimited */
+    unsigned long client_rate;  /* bytes per second for each client address, 0 is unlimited */
 } config;
 
+/*
+ * token bucket to limit the bandwidth of the streams, it is filled with
+ * "rate" bytes per second up to one second worth of data. A frame is sent
+ * if there are tokens left and costs its size, so the bucket may run into
+ * debt with a large frame. Frames are only dropped as a whole.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    double tokens;
+    struct timespec last;
+} token_bucket;
+
 /* context of each server thread */
 typedef struct {
     int sd[MAX_SD_LEN];
+    listener *sd_listener[MAX_SD_LEN];  /* the port each socket was bound for */
     int sd_len;
     int id;
     globals *pglobal;
     pthread_t threadID;
 
     config conf;
+    #ifdef USE_OPENSSL
+    SSL_CTX *ssl_ctx;   /* NULL if this server speaks plain HTTP */
+    #endif
+    token_bucket bucket;    /* shared by all stream clients of this server */
 } context;
 
 
-#if defined(MANAGMENT)
+/* number of hash buckets of the client table, must be a power of two */
+#define CLIENT_HASH_SIZE 1024
+
+/* client entries are allocated this many at once */
+#define CLIENT_SLAB_SIZE 64
+
+/* seconds a client address is remembered after its last connection closed */
+#define CLIENT_IDLE_TIMEOUT 60
+
+/* enough for numeric IPv6 addresses with scope */
+#define CLIENT_ADDRESS_SIZE 64
+
 /*
  * this struct is used to hold information from the clients address, and last picture take time
+ * it is used with MANAGMENT and for the per client bandwidth limit
  */
 typedef struct _client_info {
-    struct _client_info *next;
-    char *address;
-    struct timeval last_take_time;
+    struct _client_info *next;          /* hash chain, or free list */
+    struct _client_info *idle_prev;     /* list of entries without connection, oldest first */
+    struct _client_info *idle_next;
+    char address[CLIENT_ADDRESS_SIZE];
+    int references;                     /* connections of this address */
+    time_t idle_since;
+
+    /* statistics, written and read with atomic operations and without lock */
+    long long last_take_time;           /* microseconds since the epoch */
+    unsigned long frames;
+    unsigned long dropped_frames;       /* frames skipped because of the bandwidth limit */
+
+    token_bucket bucket;                /* shared by all connections from this address */
 } client_info;
 
-struct {
-    client_info **infos;
-    unsigned int client_count;
+/* the clients hashed by address, the mutex protects the lists and references */
+typedef struct {
     pthread_mutex_t mutex;
-} client_infos;
+    client_info *buckets[CLIENT_HASH_SIZE];
+    client_info *free;
+    client_info *idle_head;
+    client_info *idle_tail;
+    unsigned int client_count;
+} client_table;
 
-#endif
+extern client_table client_infos;
 
 /*
  * this struct is just defined to allow passing all necessary details to a worker thread
@@ -163,26 +292,65 @@ struct {
 typedef struct {
     context *pc;
     int fd;
-    #ifdef MANAGMENT
-    client_info *client;
+    #ifdef USE_OPENSSL
+    SSL *ssl;
     #endif
+    client_info *client;    /* NULL unless MANAGMENT or a client rate is configured */
+    listener *listener;     /* the port the client connected to */
 } cfd;
 
 
 
+/* growable string, the JSON documents are built with it */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t size;
+    int failed;
+} strbuf;
+
+/* a rendered JSON response including its HTTP header */
+typedef struct {
+    int references;
+    size_t length;
+    char data[];
+} json_document;
+
+/* the current rendering of a JSON response and what it was rendered from */
+typedef struct {
+    json_document *document;
+    unsigned long fingerprint;
+} json_cache;
+
 /* prototypes */
 void *server_thread(void *arg);
-void send_error(int fd, int which, char *message);
-void send_output_JSON(int fd, int plugin_number);
-void send_input_JSON(int fd, int plugin_number);
-void send_program_JSON(int fd);
+ssize_t http_write(cfd *context_fd, const void *buffer, size_t length);
+ssize_t http_read(cfd *context_fd, void *buffer, size_t length);
+int http_pending(cfd *context_fd);
+void http_close(cfd *context_fd);
+void send_error(cfd *context_fd, int which, char *message);
+int send_next_frame(cfd *context_fd, int input_number, char *parameter, int keep_alive);
+void send_output_JSON(cfd *context_fd, int plugin_number);
+void send_input_JSON(cfd *context_fd, int plugin_number);
+void send_program_JSON(cfd *context_fd);
 void check_JSON_string(char *source, char *destination);
+void strbuf_printf(strbuf *sb, const char *format, ...);
+void invalidate_JSON(int dest, int plugin);
+void control_changed(int dest, int plugin, int id, int group, int value);
+
+#ifdef USE_OPENSSL
+SSL_CTX *tls_context(const char *certificate, const char *key);
+int tls_accept(cfd *context_fd, int timeout);
+#endif
 
-#ifdef MANAGMENT
 client_info *add_client(char *address);
+void release_client(client_info *client);
+int allow_frame(cfd *context_fd, int size);
+
+#ifdef MANAGMENT
 int check_client_status(client_info *client);
 void update_client_timestamp(client_info *client);
-void send_clients_JSON(int fd);
+void send_clients_JSON(cfd *context_fd);
 #endif
 
 
@@ -40,6 +40,7 @@
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
 #include "httpd.h"
+#include "events.h"
 
 #define OUTPUT_PLUGIN_NAME "HTTP output plugin"
 /*
@@ -60,13 +61,41 @@ void help(void)
             " The following parameters can be passed to this plugin:\n\n" \
             " [-w | --www ]...........: folder that contains webpages in \n" \
             "                           flat hierarchy (no subfolders)\n" \
-            " [-p | --port ]..........: TCP port for this HTTP server\n" \
+            " [-p | --port ]..........: TCP port for this HTTP server, can be given\n" \
+            "                           several times, \"port:input\" serves the\n" \
+            "                           input plugin number input by default\n" \
+            " [--path ]...............: \"/prefix:input\" serves the input plugin\n" \
+            "                           number input below /prefix, e.g. /cam2/stream,\n" \
+            "                           can be given several times\n" \
 	    " [-l ] --listen ]........: Listen on Hostname / IP\n" \
             " [-c | --credentials ]...: ask for \"username:password\" on connect\n" \
             " [-n | --nocommands ]....: disable execution of commands\n"
+            " [--cert ]...............: PEM certificate (chain), enables HTTPS\n" \
+            " [-k | --key ]...........: PEM private key of the certificate\n" \
+            " [-r | --rate ]..........: bandwidth of all streams together in bytes/s,\n" \
+            "                           k and M suffixes allowed, e.g. 2M\n" \
+            " [-cr | --client_rate ]..: bandwidth per client address in bytes/s\n" \
             " ---------------------------------------------------------------\n");
 }
 
+/******************************************************************************
+Description.: parse a bandwidth like "500000", "500k" or "2M"
+Input Value.: string to parse
+Return Value: bytes per second
+******************************************************************************/
+static unsigned long parse_rate(const char *string)
+{
+    char *end;
+    unsigned long rate = strtoul(string, &end, 10);
+
+    if(*end == 'k' || *end == 'K')
+        rate *= 1000;
+    else if(*end == 'm' || *end == 'M')
+        rate *= 1000000;
+
+    return rate;
+}
+
 /*** plugin interface functions ***/
 /******************************************************************************
 Description.: Initialize this plugin.
@@ -80,13 +109,18 @@ Return Value: 0 if everything is OK, other values signal an error
 int output_init(output_parameter *param, int id)
 {
     int i;
-    int  port;
+    listener ports[MAX_PORTS];
+    int port_count = 0;
+    path_prefix paths[MAX_PATHS];
+    int path_count = 0;
+    char *end, *colon;
     char *credentials, *www_folder, *hostname = NULL;
+    char *certificate = NULL, *key = NULL;
+    unsigned long rate = 0, client_rate = 0;
     char nocommands;
 
     DBG("output #%02d\n", param->id);
 
-    port = htons(8080);
     credentials = NULL;
     www_folder = NULL;
     nocommands = 0;
@@ -115,6 +149,15 @@ int output_init(output_parameter *param, int id)
             {"www", required_argument, 0, 0},
             {"n", no_argument, 0, 0},
             {"nocommands", no_argument, 0, 0},
+            {"cert", required_argument, 0, 0},
+            {"certificate", required_argument, 0, 0},
+            {"k", required_argument, 0, 0},
+            {"key", required_argument, 0, 0},
+            {"r", required_argument, 0, 0},
+            {"rate", required_argument, 0, 0},
+            {"cr", required_argument, 0, 0},
+            {"client_rate", required_argument, 0, 0},
+            {"path", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -142,7 +185,21 @@ int output_init(output_parameter *param, int id)
         case 2:
         case 3:
             DBG("case 2,3\n");
-            port = htons(atoi(optarg));
+            if(port_count == MAX_PORTS) {
+                OPRINT("ERROR: at most %d ports are possible\n", MAX_PORTS);
+                return 1;
+            }
+            ports[port_count].port = strtol(optarg, &end, 10);
+            ports[port_count].input = -1;
+            if(*end == ':')
+                ports[port_count].input = strtol(end + 1, &end, 10);
+            if(*end != '\0' || ports[port_count].port <= 0 || ports[port_count].port > 65535 ||
+               (ports[port_count].input != -1 &&
+                (ports[port_count].input < 0 || ports[port_count].input >= param->global->incnt))) {
+                OPRINT("ERROR: invalid port %s, use \"port\" or \"port:input\"\n", optarg);
+                return 1;
+            }
+            port_count++;
             break;
        
             /* Interface name */
@@ -175,22 +232,117 @@ int output_init(output_parameter *param, int id)
             DBG("case 10,11\n");
             nocommands = 1;
             break;
+
+            /* cert, certificate */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            certificate = strdup(optarg);
+            break;
+
+            /* k, key */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            key = strdup(optarg);
+            break;
+
+            /* r, rate */
+        case 16:
+        case 17:
+            DBG("case 16,17\n");
+            rate = parse_rate(optarg);
+            break;
+
+            /* cr, client_rate */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            client_rate = parse_rate(optarg);
+            break;
+
+            /* path */
+        case 20:
+            DBG("case 20\n");
+            if(path_count == MAX_PATHS) {
+                OPRINT("ERROR: at most %d paths are possible\n", MAX_PATHS);
+                return 1;
+            }
+            /* the prefix is a path without trailing slash, e.g. "/cam2" or "/cams/2" */
+            colon = strrchr(optarg, ':');
+            if(colon == NULL || optarg[0] != '/' || colon - optarg < 2 || colon[-1] == '/' ||
+               strspn(optarg, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-/1234567890") != (size_t)(colon - optarg)) {
+                OPRINT("ERROR: invalid path %s, use \"/prefix:input\"\n", optarg);
+                return 1;
+            }
+            paths[path_count].input = strtol(colon + 1, &end, 10);
+            if(colon[1] == '\0' || *end != '\0' ||
+               paths[path_count].input < 0 || paths[path_count].input >= param->global->incnt) {
+                OPRINT("ERROR: invalid input in path %s\n", optarg);
+                return 1;
+            }
+            paths[path_count].prefix = strndup(optarg, colon - optarg);
+            path_count++;
+            break;
         }
     }
 
+    if((certificate == NULL) != (key == NULL)) {
+        OPRINT("ERROR: HTTPS requires both, --cert and --key\n");
+        return 1;
+    }
+
+    #ifdef USE_OPENSSL
+    servers[param->id].ssl_ctx = NULL;
+    if(certificate != NULL &&
+       (servers[param->id].ssl_ctx = tls_context(certificate, key)) == NULL) {
+        OPRINT("ERROR: could not load certificate %s and key %s\n", certificate, key);
+        return 1;
+    }
+    #else
+    if(certificate != NULL) {
+        OPRINT("ERROR: this plugin was built without HTTPS support\n");
+        return 1;
+    }
+    #endif
+
     servers[param->id].id = param->id;
     servers[param->id].pglobal = param->global;
-    servers[param->id].conf.port = port;
+    if(port_count == 0) {
+        ports[0].port = 8080;
+        ports[0].input = -1;
+        port_count = 1;
+    }
+
+    memcpy(servers[param->id].conf.ports, ports, sizeof(ports));
+    servers[param->id].conf.port_count = port_count;
+    memcpy(servers[param->id].conf.paths, paths, sizeof(paths));
+    servers[param->id].conf.path_count = path_count;
     servers[param->id].conf.hostname = hostname;
     servers[param->id].conf.credentials = credentials;
     servers[param->id].conf.www_folder = www_folder;
     servers[param->id].conf.nocommands = nocommands;
+    servers[param->id].conf.rate = rate;
+    servers[param->id].conf.client_rate = client_rate;
 
     OPRINT("www-folder-path......: %s\n", (www_folder == NULL) ? "disabled" : www_folder);
-    OPRINT("HTTP TCP port........: %d\n", ntohs(port));
+    for(i = 0; i < port_count; i++) {
+        if(ports[i].input >= 0) {
+            OPRINT("HTTP TCP port........: %d (input %d)\n", ports[i].port, ports[i].input);
+        } else {
+            OPRINT("HTTP TCP port........: %d\n", ports[i].port);
+        }
+    }
+    for(i = 0; i < path_count; i++)
+        OPRINT("path prefix..........: %s (input %d)\n", paths[i].prefix, paths[i].input);
     OPRINT("HTTP Listen Address..: %s\n", hostname);
     OPRINT("username:password....: %s\n", (credentials == NULL) ? "disabled" : credentials);
     OPRINT("commands.............: %s\n", (nocommands) ? "disabled" : "enabled");
+    OPRINT("HTTPS certificate....: %s\n", (certificate == NULL) ? "disabled" : certificate);
+    if(rate > 0)
+        OPRINT("stream bandwidth.....: %lu bytes/s\n", rate);
+    if(client_rate > 0)
+        OPRINT("bandwidth per client.: %lu bytes/s\n", client_rate);
 
     param->global->out[id].name = malloc((strlen(OUTPUT_PLUGIN_NAME) + 1) * sizeof(char));
     sprintf(param->global->out[id].name, OUTPUT_PLUGIN_NAME);
@@ -212,6 +364,9 @@ int output_stop(int id)
     DBG("will cancel server thread #%02d\n", id);
     pthread_cancel(servers[id].threadID);
 
+    /* the event monitors wait on the inputs, these get destroyed next */
+    events_stop();
+
     return 0;
 }
 
@@ -0,0 +1,323 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Minimal server side of the WebSocket protocol (RFC 6455): the opening
+  handshake, unfragmented frames to the client and small masked messages
+  from the client. The SHA-1 is only used for the handshake.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "../../mjpg_streamer.h"
+#include "httpd.h"
+#include "websocket.h"
+
+#define ROL(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+/******************************************************************************
+Description.: process one 64 byte block of the SHA-1 message
+Input Value.: * state..: the five words of the intermediate hash
+              * block..: 64 bytes of message
+Return Value: state is updated
+******************************************************************************/
+static void sha1_block(uint32_t state[5], const unsigned char block[64])
+{
+    uint32_t w[80], a, b, c, d, e, f, k, tmp;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+    for(i = 16; i < 80; i++)
+        w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+
+    for(i = 0; i < 80; i++) {
+        if(i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if(i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if(i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        tmp = ROL(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = ROL(b, 30); b = a; a = tmp;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+/******************************************************************************
+Description.: calculate the SHA-1 digest of a short message
+Input Value.: * data...: the message
+              * length.: length of the message
+              * digest.: 20 bytes to store the digest at
+Return Value: -
+******************************************************************************/
+static void sha1(const unsigned char *data, size_t length, unsigned char digest[20])
+{
+    uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    unsigned char block[64];
+    uint64_t bits = (uint64_t)length * 8;
+    size_t i, rest;
+
+    for(i = 0; i + 64 <= length; i += 64)
+        sha1_block(state, data + i);
+
+    /* padding: 0x80, zeros and the message length in bits */
+    rest = length - i;
+    memset(block, 0, sizeof(block));
+    memcpy(block, data + i, rest);
+    block[rest] = 0x80;
+    if(rest >= 56) {
+        sha1_block(state, block);
+        memset(block, 0, sizeof(block));
+    }
+    for(i = 0; i < 8; i++)
+        block[63 - i] = (unsigned char)(bits >> (i * 8));
+    sha1_block(state, block);
+
+    for(i = 0; i < 20; i++)
+        digest[i] = (unsigned char)(state[i / 4] >> (24 - (i % 4) * 8));
+}
+
+/******************************************************************************
+Description.: calculate the Sec-WebSocket-Accept value for the handshake
+Input Value.: * key....: value of the Sec-WebSocket-Key header of the client
+              * accept.: WEBSOCKET_ACCEPT_SIZE bytes to store the result at
+Return Value: -
+******************************************************************************/
+void websocket_accept_key(const char *key, char *accept)
+{
+    static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned char buffer[128], digest[21];
+    size_t length = strlen(key);
+    uint32_t triple;
+    int i;
+
+    /* keys are 24 characters, just refuse to overflow with bogus ones */
+    if(length > sizeof(buffer) - strlen(WEBSOCKET_GUID))
+        length = sizeof(buffer) - strlen(WEBSOCKET_GUID);
+
+    memcpy(buffer, key, length);
+    memcpy(buffer + length, WEBSOCKET_GUID, strlen(WEBSOCKET_GUID));
+    sha1(buffer, length + strlen(WEBSOCKET_GUID), digest);
+    digest[20] = 0;
+
+    /* 20 bytes of digest become 27 characters and one padding character */
+    for(i = 0; i < 7; i++) {
+        triple = (uint32_t)digest[i * 3] << 16 | (uint32_t)digest[i * 3 + 1] << 8 | digest[i * 3 + 2];
+        accept[i * 4]     = base64[(triple >> 18) & 0x3F];
+        accept[i * 4 + 1] = base64[(triple >> 12) & 0x3F];
+        accept[i * 4 + 2] = base64[(triple >> 6) & 0x3F];
+        accept[i * 4 + 3] = base64[triple & 0x3F];
+    }
+    accept[27] = '=';
+    accept[28] = '\0';
+}
+
+/******************************************************************************
+Description.: prepare the header of an unmasked, unfragmented frame
+Input Value.: * header.: at least WEBSOCKET_HEADER_SIZE bytes
+              * opcode.: type of the frame
+              * length.: length of the payload
+Return Value: number of header bytes
+******************************************************************************/
+int websocket_frame_header(unsigned char *header, websocket_opcode opcode, size_t length)
+{
+    int i;
+
+    header[0] = 0x80 | opcode;
+
+    if(length < 126) {
+        header[1] = (unsigned char)length;
+        return 2;
+    }
+
+    if(length <= 0xFFFF) {
+        header[1] = 126;
+        header[2] = (unsigned char)(length >> 8);
+        header[3] = (unsigned char)length;
+        return 4;
+    }
+
+    header[1] = 127;
+    for(i = 0; i < 8; i++)
+        header[2 + i] = (unsigned char)((uint64_t)length >> (56 - i * 8));
+    return 10;
+}
+
+/******************************************************************************
+Description.: send a complete message as a single frame
+Input Value.: * context_fd: connection of the client
+              * opcode....: type of the frame
+              * data......: payload
+              * length....: length of the payload
+Return Value: 0 if everything was sent, -1 otherwise
+******************************************************************************/
+int websocket_send(cfd *context_fd, websocket_opcode opcode, const void *data, size_t length)
+{
+    unsigned char header[WEBSOCKET_HEADER_SIZE];
+    struct iovec iov[2];
+    ssize_t rc;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = websocket_frame_header(header, opcode, length);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = length;
+
+    #ifdef USE_OPENSSL
+    if(context_fd->ssl != NULL) {
+        if(http_write(context_fd, iov[0].iov_base, iov[0].iov_len) < 0 ||
+           http_write(context_fd, iov[1].iov_base, iov[1].iov_len) < 0)
+            return -1;
+        return 0;
+    }
+    #endif
+
+    /* header and payload leave with one system call, resume after partial writes */
+    while(iov[0].iov_len + iov[1].iov_len > 0) {
+        if((rc = writev(context_fd->fd, iov[0].iov_len > 0 ? iov : iov + 1, iov[0].iov_len > 0 ? 2 : 1)) <= 0)
+            return -1;
+
+        if((size_t)rc >= iov[0].iov_len) {
+            rc -= iov[0].iov_len;
+            iov[0].iov_len = 0;
+            iov[1].iov_base = (char *)iov[1].iov_base + rc;
+            iov[1].iov_len -= rc;
+        } else {
+            iov[0].iov_base = (char *)iov[0].iov_base + rc;
+            iov[0].iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: read what the client has sent so far without waiting for more
+Input Value.: * context_fd: connection of the client
+              * buffer....: where to store the data
+              * length....: number of bytes wanted at most
+Return Value: number of bytes read, 0 if nothing is available,
+              -1 if the connection failed or was closed
+******************************************************************************/
+static ssize_t receive_available(cfd *context_fd, void *buffer, size_t length)
+{
+    int flags = fcntl(context_fd->fd, F_GETFL);
+    ssize_t rc;
+
+    /* only this read must not block, the frames are still sent blocking */
+    fcntl(context_fd->fd, F_SETFL, flags | O_NONBLOCK);
+    rc = http_read(context_fd, buffer, length);
+    fcntl(context_fd->fd, F_SETFL, flags);
+
+    if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+
+    return (rc > 0) ? rc : -1;
+}
+
+/******************************************************************************
+Description.: receive one frame of the client and unmask its payload.
+              The frame is read as far as it has arrived, the rest follows
+              with the next calls, so a slow client does not block the stream.
+              Clients only send short control messages, larger frames are
+              treated as protocol violation.
+Input Value.: * context_fd: connection of the client
+              * reader....: the part of the frame received before, the
+                            complete payload is stored there null-terminated
+              * opcode....: where to store the type of the frame
+Return Value: length of the payload, WEBSOCKET_PARTIAL if the frame is not
+              complete yet, -1 in case of error or protocol violation
+******************************************************************************/
+int websocket_receive(cfd *context_fd, websocket_reader *reader, websocket_opcode *opcode)
+{
+    uint64_t length = 0;
+    size_t i, extra = 0, header = 2, wanted;
+    ssize_t rc;
+
+    for(;;) {
+        if(reader->level >= 2) {
+            /* clients have to mask their frames */
+            if(!(reader->header[1] & 0x80))
+                return -1;
+
+            length = reader->header[1] & 0x7F;
+            extra = (length == 126) ? 2 : (length == 127) ? 8 : 0;
+            header = 2 + extra + 4;
+        }
+
+        if(reader->level >= header) {
+            if(extra > 0) {
+                length = 0;
+                for(i = 0; i < extra; i++)
+                    length = (length << 8) | reader->header[2 + i];
+            }
+
+            if(length >= WEBSOCKET_MESSAGE_SIZE)
+                return -1;
+
+            if(reader->level == header + length)
+                break;
+        }
+
+        /* read only up to the end of this frame, the next one stays in the socket */
+        if(reader->level < header) {
+            wanted = header - reader->level;
+            rc = receive_available(context_fd, reader->header + reader->level, wanted);
+        } else {
+            wanted = header + length - reader->level;
+            rc = receive_available(context_fd, reader->payload + reader->level - header, wanted);
+        }
+
+        if(rc < 0)
+            return -1;
+        if(rc == 0)
+            return WEBSOCKET_PARTIAL;
+        reader->level += rc;
+    }
+
+    *opcode = reader->header[0] & 0x0F;
+    for(i = 0; i < length; i++)
+        reader->payload[i] ^= reader->header[2 + extra + (i % 4)];
+    reader->payload[length] = '\0';
+    reader->level = 0;
+
+    return (int)length;
+}
@@ -0,0 +1,66 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stddef.h>
+
+/* appended to the Sec-WebSocket-Key of the client, see RFC 6455 */
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/* length of the Sec-WebSocket-Accept value including the null-character */
+#define WEBSOCKET_ACCEPT_SIZE 29
+
+/* a frame header is at most 14 bytes long (with masking key) */
+#define WEBSOCKET_HEADER_SIZE 14
+
+/* largest message accepted from a client, including the null-character */
+#define WEBSOCKET_MESSAGE_SIZE 128
+
+/* returned by websocket_receive() while the frame is not complete */
+#define WEBSOCKET_PARTIAL -2
+
+/* frame opcodes */
+typedef enum {
+    WS_OP_CONTINUATION = 0x0,
+    WS_OP_TEXT         = 0x1,
+    WS_OP_BINARY       = 0x2,
+    WS_OP_CLOSE        = 0x8,
+    WS_OP_PING         = 0x9,
+    WS_OP_PONG         = 0xA
+} websocket_opcode;
+
+/* a frame of the client that arrives in pieces, keep one per connection */
+typedef struct {
+    unsigned char header[WEBSOCKET_HEADER_SIZE];
+    char payload[WEBSOCKET_MESSAGE_SIZE];
+    size_t level;           /* bytes of the frame received so far, header included */
+} websocket_reader;
+
+void websocket_accept_key(const char *key, char *accept);
+int websocket_frame_header(unsigned char *header, websocket_opcode opcode, size_t length);
+/* these need the cfd type, include httpd.h first */
+int websocket_send(cfd *context_fd, websocket_opcode opcode, const void *data, size_t length);
+int websocket_receive(cfd *context_fd, websocket_reader *reader, websocket_opcode *opcode);
+
+#endif
@@ -25,53 +25,59 @@
   Writen by Dimitrios Zachariadis
   Version 0.1, May 2010
 
-  It provides a mechanism to take snapshots with a trigger from a UDP packet.
-  The UDP msg contains the path for the snapshot jpeg file
-  It echoes the message received back to the sender, after taking the snapshot
+  It is an RTSP server (RFC 2326) for a single video stream. The frames of
+  the input plugin are sent as RTP/JPEG (RFC 2435) to each client that
+  started playing, over UDP or interleaved with the RTSP connection.
+  Every connection is served by its own thread, like the clients of
+  output_http.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/ioctl.h>
+#include <strings.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/socket.h>
-#include <resolv.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
-#include <sys/stat.h>
 #include <getopt.h>
 #include <pthread.h>
-#include <fcntl.h>
 #include <time.h>
+#include <poll.h>
 #include <syslog.h>
 
-#include <dirent.h>
-
+#include "output_rtsp.h"
 
 #include "../../utils.h"
 #include "../../mjpg_streamer.h"
 
 #define OUTPUT_PLUGIN_NAME "RTSP output plugin"
 
-enum RTSP_State {
-    RTSP_State_Setup,
-    RTSP_State_Playing,
-    RTSP_State_Paused,
-    RTSP_State_Teardown,
-};
-
-static pthread_t worker;
+static pthread_t server, multicast;
 static globals *pglobal;
-static int fd, max_frame_size;
-static unsigned char *frame = NULL;
-static char *command = NULL;
 static int input_number = 0;
 
-// UDP port
-static int port = 554;
+/* TCP port for RTSP, UDP ports for RTP and RTCP */
+static int port = RTSP_PORT;
+static int rtp_port = RTP_PORT;
+static int server_sd = -1, rtp_sd = -1, rtcp_sd = -1;
+static udp_batch_method rtp_method = UDP_BATCH_SINGLE;
+
+/*
+ * multicast: one copy of the stream goes to the group, no matter how many
+ * receivers there are. The packets of each frame are spread over "pace"
+ * percent of the frame interval, -1 is the default (MULTICAST_PACE for the
+ * group, unicast clients get bursts).
+ */
+static struct in_addr multicast_group;
+static int multicast_port = MULTICAST_PORT, multicast_ttl = 1, multicast_sd = -1;
+static int pace = -1;
+static rtsp_session *multicast_session = NULL;
 
 /******************************************************************************
 Description.: print a help message
@@ -84,155 +90,756 @@ void help(void)
             " Help for output plugin..: "OUTPUT_PLUGIN_NAME"\n" \
             " ---------------------------------------------------------------\n" \
             " The following parameters can be passed to this plugin:\n\n" \
-            " [-p | --port ]..........: UDP port to listen for picture requests. UDP message is the filename to save\n\n" \
-            " [-i | --input ].......: read frames from the specified input plugin (first input plugin between the arguments is the 0th)\n\n" \
-            " ---------------------------------------------------------------\n");
+            " [-p | --port ]..........: TCP port of the RTSP server\n" \
+            " [-r | --rtp_port ]......: UDP port to send RTP from, RTCP uses the next one\n" \
+            " [-i | --input ].......: read frames from the specified input plugin (first input plugin between the arguments is the 0th)\n" \
+            " [-m | --multicast ].....: send the stream to this group, \"group[:port]\"\n" \
+            " [-t | --ttl ]...........: time to live of the multicast packets, default 1\n" \
+            " [--pace ]...............: spread the packets of a frame over this percentage\n" \
+            "                           of the frame interval, default %d for multicast,\n" \
+            "                           0 (bursts) for unicast\n\n" \
+            " ---------------------------------------------------------------\n", MULTICAST_PACE);
 }
 
 /******************************************************************************
-Description.: clean up allocated resources
-Input Value.: unused argument
-Return Value: -
+Description.: send all bytes of an I/O vector over the RTSP connection,
+              continue after partial writes
+Input Value.: * fd.....: the connection
+              * iov....: the vector, gets modified
+              * count..: number of elements
+Return Value: 0 on success, -1 if the connection failed
 ******************************************************************************/
-void worker_cleanup(void *arg)
+static int send_all(int fd, struct iovec *iov, int count)
 {
-    static unsigned char first_run = 1;
+    struct msghdr msg;
+    ssize_t rc;
+    int i = 0;
 
-    if(!first_run) {
-        DBG("already cleaned up resources\n");
-        return;
-    }
+    while(i < count) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov + i;
+        msg.msg_iovlen = count - i;
 
-    first_run = 0;
-    OPRINT("cleaning up resources allocated by worker thread\n");
+        if((rc = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
 
-    if(frame != NULL) {
-        free(frame);
+        for(; i < count && (size_t)rc >= iov[i].iov_len; i++)
+            rc -= iov[i].iov_len;
+        if(i < count) {
+            iov[i].iov_base = (char *)iov[i].iov_base + rc;
+            iov[i].iov_len -= rc;
+        }
     }
-    close(fd);
+
+    return 0;
 }
 
 /******************************************************************************
-Description.: this is the main worker thread
-              it loops forever, grabs a fresh frame and stores it to file
-Input Value.:
-Return Value:
+Description.: send an RTP or RTCP packet to the client of a session
+Input Value.: * s......: the session
+              * rtcp...: 0 for RTP, 1 for RTCP
+              * iov....: the packet, iov[0] is left empty for the interleaved
+                         header
+              * count..: number of elements including iov[0]
+Return Value: 0 on success, -1 if the client is gone
 ******************************************************************************/
-void *worker_thread(void *arg)
+static int send_packet(rtsp_session *s, int rtcp, struct iovec *iov, int count)
 {
-    int ok = 1, frame_size = 0, rc = 0;
-    char buffer1[1024] = {0};
-    unsigned char *tmp_framebuffer = NULL;
+    unsigned char interleaved[4];
+    struct msghdr msg;
+    size_t length = 0;
+    int i;
 
-    /* set cleanup handler to cleanup allocated resources */
-    pthread_cleanup_push(worker_cleanup, NULL);
+    for(i = 1; i < count; i++)
+        length += iov[i].iov_len;
 
-    // set UDP server data structures ---------------------------
-    if(port <= 0) {
-        OPRINT("a valid UDP port must be provided\n");
-        return NULL;
+    if(s->transport == RTP_TCP) {
+        interleaved[0] = '$';
+        interleaved[1] = rtcp ? s->rtcp_channel : s->rtp_channel;
+        interleaved[2] = (length >> 8) & 0xFF;
+        interleaved[3] = length & 0xFF;
+        iov[0].iov_base = interleaved;
+        iov[0].iov_len = sizeof(interleaved);
+        return send_all(s->fd, iov, count);
     }
-    struct sockaddr_in addr;
-    int sd;
-    int bytes;
-    unsigned int addr_len = sizeof(addr);
-    char udpbuffer[1024] = {0};
-    sd = socket(PF_INET, SOCK_DGRAM, 0);
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
-    if(bind(sd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
-        perror("bind");
-    // -----------------------------------------------------------
 
-    while(ok >= 0 && !pglobal->stop) {
-        DBG("waiting for a UDP message\n");
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = rtcp ? &s->rtcp_addr : &s->rtp_addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = iov + 1;
+    msg.msg_iovlen = count - 1;
 
-        // UDP receive ---------------------------------------------
-        memset(udpbuffer, 0, sizeof(udpbuffer));
-        bytes = recvfrom(sd, udpbuffer, sizeof(udpbuffer), 0, (struct sockaddr*)&addr, &addr_len);
-        // ---------------------------------------------------------
+    /* a lost datagram is no reason to give up the client */
+    if(sendmsg(s->transport == RTP_MULTICAST ? multicast_sd : rtcp ? rtcp_sd : rtp_sd, &msg, 0) < 0) {
+        DBG("sendmsg: %s\n", strerror(errno));
+    }
 
+    return 0;
+}
 
+/******************************************************************************
+Description.: send an RTCP sender report, it lets the client map the RTP
+              timestamps to the wall clock
+Input Value.: * s.........: the session
+              * timestamp.: RTP timestamp of the frame that was just sent
+Return Value: 0 on success, -1 if the client is gone
+******************************************************************************/
+static int send_sender_report(rtsp_session *s, unsigned int timestamp)
+{
+    unsigned char report[28];
+    unsigned int words[7];
+    struct iovec iov[2];
+    struct timeval now;
+    int i;
 
-        DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    gettimeofday(&now, NULL);
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+    words[0] = 0x80C80006;          /* version 2, sender report, 6 words follow */
+    words[1] = s->ssrc;
+    words[2] = now.tv_sec + 2208988800U;  /* NTP time starts in 1900 */
+    words[3] = (unsigned int)(((unsigned long long)now.tv_usec << 32) / 1000000);
+    words[4] = timestamp;
+    words[5] = s->sent_packets;
+    words[6] = s->sent_octets;
 
-        /* check if buffer for frame is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+    for(i = 0; i < 7; i++) {
+        report[i * 4] = words[i] >> 24;
+        report[i * 4 + 1] = (words[i] >> 16) & 0xFF;
+        report[i * 4 + 2] = (words[i] >> 8) & 0xFF;
+        report[i * 4 + 3] = words[i] & 0xFF;
+    }
 
-            max_frame_size = frame_size + (1 << 16);
-            if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
+    iov[1].iov_base = report;
+    iov[1].iov_len = sizeof(report);
+    return send_packet(s, 1, iov, 2);
+}
+
+/******************************************************************************
+Description.: packetize a frame and send it to the client of a session.
+              All packets are built back to back in one buffer, so over TCP
+              the frame is a single write and over UDP the kernel gets up
+              to UDP_BATCH_MAX packets per system call.
+Input Value.: * s.........: the session
+              * data......: the JPEG image
+              * size......: length of the image
+              * timestamp.: capture time of the frame
+Return Value: 0 on success (frames that can not be sent are skipped),
+              -1 if the client is gone
+******************************************************************************/
+static int send_frame(rtsp_session *s, const unsigned char *data, int size, struct timeval timestamp)
+{
+    unsigned char *packet, *tmp;
+    unsigned int rtp_timestamp;
+    struct iovec iov[1];
+    jpeg_frame jpeg;
+    size_t used = 0, stride, needed;
+    int offset, length, header_size, prefix, tables = 0;
+
+    if(rtp_jpeg_parse(data, size, &jpeg) != 0) {
+        DBG("the frame can not be sent as RTP/JPEG, it is skipped\n");
+        return 0;
+    }
+
+    /*
+     * a new Q value for new tables, as long as they stay the same the
+     * client uses the ones it received with the first frame. Receivers of
+     * the group may join at any time, they get the tables with every frame.
+     */
+    if(s->q == 0 || jpeg.tables_size != s->tables_size || memcmp(jpeg.tables, s->tables, jpeg.tables_size) != 0) {
+        s->q = (s->q == 0 || s->q == 254) ? 128 : s->q + 1;
+        memcpy(s->tables, jpeg.tables, jpeg.tables_size);
+        s->tables_size = jpeg.tables_size;
+        tables = 1;
+    }
+    if(s->transport == RTP_MULTICAST)
+        tables = 1;
+
+    rtp_timestamp = s->timestamp_offset +
+                    (unsigned int)(((unsigned long long)timestamp.tv_sec * 1000000 + timestamp.tv_usec) * RTP_CLOCK_RATE / 1000000);
+
+    /* every packet but the last one fills its slot */
+    prefix = (s->transport == RTP_TCP) ? RTP_INTERLEAVED_SIZE : 0;
+    stride = prefix + RTP_PACKET_SIZE;
+
+    for(offset = 0; offset < jpeg.scan_size; offset += length) {
+        if(used + stride > s->packets_size) {
+            needed = MAX(s->packets_size * 2, (size_t)jpeg.scan_size + 64 * stride);
+            if((tmp = realloc(s->packets, needed)) == NULL) {
                 LOG("not enough memory\n");
-                return NULL;
+                return -1;
             }
+            s->packets = tmp;
+            s->packets_size = needed;
+        }
+
+        packet = s->packets + used;
+        header_size = rtp_jpeg_header(packet + prefix + RTP_HEADER_SIZE, &jpeg, s->q, offset, tables);
+        length = MIN(jpeg.scan_size - offset, RTP_PACKET_SIZE - RTP_HEADER_SIZE - header_size);
 
-            frame = tmp_framebuffer;
+        if(prefix > 0) {
+            packet[0] = '$';
+            packet[1] = s->rtp_channel;
+            packet[2] = ((RTP_HEADER_SIZE + header_size + length) >> 8) & 0xFF;
+            packet[3] = (RTP_HEADER_SIZE + header_size + length) & 0xFF;
+            packet += prefix;
         }
 
-        /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        /* the marker bit is set on the last packet of a frame */
+        packet[0] = 0x80;
+        packet[1] = RTP_PAYLOAD_TYPE_JPEG | ((offset + length == jpeg.scan_size) ? 0x80 : 0);
+        packet[2] = s->sequence >> 8;
+        packet[3] = s->sequence & 0xFF;
+        packet[4] = rtp_timestamp >> 24;
+        packet[5] = (rtp_timestamp >> 16) & 0xFF;
+        packet[6] = (rtp_timestamp >> 8) & 0xFF;
+        packet[7] = rtp_timestamp & 0xFF;
+        packet[8] = s->ssrc >> 24;
+        packet[9] = (s->ssrc >> 16) & 0xFF;
+        packet[10] = (s->ssrc >> 8) & 0xFF;
+        packet[11] = s->ssrc & 0xFF;
+
+        memcpy(packet + RTP_HEADER_SIZE + header_size, jpeg.scan + offset, length);
+        used += prefix + RTP_HEADER_SIZE + header_size + length;
+
+        s->sequence++;
+        s->sent_packets++;
+        s->sent_octets += header_size + length;
+    }
+
+    if(s->transport == RTP_TCP) {
+        iov[0].iov_base = s->packets;
+        iov[0].iov_len = used;
+        if(send_all(s->fd, iov, 1) != 0)
+            return -1;
+    } else if(udp_send_paced(s->transport == RTP_MULTICAST ? multicast_sd : rtp_sd,
+                             (struct sockaddr *)&s->rtp_addr, sizeof(s->rtp_addr),
+                             s->packets, used, RTP_PACKET_SIZE, &s->method,
+                             s->interval * (pace >= 0 ? pace : s->transport == RTP_MULTICAST ? MULTICAST_PACE : 0) / 100) != 0) {
+        /* a lost frame is no reason to give up the client */
+        DBG("udp_send_batch: %s\n", strerror(errno));
+    }
+
+    if(time(NULL) - s->last_report >= RTCP_INTERVAL) {
+        s->last_report = time(NULL);
+        return send_sender_report(s, rtp_timestamp);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: find a header of a request
+Input Value.: * request: the request, null-terminated
+              * name...: name of the header including the colon
+              * value..: where to store the value
+              * size...: size of value
+Return Value: 0 if found, -1 otherwise
+******************************************************************************/
+static int get_header(const char *request, const char *name, char *value, size_t size)
+{
+    const char *line, *end;
+    size_t length = strlen(name);
+
+    for(line = strstr(request, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if(strncasecmp(line + 2, name, length) != 0)
+            continue;
+
+        line += 2 + length;
+        line += strspn(line, " \t");
+        if((end = strstr(line, "\r\n")) == NULL)
+            end = line + strlen(line);
+
+        snprintf(value, size, "%.*s", (int)(end - line), line);
+        return 0;
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+Description.: send the answer to a request
+Input Value.: * s......: the session
+              * status.: status code and text, e.g. "200 OK"
+              * cseq...: sequence number of the request
+              * headers: additional header lines, each ending with CRLF
+              * body...: NULL or the body
+Return Value: 0 on success, -1 if the connection failed
+******************************************************************************/
+static int send_reply(rtsp_session *s, const char *status, const char *cseq, const char *headers, const char *body)
+{
+    char buffer[RTSP_BUFFER_SIZE], session[64] = "";
+    struct iovec iov[2];
+    int length;
+
+    if(s->session != 0)
+        snprintf(session, sizeof(session), "Session: %08X;timeout=%d\r\n", s->session, RTSP_SESSION_TIMEOUT);
+
+    length = snprintf(buffer, sizeof(buffer),
+                      "RTSP/1.0 %s\r\n" \
+                      "CSeq: %s\r\n" \
+                      "Server: MJPG-Streamer/0.2\r\n" \
+                      "%s%s" \
+                      "Content-Length: %d\r\n" \
+                      "\r\n",
+                      status, cseq, session, headers,
+                      body != NULL ? (int)strlen(body) : 0);
+
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = MIN(length, (int)sizeof(buffer) - 1);
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = body != NULL ? strlen(body) : 0;
+
+    return send_all(s->fd, iov, 2);
+}
+
+/******************************************************************************
+Description.: describe the stream
+Input Value.: * s......: the session
+              * cseq...: sequence number of the request
+              * url....: URL of the request
+Return Value: 0 on success, -1 if the connection failed
+******************************************************************************/
+static int handle_describe(rtsp_session *s, const char *cseq, const char *url)
+{
+    char sdp[1024], headers[1024], address[INET_ADDRSTRLEN] = "0.0.0.0";
+    struct sockaddr_in local;
+    socklen_t length = sizeof(local);
+
+    if(getsockname(s->fd, (struct sockaddr *)&local, &length) == 0)
+        inet_ntop(AF_INET, &local.sin_addr, address, sizeof(address));
+
+    snprintf(sdp, sizeof(sdp),
+             "v=0\r\n" \
+             "o=- %u 1 IN IP4 %s\r\n" \
+             "s=MJPG-streamer\r\n" \
+             "t=0 0\r\n" \
+             "a=control:*\r\n" \
+             "m=video 0 RTP/AVP %d\r\n" \
+             "c=IN IP4 0.0.0.0\r\n" \
+             "a=control:track0\r\n",
+             (unsigned int)time(NULL), address, RTP_PAYLOAD_TYPE_JPEG);
+
+    /* the URL of the track is relative to the one of the stream */
+    snprintf(headers, sizeof(headers),
+             "Content-Type: application/sdp\r\n" \
+             "Content-Base: %s%s\r\n",
+             url, url[strlen(url) - 1] == '/' ? "" : "/");
+
+    return send_reply(s, "200 OK", cseq, headers, sdp);
+}
+
+/******************************************************************************
+Description.: choose the transport of the stream from the Transport header
+Input Value.: * s......: the session
+              * cseq...: sequence number of the request
+              * request: the request
+Return Value: 0 on success, -1 if the connection failed
+******************************************************************************/
+static int handle_setup(rtsp_session *s, const char *cseq, const char *request)
+{
+    char transport[256], headers[512], *value;
+    int first, second;
+
+    if(get_header(request, "Transport:", transport, sizeof(transport)) != 0 ||
+       (strstr(transport, "multicast") != NULL && multicast_session == NULL))
+        return send_reply(s, "461 Unsupported Transport", cseq, "", NULL);
+
+    if(s->state == RTSP_State_Playing)
+        return send_reply(s, "455 Method Not Valid in This State", cseq, "", NULL);
+
+    if(strstr(transport, "multicast") != NULL) {
+        /* the client joins the group, the multicast thread sends the stream */
+        s->transport = RTP_MULTICAST;
+        snprintf(headers, sizeof(headers), "Transport: RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d;ssrc=%08X\r\n",
+                 inet_ntoa(multicast_group), multicast_port, multicast_port + 1, multicast_ttl, multicast_session->ssrc);
+    } else if(strstr(transport, "RTP/AVP/TCP") != NULL) {
+        first = 0;
+        second = 1;
+        if((value = strstr(transport, "interleaved=")) != NULL && sscanf(value, "interleaved=%d-%d", &first, &second) < 2)
+            second = first + 1;
+
+        s->transport = RTP_TCP;
+        s->rtp_channel = first & 0xFF;
+        s->rtcp_channel = second & 0xFF;
+        snprintf(headers, sizeof(headers), "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d;ssrc=%08X\r\n",
+                 s->rtp_channel, s->rtcp_channel, s->ssrc);
+    } else {
+        if((value = strstr(transport, "client_port=")) == NULL || sscanf(value, "client_port=%d", &first) != 1)
+            return send_reply(s, "461 Unsupported Transport", cseq, "", NULL);
+        if(sscanf(value, "client_port=%d-%d", &first, &second) != 2)
+            second = first + 1;
+
+        s->transport = RTP_UDP;
+        s->rtp_addr = s->peer;
+        s->rtp_addr.sin_port = htons(first);
+        s->rtcp_addr = s->peer;
+        s->rtcp_addr.sin_port = htons(second);
+        snprintf(headers, sizeof(headers), "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d;ssrc=%08X\r\n",
+                 first, second, rtp_port, rtp_port + 1, s->ssrc);
+    }
+
+    while(s->session == 0)
+        s->session = random();
+
+    return send_reply(s, "200 OK", cseq, headers, NULL);
+}
+
+/******************************************************************************
+Description.: answer a complete request
+Input Value.: * s......: the session
+              * request: the request, null-terminated
+Return Value: 0 on success, -1 if the connection failed
+******************************************************************************/
+static int handle_request(rtsp_session *s, char *request)
+{
+    char method[32], url[512], cseq[32] = "0", session[64], headers[1024];
+    struct timeval now;
 
-        /* allow others to access the global buffer again */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+    if(sscanf(request, "%31s %511s", method, url) != 2)
+        return -1;
 
-        /* only save a file if a name came in with the UDP message */
-        if(strlen(udpbuffer) > 0) {
-            DBG("writing file: %s\n", udpbuffer);
+    get_header(request, "CSeq:", cseq, sizeof(cseq));
+    DBG("%s %s (CSeq %s)\n", method, url, cseq);
+
+    if(strcmp(method, "OPTIONS") == 0)
+        return send_reply(s, "200 OK", cseq, "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER\r\n", NULL);
+
+    if(strcmp(method, "DESCRIBE") == 0)
+        return handle_describe(s, cseq, url);
+
+    if(strcmp(method, "SETUP") == 0)
+        return handle_setup(s, cseq, request);
+
+    /* everything else belongs to the session */
+    if(s->session == 0 || get_header(request, "Session:", session, sizeof(session)) != 0 ||
+       strtoul(session, NULL, 16) != s->session) {
+        /* keep-alives without session are fine */
+        if(strcmp(method, "GET_PARAMETER") == 0 && s->session == 0)
+            return send_reply(s, "200 OK", cseq, "", NULL);
+        return send_reply(s, "454 Session Not Found", cseq, "", NULL);
+    }
+
+    if(strcmp(method, "PLAY") == 0 && s->transport == RTP_MULTICAST) {
+        s->state = RTSP_State_Playing;
+        return send_reply(s, "200 OK", cseq, "Range: npt=0.000-\r\n", NULL);
+    }
+
+    if(strcmp(method, "PLAY") == 0) {
+        /* frames of inputs without timestamps get the time they arrive */
+        now = pglobal->in[input_number].timestamp;
+        if(!timerisset(&now))
+            gettimeofday(&now, NULL);
+        snprintf(headers, sizeof(headers), "Range: npt=0.000-\r\nRTP-Info: url=%s;seq=%u;rtptime=%u\r\n",
+                 url, s->sequence, s->timestamp_offset +
+                 (unsigned int)(((unsigned long long)now.tv_sec * 1000000 + now.tv_usec) * RTP_CLOCK_RATE / 1000000));
+        s->state = RTSP_State_Playing;
+        return send_reply(s, "200 OK", cseq, headers, NULL);
+    }
+
+    if(strcmp(method, "PAUSE") == 0) {
+        s->state = RTSP_State_Paused;
+        return send_reply(s, "200 OK", cseq, "", NULL);
+    }
+
+    if(strcmp(method, "TEARDOWN") == 0) {
+        s->state = RTSP_State_Teardown;
+        return send_reply(s, "200 OK", cseq, "", NULL);
+    }
 
-            /* open file for write. Path must pre-exist */
-            if((fd = open(udpbuffer, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-                OPRINT("could not open the file %s\n", udpbuffer);
-                return NULL;
+    if(strcmp(method, "GET_PARAMETER") == 0)
+        return send_reply(s, "200 OK", cseq, "", NULL);
+
+    return send_reply(s, "501 Not Implemented", cseq, "", NULL);
+}
+
+/******************************************************************************
+Description.: read from the RTSP connection and answer all complete requests,
+              interleaved RTCP packets of the client are skipped
+Input Value.: the session
+Return Value: 0 on success, -1 if the connection was closed or failed
+******************************************************************************/
+static int receive_requests(rtsp_session *s)
+{
+    char length_value[32], *end;
+    ssize_t rc;
+    int length, used;
+
+    if((rc = recv(s->fd, s->buffer + s->level, sizeof(s->buffer) - 1 - s->level, 0)) <= 0)
+        return -1;
+    s->level += rc;
+    s->buffer[s->level] = '\0';
+
+    while(s->level > 0) {
+        if(s->buffer[0] == '$') {
+            /* interleaved packet: '$', channel, 16 bit length */
+            if(s->level < 4)
+                break;
+            used = 4 + ((unsigned char)s->buffer[2] << 8 | (unsigned char)s->buffer[3]);
+            if(used > s->level) {
+                /* skip what is there, the rest follows */
+                if(used >= (int)sizeof(s->buffer))
+                    return -1;
+                break;
+            }
+        } else {
+            if((end = strstr(s->buffer, "\r\n\r\n")) == NULL) {
+                /* the request does not fit into the buffer */
+                if(s->level >= (int)sizeof(s->buffer) - 1)
+                    return -1;
+                break;
             }
+            end[2] = '\0';
 
-            /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
-                OPRINT("could not write to file %s\n", udpbuffer);
-                perror("write()");
-                close(fd);
-                return NULL;
+            /* requests like SET_PARAMETER may have a body, it is ignored */
+            length = 0;
+            if(get_header(s->buffer, "Content-Length:", length_value, sizeof(length_value)) == 0)
+                length = MAX(atoi(length_value), 0);
+            used = (end + 4 - s->buffer) + length;
+            if(used > s->level) {
+                if(used >= (int)sizeof(s->buffer))
+                    return -1;
+                end[2] = '\r';
+                break;
             }
 
-            close(fd);
+            if(handle_request(s, s->buffer) != 0)
+                return -1;
         }
 
-        // send back client's message that came in udpbuffer
-        sendto(sd, udpbuffer, bytes, 0, (struct sockaddr*)&addr, sizeof(addr));
+        memmove(s->buffer, s->buffer + used, s->level - used);
+        s->level -= used;
+        s->buffer[s->level] = '\0';
+    }
 
-        /* call the command if user specified one, pass current filename as argument */
-        if(command != NULL) {
-            memset(buffer1, 0, sizeof(buffer1));
+    return 0;
+}
 
-            /* udpbuffer still contains the filename, pass it to the command as parameter */
-            snprintf(buffer1, sizeof(buffer1), "%s \"%s\"", command, udpbuffer);
-            DBG("calling command %s", buffer1);
+/******************************************************************************
+Description.: wait for a fresh frame of the input plugin and copy it, the
+              average frame interval is updated for the pacing. A frame is
+              fresh if the sequence number of the input moved since the last
+              one, a new session starts with the current frame. Inputs that
+              leave the timestamp empty get the time the frame arrived.
+Input Value.: * s......: the session, gets the frame
+              * timeout: milliseconds to wait at most
+Return Value: 1 if there is a fresh frame, 0 if not, -1 if out of memory
+******************************************************************************/
+static int wait_frame(rtsp_session *s, int timeout)
+{
+    struct timespec deadline;
+    struct timeval timestamp;
+    unsigned char *tmp;
+    long long delta;
+    int rc = 0, fresh;
 
-            /* in addition provide the filename as environment variable */
-            if((rc = setenv("MJPG_FILE", udpbuffer, 1)) != 0) {
-                LOG("setenv failed (return value %d)\n", rc);
-            }
+    pthread_mutex_lock(&pglobal->in[input_number].db);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000 * 1000;
+    if(deadline.tv_nsec >= 1000 * 1000 * 1000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+    while(pglobal->in[input_number].sequence == s->frame_sequence && rc == 0)
+        rc = pthread_cond_timedwait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db, &deadline);
 
-            /* execute the command now */
-            if((rc = system(buffer1)) != 0) {
-                LOG("command failed (return value %d)\n", rc);
+    /* not all inputs set a timestamp */
+    timestamp = pglobal->in[input_number].timestamp;
+    fresh = pglobal->in[input_number].sequence != s->frame_sequence;
+    if(fresh) {
+        s->frame_sequence = pglobal->in[input_number].sequence;
+        if(!timerisset(&timestamp))
+            gettimeofday(&timestamp, NULL);
+
+        s->frame_size = pglobal->in[input_number].size;
+
+        /* check if buffer for frame is large enough, increase it if necessary */
+        if(s->frame_size > s->max_frame_size) {
+            DBG("increasing buffer size to %d\n", s->frame_size);
+            if((tmp = realloc(s->frame, s->frame_size + (1 << 16))) == NULL) {
+                pthread_mutex_unlock(&pglobal->in[input_number].db);
+                LOG("not enough memory\n");
+                return -1;
             }
+            s->frame = tmp;
+            s->max_frame_size = s->frame_size + (1 << 16);
+        }
+
+        memcpy(s->frame, pglobal->in[input_number].buf, s->frame_size);
+    }
+
+    /* allow others to access the global buffer again */
+    pthread_mutex_unlock(&pglobal->in[input_number].db);
+
+    if(!fresh)
+        return 0;
+
+    /* moving average of the frame interval, longer gaps are pauses of the input */
+    delta = (long long)(timestamp.tv_sec - s->last.tv_sec) * 1000000 + (timestamp.tv_usec - s->last.tv_usec);
+    if(delta > 0 && delta <= 2000000)
+        s->interval = s->interval > 0 ? (s->interval * 7 + delta) / 8 : delta;
+    s->last = timestamp;
+
+    return 1;
+}
+
+/******************************************************************************
+Description.: serve one RTSP connection, while the session plays it waits
+              for the frames of the input plugin and sends them
+Input Value.: the session, it is freed at the end
+Return Value: NULL
+******************************************************************************/
+void *client_thread(void *arg)
+{
+    rtsp_session *s = arg;
+    struct pollfd pfd;
+    int playing, rc;
+
+    pfd.fd = s->fd;
+    pfd.events = POLLIN;
+
+    while(!pglobal->stop && s->state != RTSP_State_Teardown) {
+        /* the multicast thread sends the frames of multicast clients */
+        playing = s->state == RTSP_State_Playing && s->transport != RTP_MULTICAST;
+
+        /* wait for a fresh frame, but not forever so requests get answered */
+        if(playing) {
+            if((rc = wait_frame(s, 100)) < 0)
+                break;
+            if(rc > 0 && send_frame(s, s->frame, s->frame_size, s->last) != 0)
+                break;
         }
+
+        /* answer the requests, only block while no frames are sent */
+        rc = poll(&pfd, 1, playing ? 0 : 1000);
+        if(rc < 0 && errno != EINTR)
+            break;
+        if(rc > 0 && receive_requests(s) != 0)
+            break;
     }
 
-    // close UDP port
-    if(port > 0)
+    DBG("closing RTSP connection\n");
+    close(s->fd);
+    free(s->frame);
+    free(s->packets);
+    free(s);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: send every frame to the multicast group
+Input Value.: unused
+Return Value: NULL
+******************************************************************************/
+void *multicast_thread(void *arg)
+{
+    rtsp_session *s = multicast_session;
+
+    while(!pglobal->stop) {
+        if(wait_frame(s, 1000) > 0)
+            send_frame(s, s->frame, s->frame_size, s->last);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: bind a socket to a port on all addresses
+Input Value.: * type...: SOCK_STREAM or SOCK_DGRAM
+              * port...: the port
+Return Value: the socket or -1 in case of error
+******************************************************************************/
+static int open_socket(int type, int port)
+{
+    struct sockaddr_in addr;
+    int sd, on = 1;
+
+    if((sd = socket(PF_INET, type, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    /* ignore "socket already in use" errors */
+    if(setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+        perror("setsockopt(SO_REUSEADDR) failed");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if(bind(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("bind");
+        close(sd);
+        return -1;
+    }
+
+    if(type == SOCK_STREAM && listen(sd, RTSP_BACKLOG) != 0) {
+        perror("listen");
         close(sd);
+        return -1;
+    }
+
+    return sd;
+}
+
+/******************************************************************************
+Description.: accept RTSP connections and start a thread for each one
+Input Value.: unused
+Return Value: NULL
+******************************************************************************/
+void *server_thread(void *arg)
+{
+    struct pollfd pfd;
+    struct timeval timeout;
+    socklen_t addr_len;
+    rtsp_session *s;
+    pthread_t client;
+    int fd;
+
+    pfd.fd = server_sd;
+    pfd.events = POLLIN;
+
+    while(!pglobal->stop) {
+        /* wake up now and then to notice the stop signal */
+        if(poll(&pfd, 1, 1000) <= 0)
+            continue;
+
+        if((s = calloc(1, sizeof(rtsp_session))) == NULL) {
+            LOG("not enough memory\n");
+            continue;
+        }
+
+        addr_len = sizeof(s->peer);
+        if((fd = accept(server_sd, (struct sockaddr *)&s->peer, &addr_len)) < 0) {
+            perror("accept");
+            free(s);
+            continue;
+        }
 
-    /* cleanup now */
-    pthread_cleanup_pop(1);
+        /* a client that does not take the interleaved packets must not block forever */
+        timeout.tv_sec = 5;
+        timeout.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        s->fd = fd;
+        s->state = RTSP_State_Setup;
+        s->ssrc = random();
+        s->sequence = random();
+        s->timestamp_offset = random();
+        s->method = rtp_method;
+
+        DBG("RTSP connection from %s\n", inet_ntoa(s->peer.sin_addr));
+        if(pthread_create(&client, NULL, client_thread, s) != 0) {
+            DBG("could not launch another client thread\n");
+            close(fd);
+            free(s);
+            continue;
+        }
+        pthread_detach(client);
+    }
 
     return NULL;
 }
@@ -246,6 +853,8 @@ Return Value: 0 if everything is ok, non-zero otherwise
 ******************************************************************************/
 int output_init(output_parameter *param)
 {
+    unsigned char ttl;
+    char *value;
     int i;
 
     param->argv[0] = OUTPUT_PLUGIN_NAME;
@@ -266,6 +875,13 @@ int output_init(output_parameter *param)
             {"port", required_argument, 0, 0},
             {"i", required_argument, 0, 0},
             {"input", required_argument, 0, 0},
+            {"r", required_argument, 0, 0},
+            {"rtp_port", required_argument, 0, 0},
+            {"m", required_argument, 0, 0},
+            {"multicast", required_argument, 0, 0},
+            {"t", required_argument, 0, 0},
+            {"ttl", required_argument, 0, 0},
+            {"pace", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -288,6 +904,7 @@ int output_init(output_parameter *param)
             help();
             return 1;
             break;
+            /* p, port */
         case 2:
         case 3:
             DBG("case 2,3\n");
@@ -299,6 +916,36 @@ int output_init(output_parameter *param)
             DBG("case 4,5\n");
             input_number = atoi(optarg);
             break;
+            /* r, rtp_port */
+        case 6:
+        case 7:
+            DBG("case 6,7\n");
+            rtp_port = atoi(optarg);
+            break;
+            /* m, multicast */
+        case 8:
+        case 9:
+            DBG("case 8,9\n");
+            if((value = strchr(optarg, ':')) != NULL) {
+                *value = '\0';
+                multicast_port = atoi(value + 1);
+            }
+            if(inet_pton(AF_INET, optarg, &multicast_group) != 1 || !IN_MULTICAST(ntohl(multicast_group.s_addr))) {
+                OPRINT("ERROR: %s is no IPv4 multicast group\n", optarg);
+                return 1;
+            }
+            break;
+            /* t, ttl */
+        case 10:
+        case 11:
+            DBG("case 10,11\n");
+            multicast_ttl = MIN(MAX(atoi(optarg), 0), 255);
+            break;
+            /* pace */
+        case 12:
+            DBG("case 12\n");
+            pace = MIN(MAX(atoi(optarg), 0), 100);
+            break;
         }
     }
 
@@ -309,33 +956,83 @@ int output_init(output_parameter *param)
     }
 
     OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
-    OPRINT("UDP port..........: %d\n", port);
+    OPRINT("RTSP port.........: %d\n", port);
+    OPRINT("RTP/RTCP ports....: %d-%d\n", rtp_port, rtp_port + 1);
+
+    if((server_sd = open_socket(SOCK_STREAM, port)) < 0 ||
+       (rtp_sd = open_socket(SOCK_DGRAM, rtp_port)) < 0 ||
+       (rtcp_sd = open_socket(SOCK_DGRAM, rtp_port + 1)) < 0) {
+        OPRINT("ERROR: could not open the ports\n");
+        return 1;
+    }
+
+    rtp_method = udp_batch_probe(rtp_sd);
+    OPRINT("RTP over UDP with.: %s\n", udp_batch_name(rtp_method));
+    if(pace >= 0) {
+        OPRINT("pacing............: %d%% of the frame interval\n", pace);
+    }
+
+    srandom(time(NULL) ^ getpid());
+
+    if(multicast_group.s_addr != 0) {
+        OPRINT("multicast group...: %s:%d-%d, TTL %d\n", inet_ntoa(multicast_group), multicast_port, multicast_port + 1, multicast_ttl);
+
+        ttl = multicast_ttl;
+        if((multicast_sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+           setsockopt(multicast_sd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0 ||
+           (multicast_session = calloc(1, sizeof(rtsp_session))) == NULL) {
+            OPRINT("ERROR: could not set up the multicast stream\n");
+            return 1;
+        }
+
+        multicast_session->fd = -1;
+        multicast_session->state = RTSP_State_Playing;
+        multicast_session->transport = RTP_MULTICAST;
+        multicast_session->rtp_addr.sin_family = AF_INET;
+        multicast_session->rtp_addr.sin_addr = multicast_group;
+        multicast_session->rtp_addr.sin_port = htons(multicast_port);
+        multicast_session->rtcp_addr = multicast_session->rtp_addr;
+        multicast_session->rtcp_addr.sin_port = htons(multicast_port + 1);
+        multicast_session->ssrc = random();
+        multicast_session->sequence = random();
+        multicast_session->timestamp_offset = random();
+        multicast_session->method = udp_batch_probe(multicast_sd);
+    }
     return 0;
 }
 
 /******************************************************************************
-Description.: calling this function stops the worker thread
+Description.: calling this function stops the server thread and the
+              multicast thread, the client threads end on their own
 Input Value.: -
 Return Value: always 0
 ******************************************************************************/
 int output_stop(int id)
 {
-    DBG("will cancel worker thread\n");
-    pthread_cancel(worker);
+    DBG("will cancel server thread\n");
+    pthread_cancel(server);
+    if(multicast_session != NULL)
+        pthread_cancel(multicast);
     return 0;
 }
 
 /******************************************************************************
-Description.: calling this function creates and starts the worker thread
+Description.: calling this function creates and starts the server thread
+              and the multicast thread
 Input Value.: -
 Return Value: always 0
 ******************************************************************************/
 int output_run(int id)
 {
-    DBG("launching worker thread\n");
-    pthread_create(&worker, 0, worker_thread, NULL);
-    pthread_detach(worker);
+    DBG("launching server thread\n");
+    pthread_create(&server, 0, server_thread, NULL);
+    pthread_detach(server);
+
+    if(multicast_session != NULL) {
+        DBG("launching multicast thread\n");
+        pthread_create(&multicast, 0, multicast_thread, NULL);
+        pthread_detach(multicast);
+    }
     return 0;
 }
 
-
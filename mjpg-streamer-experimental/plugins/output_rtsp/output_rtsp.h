@@ -0,0 +1,113 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef OUTPUT_RTSP_H
+#define OUTPUT_RTSP_H
+
+#include <time.h>
+#include <netinet/in.h>
+
+#include "rtp_jpeg.h"
+#include "../udp_batch.h"
+
+/* default ports: RTSP, and the server ports of RTP and RTCP (+1) over UDP */
+#define RTSP_PORT 554
+#define RTP_PORT 6970
+
+/* a request including its headers has to fit into the buffer */
+#define RTSP_BUFFER_SIZE 4096
+
+/* largest RTP packet including its headers, stays below the usual MTU */
+#define RTP_PACKET_SIZE 1400
+
+/* "$", channel and length in front of each interleaved packet */
+#define RTP_INTERLEAVED_SIZE 4
+
+/* seconds a client may stay silent, it is announced with the session */
+#define RTSP_SESSION_TIMEOUT 60
+
+/* seconds between two RTCP sender reports of a session */
+#define RTCP_INTERVAL 5
+
+/* connections waiting for accept() */
+#define RTSP_BACKLOG 10
+
+/* default port of the multicast stream, RTCP uses the next one */
+#define MULTICAST_PORT 5004
+
+/* default share of the frame interval in percent the packets of a multicast frame are spread over */
+#define MULTICAST_PACE 80
+
+enum RTSP_State {
+    RTSP_State_Setup,
+    RTSP_State_Playing,
+    RTSP_State_Paused,
+    RTSP_State_Teardown,
+};
+
+/* how the RTP packets reach the client */
+typedef enum {
+    RTP_UDP,
+    RTP_TCP,        /* interleaved with the RTSP connection */
+    RTP_MULTICAST   /* the one stream to the group, sent by the multicast thread */
+} rtp_transport;
+
+/* one RTSP connection, there is at most one session on it */
+typedef struct {
+    int fd;
+    struct sockaddr_in peer;
+    enum RTSP_State state;
+    unsigned int session;           /* 0 until SETUP */
+
+    rtp_transport transport;
+    struct sockaddr_in rtp_addr;    /* UDP ports of the client */
+    struct sockaddr_in rtcp_addr;
+    int rtp_channel;                /* interleaved channels */
+    int rtcp_channel;
+    udp_batch_method method;        /* how the packets of a frame are sent over UDP */
+
+    unsigned int ssrc;
+    unsigned short sequence;
+    unsigned int timestamp_offset;  /* RTP timestamps start at a random value */
+    unsigned int sent_packets;      /* for the sender reports */
+    unsigned int sent_octets;
+    time_t last_report;
+
+    int q;                          /* Q value of the tables the client knows, 0 if none */
+    unsigned char tables[RTP_JPEG_MAX_TABLES];
+    int tables_size;
+
+    unsigned char *packets;         /* the packets of the current frame, back to back */
+    size_t packets_size;
+
+    unsigned char *frame;           /* copy of the frame being sent */
+    int frame_size;
+    int max_frame_size;
+    struct timeval last;            /* capture time of the last frame */
+    unsigned long frame_sequence;   /* input sequence number of the last frame */
+    long long interval;             /* average time between frames in microseconds */
+
+    char buffer[RTSP_BUFFER_SIZE];  /* requests of the client */
+    int level;
+} rtsp_session;
+
+#endif
@@ -0,0 +1,243 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  RTP payload format for JPEG-compressed video, RFC 2435.
+
+  Only the entropy coded data of a frame is sent, the receiver rebuilds the
+  JPEG headers from the type, the size and the quantization tables. Those
+  are sent in-band with a dynamic Q value (128-254) in the first packet of a
+  frame, a client that already knows the tables of a Q value gets a table
+  header of length zero instead. The Huffman tables have to be the standard
+  ones (ITU T.81 K.3), as with the frames of UVC cameras.
+*/
+
+#include <string.h>
+
+#include "rtp_jpeg.h"
+
+/******************************************************************************
+Description.: read the frame header and the component sampling
+Input Value.: * segment: data of the SOF0 segment, behind its length
+              * length.: length of the data
+              * jpeg...: the result
+Return Value: 0 if the image can be sent with RFC 2435, -1 otherwise
+******************************************************************************/
+static int parse_frame_header(const unsigned char *segment, int length, jpeg_frame *jpeg)
+{
+    int components, i;
+
+    if(length < 6 || segment[0] != 8)
+        return -1;
+
+    jpeg->height = segment[1] << 8 | segment[2];
+    jpeg->width = segment[3] << 8 | segment[4];
+    components = segment[5];
+
+    /* only YUV images with the chrominance at 1x1 */
+    if(components != 3 || length < 6 + 3 * components)
+        return -1;
+
+    for(i = 1; i < components; i++) {
+        if(segment[6 + i * 3 + 1] != 0x11)
+            return -1;
+    }
+
+    /* sampling of the luminance: 2x1 is type 0, 2x2 is type 1 */
+    switch(segment[6 + 1]) {
+    case 0x21:
+        jpeg->type = 0;
+        break;
+    case 0x22:
+        jpeg->type = 1;
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: collect the quantization tables of a DQT segment, tables 0 and 1
+              are sent in this order
+Input Value.: * segment: data of the DQT segment, behind its length
+              * length.: length of the data
+              * table..: the tables found so far, updated
+              * found..: sizes of the tables found so far, updated
+Return Value: 0 on success, -1 if the segment is broken
+******************************************************************************/
+static int parse_quantization_tables(const unsigned char *segment, int length, const unsigned char *table[2], int found[2])
+{
+    int i = 0, id, size;
+
+    while(i < length) {
+        id = segment[i] & 0x0F;
+        size = (segment[i] >> 4) ? 128 : 64;
+
+        if(id > 1 || i + 1 + size > length)
+            return -1;
+
+        table[id] = segment + i + 1;
+        found[id] = size;
+        i += 1 + size;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: find the parts of a baseline JPEG image the packetizer needs
+Input Value.: * data...: the JPEG image
+              * size...: length of the image
+              * jpeg...: the result, points into data
+Return Value: 0 if the image can be sent, -1 otherwise
+******************************************************************************/
+int rtp_jpeg_parse(const unsigned char *data, int size, jpeg_frame *jpeg)
+{
+    const unsigned char *table[2] = { NULL, NULL };
+    int found[2] = { 0, 0 }, i = 2, marker, length, frame = 0, j;
+
+    memset(jpeg, 0, sizeof(jpeg_frame));
+
+    if(size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return -1;
+
+    while(i + 4 <= size) {
+        if(data[i] != 0xFF)
+            return -1;
+
+        marker = data[i + 1];
+        if(marker == 0xFF) {
+            i++;
+            continue;
+        }
+
+        length = data[i + 2] << 8 | data[i + 3];
+        if(length < 2 || i + 2 + length > size)
+            return -1;
+
+        switch(marker) {
+        case 0xC0:  /* SOF0, only baseline images can be sent */
+            if(parse_frame_header(data + i + 4, length - 2, jpeg) != 0)
+                return -1;
+            frame = 1;
+            break;
+
+        case 0xC1: case 0xC2: case 0xC3: case 0xC5: case 0xC6: case 0xC7:
+        case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+            return -1;
+
+        case 0xDB:  /* DQT */
+            if(parse_quantization_tables(data + i + 4, length - 2, table, found) != 0)
+                return -1;
+            break;
+
+        case 0xDD:  /* DRI */
+            if(length != 4)
+                return -1;
+            jpeg->restart_interval = data[i + 4] << 8 | data[i + 5];
+            break;
+
+        case 0xDA:  /* SOS, the entropy coded data follows the header */
+            if(!frame || table[0] == NULL || table[1] == NULL)
+                return -1;
+
+            if(jpeg->width > RTP_JPEG_MAX_SIZE || jpeg->height > RTP_JPEG_MAX_SIZE)
+                return -1;
+
+            if(jpeg->restart_interval > 0)
+                jpeg->type += 64;
+
+            for(j = 0; j < 2; j++) {
+                memcpy(jpeg->tables + jpeg->tables_size, table[j], found[j]);
+                jpeg->tables_size += found[j];
+                if(found[j] == 128)
+                    jpeg->precision |= 1 << j;
+            }
+
+            jpeg->scan = data + i + 2 + length;
+            jpeg->scan_size = size - (i + 2 + length);
+
+            /* the receiver appends the EOI on its own */
+            if(jpeg->scan_size >= 2 && data[size - 2] == 0xFF && data[size - 1] == 0xD9)
+                jpeg->scan_size -= 2;
+            return 0;
+
+        default:    /* APPn, COM, DHT and everything else is not sent */
+            break;
+        }
+
+        i += 2 + length;
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+Description.: build the RFC 2435 headers in front of a fragment of the scan
+Input Value.: * header.: space for the headers, at most RTP_JPEG_HEADER_SIZE +
+                         RTP_JPEG_RESTART_SIZE + RTP_JPEG_QTABLE_SIZE +
+                         RTP_JPEG_MAX_TABLES bytes
+              * jpeg...: the image
+              * q......: Q value, 128 to 255 for in-band tables
+              * offset.: offset of the fragment in the scan
+              * tables.: 1 to send the tables (first fragment only), 0 to
+                         reference the tables the client received before
+Return Value: length of the headers
+******************************************************************************/
+int rtp_jpeg_header(unsigned char *header, const jpeg_frame *jpeg, int q, int offset, int tables)
+{
+    int length = 0;
+
+    /* main JPEG header, type specific is 0 for progressive frames */
+    header[length++] = 0;
+    header[length++] = (offset >> 16) & 0xFF;
+    header[length++] = (offset >> 8) & 0xFF;
+    header[length++] = offset & 0xFF;
+    header[length++] = jpeg->type;
+    header[length++] = q;
+    header[length++] = jpeg->width / 8;
+    header[length++] = jpeg->height / 8;
+
+    /* restart marker header, the fragments are not aligned to intervals */
+    if(jpeg->type >= 64) {
+        header[length++] = (jpeg->restart_interval >> 8) & 0xFF;
+        header[length++] = jpeg->restart_interval & 0xFF;
+        header[length++] = 0xFF;
+        header[length++] = 0xFF;
+    }
+
+    /* quantization table header, only in the first fragment */
+    if(q >= 128 && offset == 0) {
+        header[length++] = 0;
+        header[length++] = jpeg->precision;
+        header[length++] = tables ? (jpeg->tables_size >> 8) & 0xFF : 0;
+        header[length++] = tables ? jpeg->tables_size & 0xFF : 0;
+        if(tables) {
+            memcpy(header + length, jpeg->tables, jpeg->tables_size);
+            length += jpeg->tables_size;
+        }
+    }
+
+    return length;
+}
@@ -0,0 +1,60 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef RTP_JPEG_H
+#define RTP_JPEG_H
+
+/* RTP header without CSRCs */
+#define RTP_HEADER_SIZE 12
+
+/* static payload type and clock rate of JPEG, RFC 3551 */
+#define RTP_PAYLOAD_TYPE_JPEG 26
+#define RTP_CLOCK_RATE 90000
+
+/* main JPEG header, restart marker header and quantization table header, RFC 2435 */
+#define RTP_JPEG_HEADER_SIZE 8
+#define RTP_JPEG_RESTART_SIZE 4
+#define RTP_JPEG_QTABLE_SIZE 4
+
+/* RFC 2435 has no room for larger images, width and height are sent in units of 8 pixel */
+#define RTP_JPEG_MAX_SIZE 2040
+
+/* enough for two 16 bit quantization tables */
+#define RTP_JPEG_MAX_TABLES 256
+
+/* what the packetizer needs to know about a baseline JPEG image */
+typedef struct {
+    int type;                   /* RFC 2435 type, 0 (4:2:2) or 1 (4:2:0), +64 with restart markers */
+    int width;
+    int height;
+    int restart_interval;
+    int precision;              /* bit n is set if table n has 16 bit values */
+    unsigned char tables[RTP_JPEG_MAX_TABLES];
+    int tables_size;
+    const unsigned char *scan;  /* entropy coded data, without the headers and EOI */
+    int scan_size;
+} jpeg_frame;
+
+int rtp_jpeg_parse(const unsigned char *data, int size, jpeg_frame *jpeg);
+int rtp_jpeg_header(unsigned char *header, const jpeg_frame *jpeg, int q, int offset, int tables);
+
+#endif
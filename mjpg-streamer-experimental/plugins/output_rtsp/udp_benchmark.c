@@ -0,0 +1,187 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Compares the methods udp_send_batch() offers. It sends the same frames,
+  cut into datagrams like RTP/JPEG does, with each method and reports the
+  packet rate and the CPU time spent per Mbit. Without a destination the
+  datagrams go to a socket on the loopback interface that never reads them.
+
+  Build it with the cmake option ENABLE_UDP_BENCHMARK.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../udp_batch.h"
+
+/******************************************************************************
+Description.: print a help message
+Input Value.: name of the program
+Return Value: -
+******************************************************************************/
+static void help(const char *program)
+{
+    fprintf(stderr, "usage: %s [-s frame size] [-n frames] [-p packet size] [address port]\n" \
+            " -s: bytes per frame (default 200000)\n" \
+            " -n: frames per method (default 2000)\n" \
+            " -p: bytes per datagram (default 1400)\n" \
+            " without address the datagrams are sent to a socket on 127.0.0.1\n", program);
+}
+
+/******************************************************************************
+Description.: CPU time the process used so far
+Input Value.: -
+Return Value: seconds, user and system time together
+******************************************************************************/
+static double cpu_time(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/******************************************************************************
+Description.: wall clock
+Input Value.: -
+Return Value: seconds
+******************************************************************************/
+static double wall_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    int frame_size = 200000, frames = 2000, packet_size = 1400, sd, sink = -1, c, i, packets;
+    struct sockaddr_in to;
+    socklen_t to_length = sizeof(to);
+    udp_batch_method best, method, used;
+    double wall, cpu, megabits;
+    unsigned char *data;
+
+    while((c = getopt(argc, argv, "s:n:p:h")) != -1) {
+        switch(c) {
+        case 's':
+            frame_size = atoi(optarg);
+            break;
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        case 'p':
+            packet_size = atoi(optarg);
+            break;
+        default:
+            help(argv[0]);
+            return 1;
+        }
+    }
+
+    if(frame_size <= 0 || frames <= 0 || packet_size <= 0 || packet_size > UDP_BATCH_MAX_LENGTH ||
+       (argc - optind != 0 && argc - optind != 2)) {
+        help(argv[0]);
+        return 1;
+    }
+
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+
+    if(argc - optind == 2) {
+        if(inet_pton(AF_INET, argv[optind], &to.sin_addr) != 1) {
+            fprintf(stderr, "invalid address %s\n", argv[optind]);
+            return 1;
+        }
+        to.sin_port = htons(atoi(argv[optind + 1]));
+    } else {
+        /* a receiver that drops everything, the sender does the same work */
+        to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if((sink = socket(PF_INET, SOCK_DGRAM, 0)) < 0 ||
+           bind(sink, (struct sockaddr *)&to, sizeof(to)) != 0 ||
+           getsockname(sink, (struct sockaddr *)&to, &to_length) != 0) {
+            perror("sink");
+            return 1;
+        }
+    }
+
+    if((sd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    if((data = malloc(frame_size)) == NULL) {
+        fprintf(stderr, "not enough memory\n");
+        return 1;
+    }
+    for(i = 0; i < frame_size; i++)
+        data[i] = i;
+
+    packets = (frame_size + packet_size - 1) / packet_size;
+    megabits = (double)frame_size * frames * 8 / 1e6;
+    best = udp_batch_probe(sd);
+
+    printf("%d frames of %d bytes, %d datagrams of %d bytes each, best method: %s\n",
+           frames, frame_size, packets, packet_size, udp_batch_name(best));
+    printf("%-12s %12s %10s %14s\n", "method", "packets/s", "Mbit/s", "CPU ms/Mbit");
+
+    for(method = UDP_BATCH_SINGLE; method <= best; method++) {
+        used = method;
+        wall = wall_time();
+        cpu = cpu_time();
+
+        for(i = 0; i < frames; i++) {
+            if(udp_send_batch(sd, (struct sockaddr *)&to, sizeof(to), data, frame_size, packet_size, &used) != 0 &&
+               errno != ENOBUFS && errno != EAGAIN) {
+                perror("udp_send_batch");
+                return 1;
+            }
+        }
+
+        wall = wall_time() - wall;
+        cpu = cpu_time() - cpu;
+
+        printf("%-12s %12.0f %10.1f %14.3f%s%s\n", udp_batch_name(method),
+               (double)packets * frames / wall, megabits / wall, cpu * 1000 / megabits,
+               used != method ? ", fell back to " : "", used != method ? udp_batch_name(used) : "");
+    }
+
+    free(data);
+    close(sd);
+    if(sink >= 0)
+        close(sink);
+
+    return 0;
+}
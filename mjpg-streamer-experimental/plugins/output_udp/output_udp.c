@@ -28,6 +28,10 @@
   It provides a mechanism to take snapshots with a trigger from a UDP packet.
   The UDP msg contains the path for the snapshot jpeg file
   It echoes the message received back to the sender, after taking the snapshot
+
+  In stream mode clients subscribe on the same port and get every frame,
+  cut into datagrams as described in udp_stream.h. udp_receiver.c is a
+  reference implementation of the client side.
 */
 
 #include <stdio.h>
@@ -52,10 +56,18 @@
 
 #include "../../utils.h"
 #include "../../mjpg_streamer.h"
+#include "../udp_batch.h"
+#include "udp_stream.h"
 
 #define OUTPUT_PLUGIN_NAME "UDP output plugin"
 
-static pthread_t worker;
+/* a client of the stream */
+typedef struct {
+    struct sockaddr_in addr;
+    time_t renewed;             /* monotonic seconds of the last subscription */
+} udp_subscriber;
+
+static pthread_t worker, streamer;
 static globals *pglobal;
 static int fd, delay, max_frame_size;
 static char *folder = "/tmp";
@@ -64,7 +76,17 @@ static char *command = NULL;
 static int input_number = 0;
 
 // UDP port
-static int port = 0;
+static int port = 0, sd = -1;
+
+// stream mode
+static int stream = 0, fragment_size = UDP_STREAM_FRAGMENT_SIZE, fec = 0;
+static udp_batch_method stream_method = UDP_BATCH_SINGLE;
+static pthread_mutex_t subscribers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static udp_subscriber subscribers[UDP_STREAM_MAX_SUBSCRIBERS];
+static int subscriber_count = 0;
+
+/* key of the subscription cookies, random for every start */
+static unsigned long long cookie_key[2];
 
 /******************************************************************************
 Description.: print a help message
@@ -80,9 +102,13 @@ void help(void)
             " [-f | --folder ]........: folder to save pictures\n" \
             " [-d | --delay ].........: delay after saving pictures in ms\n" \
             " [-c | --command ].......: execute command after saveing picture\n" \
-            " [-p | --port ]..........: UDP port to listen for picture requests. UDP message is the filename to save\n\n" \
+            " [-p | --port ]..........: UDP port to listen for picture requests. UDP message is the filename to save\n" \
+            " [-s | --stream ]........: stream the frames to the clients that subscribe on the UDP port\n" \
+            " [-fs | --fragment_size ]: size of the stream datagrams, default %d\n" \
+            " [-fec ].................: send one parity datagram for every n datagrams of\n" \
+            "                           a frame, receivers rebuild one lost datagram of n\n\n" \
             " [-i | --input ].......: read frames from the specified input plugin (first input plugin between the arguments is the 0th)\n\n" \
-            " ---------------------------------------------------------------\n");
+            " ---------------------------------------------------------------\n", UDP_STREAM_FRAGMENT_SIZE);
 }
 
 /******************************************************************************
@@ -108,6 +134,317 @@ void worker_cleanup(void *arg)
     close(fd);
 }
 
+/******************************************************************************
+Description.: current time in seconds that does not jump with the wall clock
+Input Value.: -
+Return Value: seconds
+******************************************************************************/
+static time_t monotonic_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while(0)
+
+/******************************************************************************
+Description.: cookie of a client, SipHash-2-4 of its address and the time
+              window with the random key, nobody who does not receive what
+              is sent to the address can know it
+Input Value.: * addr..: address of the client
+              * window: UDP_STREAM_TIMEOUT long time window
+Return Value: the cookie
+******************************************************************************/
+static unsigned long long make_cookie(const struct sockaddr_in *addr, time_t window)
+{
+    unsigned long long v0 = cookie_key[0] ^ 0x736f6d6570736575ULL;
+    unsigned long long v1 = cookie_key[1] ^ 0x646f72616e646f6dULL;
+    unsigned long long v2 = cookie_key[0] ^ 0x6c7967656e657261ULL;
+    unsigned long long v3 = cookie_key[1] ^ 0x7465646279746573ULL;
+    unsigned long long m[3];
+    int i;
+
+    /* two words of message and the length byte of the last block */
+    m[0] = ((unsigned long long)ntohl(addr->sin_addr.s_addr) << 16) | ntohs(addr->sin_port);
+    m[1] = (unsigned long long)window;
+    m[2] = 16ULL << 56;
+
+    for(i = 0; i < 3; i++) {
+        v3 ^= m[i];
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m[i];
+    }
+
+    v2 ^= 0xff;
+    for(i = 0; i < 4; i++)
+        SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/******************************************************************************
+Description.: add, renew or remove the subscription of a client and answer
+              it. Only messages with the right cookie change a subscription,
+              the others get the cookie in a datagram that is shorter than
+              theirs, so spoofed requests gain an attacker nothing.
+Input Value.: * message: the message the client sent
+              * length.: its length
+              * addr...: address of the client
+Return Value: 1 if the message was about the subscription, 0 if not
+******************************************************************************/
+static int subscription(const char *message, int length, const struct sockaddr_in *addr)
+{
+    char reply[sizeof(UDP_STREAM_COOKIE) + UDP_STREAM_COOKIE_SIZE + 1];
+    unsigned long long cookie, current;
+    const char *arg;
+    time_t window;
+    int subscribe, i;
+
+    if(strncmp(message, UDP_STREAM_SUBSCRIBE, strlen(UDP_STREAM_SUBSCRIBE)) == 0) {
+        subscribe = 1;
+        arg = message + strlen(UDP_STREAM_SUBSCRIBE);
+    } else if(strncmp(message, UDP_STREAM_UNSUBSCRIBE, strlen(UDP_STREAM_UNSUBSCRIBE)) == 0) {
+        subscribe = 0;
+        arg = message + strlen(UDP_STREAM_UNSUBSCRIBE);
+    } else {
+        return 0;
+    }
+
+    /* file names that start with the keywords */
+    if(*arg != '\0' && *arg != ' ')
+        return 0;
+
+    /* a bare keyword is what clients without cookies send */
+    if(*arg != ' ' || strlen(arg + 1) != UDP_STREAM_COOKIE_SIZE ||
+       strspn(arg + 1, "0123456789abcdefABCDEF") != UDP_STREAM_COOKIE_SIZE) {
+        DBG("subscription without a cookie from %s:%d\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        return 1;
+    }
+
+    cookie = strtoull(arg + 1, NULL, 16);
+    window = monotonic_seconds() / UDP_STREAM_TIMEOUT;
+    current = make_cookie(addr, window);
+    snprintf(reply, sizeof(reply), UDP_STREAM_COOKIE " %016llx", current);
+
+    if(cookie != current && cookie != make_cookie(addr, window - 1)) {
+        if(subscribe)
+            sendto(sd, reply, strlen(reply), 0, (struct sockaddr*)addr, sizeof(*addr));
+        return 1;
+    }
+
+    pthread_mutex_lock(&subscribers_mutex);
+
+    for(i = 0; i < subscriber_count; i++) {
+        if(subscribers[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+           subscribers[i].addr.sin_port == addr->sin_port)
+            break;
+    }
+
+    if(!subscribe) {
+        /* the last one takes the place */
+        if(i < subscriber_count)
+            subscribers[i] = subscribers[--subscriber_count];
+    } else if(i < subscriber_count || subscriber_count < UDP_STREAM_MAX_SUBSCRIBERS) {
+        if(i == subscriber_count) {
+            DBG("new subscriber %s:%d\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+            subscriber_count++;
+        }
+        subscribers[i].addr = *addr;
+        subscribers[i].renewed = monotonic_seconds();
+    } else {
+        LOG("too many subscribers, ignoring %s:%d\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+    }
+
+    pthread_mutex_unlock(&subscribers_mutex);
+
+    /* the cookie of the last window is renewed once more, along with a new one */
+    if(subscribe && cookie != current)
+        sendto(sd, reply, strlen(reply), 0, (struct sockaddr*)addr, sizeof(*addr));
+    else
+        sendto(sd, message, length, 0, (struct sockaddr*)addr, sizeof(*addr));
+    return 1;
+}
+
+/******************************************************************************
+Description.: write a big endian number into a header
+Input Value.: * p....: first byte
+              * value: the number
+              * bytes: length of the number
+Return Value: -
+******************************************************************************/
+static void put_number(unsigned char *p, unsigned long long value, int bytes)
+{
+    while(bytes-- > 0) {
+        p[bytes] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+/******************************************************************************
+Description.: write the header of a stream datagram, see udp_stream.h
+Input Value.: * packet...: the datagram
+              * flags....: UDP_STREAM_FLAG_*
+              * id.......: frame id
+              * index....: index of the fragment or parity group
+              * count....: number of fragments of the frame
+              * offset...: offset of the data, the group size for parity
+              * size.....: size of the frame
+              * timestamp: capture time of the frame
+Return Value: -
+******************************************************************************/
+static void put_header(unsigned char *packet, int flags, unsigned int id, int index, int count,
+                       unsigned int offset, unsigned int size, struct timeval timestamp)
+{
+    packet[0] = UDP_STREAM_MAGIC0;
+    packet[1] = UDP_STREAM_MAGIC1;
+    packet[2] = UDP_STREAM_VERSION;
+    packet[3] = flags;
+    put_number(packet + 4, id, 4);
+    put_number(packet + 8, index, 2);
+    put_number(packet + 10, count, 2);
+    put_number(packet + 12, offset, 4);
+    put_number(packet + 16, size, 4);
+    put_number(packet + 20, (unsigned long long)timestamp.tv_sec * 1000000 + timestamp.tv_usec, 8);
+}
+
+/******************************************************************************
+Description.: build the parity datagrams of a frame, each one is the XOR of
+              the data of fec fragments, the short last one padded with zeros
+Input Value.: * packets: the fragments, the parity datagrams follow them
+              * count..: number of fragments
+              * groups.: number of parity datagrams
+              * size...: size of the frame
+Return Value: -
+******************************************************************************/
+static void build_parity(unsigned char *packets, int count, int groups, unsigned int size)
+{
+    unsigned int payload = fragment_size - UDP_STREAM_HEADER_SIZE, offset, chunk, j;
+    unsigned char *parity = packets + size + count * UDP_STREAM_HEADER_SIZE, *data, *p;
+    int i;
+
+    memset(parity, 0, groups * fragment_size);
+
+    for(i = 0, offset = 0, data = packets; i < count; i++, offset += chunk, data += UDP_STREAM_HEADER_SIZE + chunk) {
+        chunk = MIN(payload, size - offset);
+        p = parity + (i / fec) * fragment_size + UDP_STREAM_HEADER_SIZE;
+        for(j = 0; j < chunk; j++)
+            p[j] ^= data[UDP_STREAM_HEADER_SIZE + j];
+    }
+}
+
+/******************************************************************************
+Description.: the stream thread cuts every fresh frame into datagrams and
+              sends them to the subscribers. The datagrams are built back to
+              back while the frame is locked, so the frame is copied only
+              once, and go out with as few system calls as the kernel allows.
+Input Value.: unused
+Return Value: NULL
+******************************************************************************/
+void *stream_thread(void *arg)
+{
+    udp_subscriber targets[UDP_STREAM_MAX_SUBSCRIBERS];
+    unsigned char *packets = NULL, *tmp, *packet;
+    size_t packets_size = 0, length = 0;
+    struct timeval timestamp;
+    struct timespec deadline;
+    unsigned int frame_id = random(), size, offset, payload, chunk;
+    unsigned long sequence = 0;
+    int count, groups, targets_count, i, rc, fresh;
+    time_t now;
+
+    payload = fragment_size - UDP_STREAM_HEADER_SIZE;
+
+    while(!pglobal->stop) {
+        /* subscriptions that were not renewed end here */
+        now = monotonic_seconds();
+        pthread_mutex_lock(&subscribers_mutex);
+        for(i = 0; i < subscriber_count;) {
+            if(now - subscribers[i].renewed > UDP_STREAM_TIMEOUT) {
+                DBG("subscription of %s:%d expired\n", inet_ntoa(subscribers[i].addr.sin_addr), ntohs(subscribers[i].addr.sin_port));
+                subscribers[i] = subscribers[--subscriber_count];
+            } else {
+                i++;
+            }
+        }
+        targets_count = subscriber_count;
+        memcpy(targets, subscribers, targets_count * sizeof(udp_subscriber));
+        pthread_mutex_unlock(&subscribers_mutex);
+
+        /* wait for a fresh frame, but not forever so the stop signal is noticed */
+        pthread_mutex_lock(&pglobal->in[input_number].db);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
+        rc = 0;
+        while(pglobal->in[input_number].sequence == sequence && rc == 0)
+            rc = pthread_cond_timedwait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db, &deadline);
+
+        /* the input counts its frames, not all inputs set a timestamp */
+        fresh = pglobal->in[input_number].sequence != sequence;
+        sequence = pglobal->in[input_number].sequence;
+        timestamp = pglobal->in[input_number].timestamp;
+        if(!timerisset(&timestamp))
+            gettimeofday(&timestamp, NULL);
+        size = pglobal->in[input_number].size;
+        count = (size + payload - 1) / payload;
+        if(!fresh || targets_count == 0 || count == 0 || count > 0xFFFF) {
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            continue;
+        }
+
+        /* check if buffer for the datagrams is large enough, increase it if necessary */
+        length = size + count * UDP_STREAM_HEADER_SIZE;
+        groups = fec > 0 ? (count + fec - 1) / fec : 0;
+        if(length + groups * fragment_size > packets_size) {
+            DBG("increasing buffer size to %d\n", (int)(length + groups * fragment_size));
+            if((tmp = realloc(packets, length + groups * fragment_size + (1 << 16))) == NULL) {
+                pthread_mutex_unlock(&pglobal->in[input_number].db);
+                LOG("not enough memory\n");
+                continue;
+            }
+            packets = tmp;
+            packets_size = length + groups * fragment_size + (1 << 16);
+        }
+
+        frame_id++;
+        for(i = 0, offset = 0, packet = packets; i < count; i++, offset += chunk, packet += UDP_STREAM_HEADER_SIZE + chunk) {
+            chunk = MIN(payload, size - offset);
+            put_header(packet, 0, frame_id, i, count, offset, size, timestamp);
+            memcpy(packet + UDP_STREAM_HEADER_SIZE, pglobal->in[input_number].buf + offset, chunk);
+        }
+
+        /* allow others to access the global buffer again */
+        pthread_mutex_unlock(&pglobal->in[input_number].db);
+
+        if(groups > 0) {
+            build_parity(packets, count, groups, size);
+            for(i = 0; i < groups; i++)
+                put_header(packets + length + i * fragment_size, UDP_STREAM_FLAG_PARITY, frame_id, i, count, fec, size, timestamp);
+        }
+
+        /* the short last fragment ends a batch, so the parity datagrams are a second one */
+        for(i = 0; i < targets_count; i++) {
+            if(udp_send_batch(sd, (struct sockaddr *)&targets[i].addr, sizeof(targets[i].addr),
+                              packets, length, fragment_size, &stream_method) != 0 ||
+               udp_send_batch(sd, (struct sockaddr *)&targets[i].addr, sizeof(targets[i].addr),
+                              packets + length, groups * fragment_size, fragment_size, &stream_method) != 0) {
+                DBG("sending to %s:%d failed: %s\n", inet_ntoa(targets[i].addr.sin_addr), ntohs(targets[i].addr.sin_port), strerror(errno));
+            }
+        }
+    }
+
+    free(packets);
+    return NULL;
+}
+
 /******************************************************************************
 Description.: this is the main worker thread
               it loops forever, grabs a fresh frame and stores it to file
@@ -123,23 +460,15 @@ void *worker_thread(void *arg)
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
-    // set UDP server data structures ---------------------------
-    if(port <= 0) {
+    // the UDP socket is opened by output_init() ----------------
+    if(sd < 0) {
         OPRINT("a valid UDP port must be provided\n");
         return NULL;
     }
     struct sockaddr_in addr;
-    int sd;
     int bytes;
     unsigned int addr_len = sizeof(addr);
     char udpbuffer[1024] = {0};
-    sd = socket(PF_INET, SOCK_DGRAM, 0);
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
-    if(bind(sd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
-        perror("bind");
     // -----------------------------------------------------------
 
     while(ok >= 0 && !pglobal->stop) {
@@ -147,9 +476,12 @@ void *worker_thread(void *arg)
 
         // UDP receive ---------------------------------------------
         memset(udpbuffer, 0, sizeof(udpbuffer));
-        bytes = recvfrom(sd, udpbuffer, sizeof(udpbuffer), 0, (struct sockaddr*)&addr, &addr_len);
+        bytes = recvfrom(sd, udpbuffer, sizeof(udpbuffer) - 1, 0, (struct sockaddr*)&addr, &addr_len);
         // ---------------------------------------------------------
 
+        /* subscriptions to the stream need no frame, they are answered by subscription() */
+        if(stream && bytes > 0 && subscription(udpbuffer, bytes, &addr))
+            continue;
 
 
         DBG("waiting for fresh frame\n");
@@ -275,6 +607,11 @@ int output_init(output_parameter *param)
             {"port", required_argument, 0, 0},
             {"i", required_argument, 0, 0},
             {"input", required_argument, 0, 0},
+            {"s", no_argument, 0, 0},
+            {"stream", no_argument, 0, 0},
+            {"fs", required_argument, 0, 0},
+            {"fragment_size", required_argument, 0, 0},
+            {"fec", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -333,6 +670,23 @@ int output_init(output_parameter *param)
             DBG("case 10,11\n");
             input_number = atoi(optarg);
             break;
+            /* s, stream */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            stream = 1;
+            break;
+            /* fs, fragment_size */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            fragment_size = MIN(MAX(atoi(optarg), UDP_STREAM_HEADER_SIZE + 64), UDP_BATCH_MAX_LENGTH);
+            break;
+            /* fec */
+        case 16:
+            DBG("case 16\n");
+            fec = MAX(atoi(optarg), 0);
+            break;
         }
     }
 
@@ -350,11 +704,44 @@ int output_init(output_parameter *param)
     } else {
         OPRINT("UDP port..........: %s\n", "disabled");
     }
+
+    if(port > 0) {
+        struct sockaddr_in addr;
+
+        sd = socket(PF_INET, SOCK_DGRAM, 0);
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+        if(bind(sd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+            perror("bind");
+    }
+
+    if(stream) {
+        if(sd < 0) {
+            OPRINT("ERROR: the stream needs a UDP port\n");
+            return 1;
+        }
+        if((i = open("/dev/urandom", O_RDONLY)) < 0 ||
+           read(i, cookie_key, sizeof(cookie_key)) != sizeof(cookie_key)) {
+            OPRINT("ERROR: could not read /dev/urandom for the subscription cookies\n");
+            if(i >= 0)
+                close(i);
+            return 1;
+        }
+        close(i);
+        stream_method = udp_batch_probe(sd);
+        OPRINT("stream............: %d byte datagrams with %s\n", fragment_size, udp_batch_name(stream_method));
+        if(fec > 0) {
+            OPRINT("parity............: 1 datagram per %d, %d%% overhead\n", fec, (100 + fec - 1) / fec);
+        }
+    }
     return 0;
 }
 
 /******************************************************************************
-Description.: calling this function stops the worker thread
+Description.: calling this function stops the worker thread and waits for
+              the stream thread
 Input Value.: -
 Return Value: always 0
 ******************************************************************************/
@@ -362,11 +749,14 @@ int output_stop(int id)
 {
     DBG("will cancel worker thread\n");
     pthread_cancel(worker);
+    if(stream)
+        pthread_join(streamer, NULL);
     return 0;
 }
 
 /******************************************************************************
 Description.: calling this function creates and starts the worker thread
+              and the stream thread
 Input Value.: -
 Return Value: always 0
 ******************************************************************************/
@@ -375,6 +765,11 @@ int output_run(int id)
     DBG("launching worker thread\n");
     pthread_create(&worker, 0, worker_thread, NULL);
     pthread_detach(worker);
+
+    if(stream) {
+        DBG("launching stream thread\n");
+        pthread_create(&streamer, 0, stream_thread, NULL);
+    }
     return 0;
 }
 
@@ -0,0 +1,129 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Subscribes to the stream of output_udp with udp_receiver.c and prints
+  once per second how many frames arrived, how many of them were rebuilt
+  from parity datagrams, how many were dropped and how old they were on
+  arrival (the clocks of both hosts need to be in sync).
+
+  Build it with the cmake option ENABLE_UDP_CLIENT.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+
+#include "udp_receiver.h"
+
+/******************************************************************************
+Description.: print a help message
+Input Value.: name of the program
+Return Value: -
+******************************************************************************/
+static void help(const char *program)
+{
+    fprintf(stderr, "usage: %s [-n frames] [-o file] host port\n" \
+            " -n: stop after this many frames (default: never)\n" \
+            " -o: write the last frame to this file\n", program);
+}
+
+/******************************************************************************
+Description.: receive frames and print statistics
+Input Value.: see help()
+Return Value: 0 on success, 1 in case of error
+******************************************************************************/
+int main(int argc, char *argv[])
+{
+    const unsigned char *data = NULL;
+    unsigned int size = 0;
+    long long timestamp, age = 0, max_age = 0;
+    unsigned long frames = 0, limit = 0, reported_frames = 0, reported_recovered = 0, reported_dropped = 0;
+    struct timeval now, report;
+    char *file = NULL;
+    udp_receiver *r;
+    FILE *out;
+    int c, rc;
+
+    while((c = getopt(argc, argv, "n:o:h")) != -1) {
+        switch(c) {
+        case 'n':
+            limit = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            file = optarg;
+            break;
+        default:
+            help(argv[0]);
+            return 1;
+        }
+    }
+
+    if(argc - optind != 2) {
+        help(argv[0]);
+        return 1;
+    }
+
+    if((r = udp_receiver_open(argv[optind], atoi(argv[optind + 1]))) == NULL) {
+        perror("udp_receiver_open");
+        return 1;
+    }
+
+    gettimeofday(&report, NULL);
+    while(limit == 0 || frames < limit) {
+        if((rc = udp_receiver_next(r, 1000, &data, &size, &timestamp)) < 0) {
+            perror("udp_receiver_next");
+            break;
+        }
+
+        gettimeofday(&now, NULL);
+        if(rc > 0) {
+            frames++;
+            age += (long long)now.tv_sec * 1000000 + now.tv_usec - timestamp;
+            if((long long)now.tv_sec * 1000000 + now.tv_usec - timestamp > max_age)
+                max_age = (long long)now.tv_sec * 1000000 + now.tv_usec - timestamp;
+        }
+
+        if(now.tv_sec > report.tv_sec || (limit != 0 && frames == limit)) {
+            printf("%lu frames, %lu recovered, %lu dropped, age %.2f ms (max %.2f ms)\n",
+                   r->frames - reported_frames, r->recovered - reported_recovered, r->dropped - reported_dropped,
+                   r->frames > reported_frames ? age / 1000.0 / (r->frames - reported_frames) : 0.0, max_age / 1000.0);
+            reported_frames = r->frames;
+            reported_recovered = r->recovered;
+            reported_dropped = r->dropped;
+            age = max_age = 0;
+            report = now;
+        }
+    }
+
+    if(file != NULL && data != NULL) {
+        if((out = fopen(file, "wb")) == NULL || fwrite(data, 1, size, out) != size)
+            perror(file);
+        if(out != NULL)
+            fclose(out);
+    }
+
+    udp_receiver_close(r);
+    return 0;
+}
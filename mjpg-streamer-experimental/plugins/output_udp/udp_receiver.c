@@ -0,0 +1,394 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Reference receiver for the stream of output_udp, see udp_stream.h for the
+  format. It reassembles one frame at a time: as soon as a fragment of a
+  newer frame arrives, an incomplete frame is dropped, and fragments of
+  older frames are ignored. A lost datagram costs one frame, it never
+  delays the next one, unless the parity datagrams of the frame can
+  rebuild it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "udp_receiver.h"
+
+/******************************************************************************
+Description.: read a big endian number from a header
+Input Value.: * p....: first byte
+              * bytes: length of the number
+Return Value: the number
+******************************************************************************/
+static unsigned long long get_number(const unsigned char *p, int bytes)
+{
+    unsigned long long value = 0;
+
+    while(bytes-- > 0)
+        value = (value << 8) | *p++;
+
+    return value;
+}
+
+/******************************************************************************
+Description.: send a subscription message with the cookie
+Input Value.: * r......: the receiver
+              * keyword: UDP_STREAM_SUBSCRIBE or UDP_STREAM_UNSUBSCRIBE
+Return Value: 0 on success, -1 in case of error
+******************************************************************************/
+static int send_message(udp_receiver *r, const char *keyword)
+{
+    char message[32];
+
+    snprintf(message, sizeof(message), "%s %s", keyword, r->cookie);
+    if(sendto(r->sd, message, strlen(message), 0,
+              (struct sockaddr *)&r->server, sizeof(r->server)) < 0)
+        return -1;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: (re)new the subscription
+Input Value.: the receiver
+Return Value: 0 on success, -1 in case of error
+******************************************************************************/
+static int subscribe(udp_receiver *r)
+{
+    r->subscribed = time(NULL);
+    return send_message(r, UDP_STREAM_SUBSCRIBE);
+}
+
+/******************************************************************************
+Description.: take the cookie the server sent and subscribe with it
+Input Value.: * r......: the receiver
+              * packet.: the datagram
+              * length.: its size
+Return Value: 1 if it was a cookie, 0 if not, -1 in case of error
+******************************************************************************/
+static int take_cookie(udp_receiver *r, const unsigned char *packet, int length)
+{
+    int prefix = strlen(UDP_STREAM_COOKIE " ");
+
+    if(length != prefix + UDP_STREAM_COOKIE_SIZE || memcmp(packet, UDP_STREAM_COOKIE " ", prefix) != 0)
+        return 0;
+
+    memcpy(r->cookie, packet + prefix, UDP_STREAM_COOKIE_SIZE);
+    r->cookie[UDP_STREAM_COOKIE_SIZE] = '\0';
+    return subscribe(r) == 0 ? 1 : -1;
+}
+
+/******************************************************************************
+Description.: subscribe to the stream of an output_udp plugin
+Input Value.: * host.: name or address of the host that runs mjpg-streamer
+              * port.: UDP port of the plugin
+Return Value: the receiver, NULL in case of error
+******************************************************************************/
+udp_receiver *udp_receiver_open(const char *host, int port)
+{
+    struct addrinfo hints, *result;
+    udp_receiver *r;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if(getaddrinfo(host, NULL, &hints, &result) != 0)
+        return NULL;
+
+    if((r = calloc(1, sizeof(udp_receiver))) == NULL) {
+        freeaddrinfo(result);
+        return NULL;
+    }
+
+    memcpy(&r->server, result->ai_addr, sizeof(r->server));
+    r->server.sin_port = htons(port);
+    freeaddrinfo(result);
+
+    /* the server answers this one with the cookie */
+    memset(r->cookie, '0', UDP_STREAM_COOKIE_SIZE);
+
+    if((r->fragments = malloc(1 << 16)) == NULL ||
+       (r->parities = malloc(1 << 16)) == NULL ||
+       (r->sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+       subscribe(r) != 0) {
+        free(r->fragments);
+        free(r->parities);
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+/******************************************************************************
+Description.: rebuild the fragment of a parity group if it is the only one
+              missing
+Input Value.: * r....: the receiver
+              * group: index of the group
+Return Value: -
+******************************************************************************/
+static void recover(udp_receiver *r, unsigned int group)
+{
+    unsigned int first, last, missing, i, j, length;
+    unsigned char *data, *parity;
+
+    if(r->group_size == 0 || !r->parities[group])
+        return;
+
+    first = group * r->group_size;
+    last = first + r->group_size < r->count ? first + r->group_size : r->count;
+    for(missing = last, i = first; i < last; i++) {
+        if(r->fragments[i])
+            continue;
+        if(missing != last)
+            return;
+        missing = i;
+    }
+    if(missing == last)
+        return;
+
+    /* the parity XOR the other fragments of the group is the missing one */
+    data = r->frame + missing * r->payload;
+    parity = r->parity + group * r->payload;
+    length = r->frame_size - missing * r->payload < r->payload ? r->frame_size - missing * r->payload : r->payload;
+    memcpy(data, parity, length);
+    for(i = first; i < last; i++) {
+        if(i == missing)
+            continue;
+        for(j = 0; j < length && i * r->payload + j < r->frame_size; j++)
+            data[j] ^= r->frame[i * r->payload + j];
+    }
+
+    r->fragments[missing] = 1;
+    r->received++;
+    r->recovering = 1;
+}
+
+/******************************************************************************
+Description.: start to reassemble a new frame
+Input Value.: * r......: the receiver
+              * id.....: frame id
+              * count..: number of fragments
+              * size...: size of the frame
+              * packet.: the first datagram that arrived
+Return Value: 0 on success, -1 if the frame can not be received
+******************************************************************************/
+static int start_frame(udp_receiver *r, unsigned int id, unsigned short count, unsigned int size, const unsigned char *packet)
+{
+    unsigned char *tmp;
+
+    if(r->started && !r->complete)
+        r->dropped++;
+
+    r->started = 1;
+    r->complete = 0;
+    r->recovering = 0;
+    r->frame_id = id;
+    r->frame_size = size;
+    r->count = count;
+    r->received = 0;
+    r->group_size = 0;
+    r->timestamp = get_number(packet + 20, 8);
+    memset(r->fragments, 0, count);
+    memset(r->parities, 0, count);
+
+    if(size > UDP_RECEIVER_MAX_FRAME) {
+        r->complete = 1;
+        r->dropped++;
+        return -1;
+    }
+    if(size > r->frame_capacity) {
+        if((tmp = realloc(r->frame, size)) == NULL) {
+            r->complete = 1;
+            r->dropped++;
+            return -1;
+        }
+        r->frame = tmp;
+        r->frame_capacity = size;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: add a fragment or parity datagram to the frame being reassembled
+Input Value.: * r......: the receiver
+              * packet.: the datagram
+              * length.: its size
+Return Value: 1 if the frame is complete now, 0 if not
+******************************************************************************/
+static int add_fragment(udp_receiver *r, const unsigned char *packet, int length)
+{
+    unsigned int id, offset, size, group;
+    unsigned short index, count;
+    unsigned char *tmp;
+
+    if(length < UDP_STREAM_HEADER_SIZE ||
+       packet[0] != UDP_STREAM_MAGIC0 || packet[1] != UDP_STREAM_MAGIC1 || packet[2] != UDP_STREAM_VERSION)
+        return 0;
+
+    id = get_number(packet + 4, 4);
+    index = get_number(packet + 8, 2);
+    count = get_number(packet + 10, 2);
+    offset = get_number(packet + 12, 4);
+    size = get_number(packet + 16, 4);
+    length -= UDP_STREAM_HEADER_SIZE;
+
+    /* a newer frame, the current one is given up if it is not complete */
+    if((!r->started || (int)(id - r->frame_id) > 0) && start_frame(r, id, count, size, packet) != 0)
+        return 0;
+
+    /* late datagrams of older frames, duplicates and garbage */
+    if(id != r->frame_id || r->complete || count != r->count || size != r->frame_size)
+        return 0;
+
+    if(packet[3] & UDP_STREAM_FLAG_PARITY) {
+        /* the group size and the data of the full fragments are the same for all of them */
+        if(offset == 0 || index >= (count + offset - 1) / offset || length == 0 || r->parities[index] ||
+           (r->group_size != 0 && (offset != r->group_size || (unsigned int)length != r->payload)))
+            return 0;
+
+        if((unsigned long long)(index + 1) * length > r->parity_capacity) {
+            if((tmp = realloc(r->parity, (unsigned long long)((count + offset - 1) / offset) * length)) == NULL)
+                return 0;
+            r->parity = tmp;
+            r->parity_capacity = ((count + offset - 1) / offset) * length;
+        }
+
+        r->group_size = offset;
+        r->payload = length;
+        memcpy(r->parity + index * length, packet + UDP_STREAM_HEADER_SIZE, length);
+        r->parities[index] = 1;
+        group = index;
+    } else {
+        if(index >= count || offset > size || (unsigned int)length > size - offset || r->fragments[index])
+            return 0;
+
+        memcpy(r->frame + offset, packet + UDP_STREAM_HEADER_SIZE, length);
+        r->fragments[index] = 1;
+        r->received++;
+        group = r->group_size != 0 ? index / r->group_size : 0;
+    }
+
+    if(r->received < r->count)
+        recover(r, group);
+    if(r->received < r->count)
+        return 0;
+
+    r->complete = 1;
+    r->frames++;
+    if(r->recovering)
+        r->recovered++;
+    return 1;
+}
+
+/******************************************************************************
+Description.: wait for the next complete frame, the subscription is renewed
+              on the way
+Input Value.: * r........: the receiver
+              * timeout..: milliseconds to wait at most, -1 waits forever
+              * data.....: gets the frame, it is valid until the next call
+              * size.....: gets the size of the frame
+              * timestamp: gets the capture time in microseconds since the
+                           epoch, may be NULL
+Return Value: 1 if there is a frame, 0 on timeout, -1 in case of error
+******************************************************************************/
+int udp_receiver_next(udp_receiver *r, int timeout, const unsigned char **data, unsigned int *size, long long *timestamp)
+{
+    unsigned char packet[UDP_STREAM_HEADER_SIZE + 65536];
+    struct timespec start, now;
+    struct pollfd pfd;
+    int wait, left, rc;
+    ssize_t length;
+
+    pfd.fd = r->sd;
+    pfd.events = POLLIN;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while(1) {
+        if(time(NULL) - r->subscribed >= UDP_STREAM_TIMEOUT / 2 && subscribe(r) != 0)
+            return -1;
+
+        /* wake up for the renewal at the latest */
+        wait = UDP_STREAM_TIMEOUT / 2 * 1000;
+        if(timeout >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = timeout - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+            if(left <= 0)
+                return 0;
+            if(left < wait)
+                wait = left;
+        }
+
+        if((rc = poll(&pfd, 1, wait)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(rc == 0)
+            continue;
+
+        if((length = recv(r->sd, packet, sizeof(packet), 0)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if((rc = take_cookie(r, packet, length)) != 0) {
+            if(rc < 0)
+                return -1;
+            continue;
+        }
+
+        if(add_fragment(r, packet, length)) {
+            *data = r->frame;
+            *size = r->frame_size;
+            if(timestamp != NULL)
+                *timestamp = r->timestamp;
+            return 1;
+        }
+    }
+}
+
+/******************************************************************************
+Description.: end the subscription and free the receiver
+Input Value.: the receiver
+Return Value: -
+******************************************************************************/
+void udp_receiver_close(udp_receiver *r)
+{
+    send_message(r, UDP_STREAM_UNSUBSCRIBE);
+    close(r->sd);
+    free(r->frame);
+    free(r->fragments);
+    free(r->parities);
+    free(r->parity);
+    free(r);
+}
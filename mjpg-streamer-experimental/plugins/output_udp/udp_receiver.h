@@ -0,0 +1,68 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef UDP_RECEIVER_H
+#define UDP_RECEIVER_H
+
+#include <netinet/in.h>
+#include <time.h>
+
+#include "udp_stream.h"
+
+/* frames larger than this are not reassembled */
+#define UDP_RECEIVER_MAX_FRAME (16 * 1024 * 1024)
+
+/* subscription to the stream of an output_udp plugin */
+typedef struct {
+    int sd;
+    struct sockaddr_in server;
+    time_t subscribed;          /* when the last subscription was sent */
+    char cookie[UDP_STREAM_COOKIE_SIZE + 1]; /* last cookie of the server */
+
+    int started;                /* a fragment was received */
+    int complete;               /* the current frame is complete */
+    unsigned int frame_id;      /* frame being reassembled */
+    unsigned int frame_size;
+    unsigned short count;       /* number of fragments */
+    unsigned short received;    /* number of fragments received */
+    long long timestamp;
+    unsigned char *frame;
+    unsigned int frame_capacity;
+    unsigned char *fragments;   /* one flag per fragment that arrived */
+
+    int recovering;             /* a fragment of the frame was rebuilt */
+    unsigned int group_size;    /* fragments per parity datagram, 0 without */
+    unsigned int payload;       /* data per full fragment */
+    unsigned char *parity;      /* data of the parity datagrams */
+    unsigned int parity_capacity;
+    unsigned char *parities;    /* one flag per parity datagram that arrived */
+
+    unsigned long frames;       /* complete frames */
+    unsigned long recovered;    /* complete frames with rebuilt fragments */
+    unsigned long dropped;      /* frames with missing fragments */
+} udp_receiver;
+
+udp_receiver *udp_receiver_open(const char *host, int port);
+int udp_receiver_next(udp_receiver *r, int timeout, const unsigned char **data, unsigned int *size, long long *timestamp);
+void udp_receiver_close(udp_receiver *r);
+
+#endif
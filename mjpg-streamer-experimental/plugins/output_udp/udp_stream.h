@@ -0,0 +1,90 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef UDP_STREAM_H
+#define UDP_STREAM_H
+
+/*
+ * Wire format of the frames output_udp streams to its subscribers. Every
+ * frame is cut into fragments, each fragment is one datagram that starts
+ * with this header, all numbers in network byte order:
+ *
+ *   offset  size  field
+ *        0     2  magic "MJ"
+ *        2     1  version, UDP_STREAM_VERSION
+ *        3     1  flags, UDP_STREAM_FLAG_*
+ *        4     4  frame id, counts up with every frame
+ *        8     2  index of the fragment
+ *       10     2  number of fragments of the frame
+ *       12     4  offset of the fragment data in the frame
+ *       16     4  size of the frame
+ *       20     8  capture time in microseconds since the epoch
+ *
+ * With forward error correction a parity datagram follows the fragments
+ * for every group of n of them. It has UDP_STREAM_FLAG_PARITY set, the
+ * index of the group instead of the fragment, n instead of the offset,
+ * and its data is the XOR of the data of the fragments of the group, the
+ * short last fragment padded with zeros. The data of the parity datagrams
+ * is as long as that of the full fragments. One lost fragment per group
+ * can be rebuilt from the others and the parity.
+ *
+ * Only addresses that proved they receive what is sent to them get the
+ * stream, a spoofed source address must not turn the plugin into a
+ * reflector. Subscriptions carry a cookie of UDP_STREAM_COOKIE_SIZE hex
+ * digits, the client starts with zeros:
+ *
+ *   client: "SUBSCRIBE 0000000000000000"
+ *   server: "COOKIE 5f1c0a93d2e4b871"      only to that address and port
+ *   client: "SUBSCRIBE 5f1c0a93d2e4b871"
+ *   server: "SUBSCRIBE 5f1c0a93d2e4b871"   echo, the frames follow
+ *
+ * A subscription has to be repeated within UDP_STREAM_TIMEOUT seconds to
+ * keep receiving frames. A cookie is valid for one to two timeouts, once
+ * it gets old or is wrong the server answers with COOKIE again and the
+ * client has to send the new one. "UNSUBSCRIBE <cookie>" ends it at once.
+ * The answers are never longer than the messages they answer.
+ */
+
+#define UDP_STREAM_MAGIC0 'M'
+#define UDP_STREAM_MAGIC1 'J'
+#define UDP_STREAM_VERSION 1
+#define UDP_STREAM_HEADER_SIZE 28
+
+#define UDP_STREAM_FLAG_PARITY 0x01
+
+#define UDP_STREAM_SUBSCRIBE "SUBSCRIBE"
+#define UDP_STREAM_UNSUBSCRIBE "UNSUBSCRIBE"
+#define UDP_STREAM_COOKIE "COOKIE"
+
+/* hex digits of a cookie */
+#define UDP_STREAM_COOKIE_SIZE 16
+
+/* seconds a subscription lasts without renewal */
+#define UDP_STREAM_TIMEOUT 10
+
+/* default size of the datagrams, header included, fits an Ethernet MTU */
+#define UDP_STREAM_FRAGMENT_SIZE 1400
+
+/* at most this many clients get the stream */
+#define UDP_STREAM_MAX_SUBSCRIBERS 16
+
+#endif
@@ -0,0 +1,265 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Sends a run of datagrams with as few system calls as the kernel allows.
+  The datagrams lie back to back in one buffer and all of them have the
+  same size, only the last one may be shorter. That is what UDP generic
+  segmentation offload (Linux 4.18) needs: one send of up to 64 datagrams,
+  the kernel or the network card cuts it. Kernels or devices without it get
+  sendmmsg(), and one sendto() per datagram is the last resort.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "udp_batch.h"
+
+/* older C libraries do not know the option, the kernel decides anyway */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+/******************************************************************************
+Description.: find the best method the kernel offers for a socket
+Input Value.: the UDP socket
+Return Value: the method
+******************************************************************************/
+udp_batch_method udp_batch_probe(int sd)
+{
+    int size = 0;
+
+    /* a kernel that knows UDP_SEGMENT accepts it as socket option */
+    if(setsockopt(sd, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0)
+        return UDP_BATCH_GSO;
+
+    if(sendmmsg(sd, NULL, 0, 0) == 0 || errno != ENOSYS)
+        return UDP_BATCH_MMSG;
+
+    return UDP_BATCH_SINGLE;
+}
+
+/******************************************************************************
+Description.: name of a method for messages
+Input Value.: the method
+Return Value: the name
+******************************************************************************/
+const char *udp_batch_name(udp_batch_method method)
+{
+    switch(method) {
+    case UDP_BATCH_GSO:
+        return "UDP_SEGMENT";
+    case UDP_BATCH_MMSG:
+        return "sendmmsg";
+    default:
+        return "sendto";
+    }
+}
+
+/******************************************************************************
+Description.: send up to UDP_BATCH_MAX datagrams as one buffer that the kernel
+              segments
+Input Value.: see udp_send_batch()
+Return Value: bytes sent, -1 in case of error
+******************************************************************************/
+static ssize_t send_gso(int sd, const struct sockaddr *to, socklen_t to_length,
+                        const unsigned char *data, size_t length, int datagram_size)
+{
+    char control[CMSG_SPACE(sizeof(unsigned short))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    unsigned short segment = datagram_size;
+
+    length = MIN(length, (size_t)MIN(UDP_BATCH_MAX, UDP_BATCH_MAX_LENGTH / datagram_size) * datagram_size);
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = length;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)to;
+    msg.msg_namelen = to_length;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    /* a single datagram needs no segmentation */
+    if(length > (size_t)datagram_size) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+        memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+    }
+
+    if(sendmsg(sd, &msg, 0) < 0)
+        return -1;
+
+    return length;
+}
+
+/******************************************************************************
+Description.: send up to UDP_BATCH_MAX datagrams with one sendmmsg()
+Input Value.: see udp_send_batch()
+Return Value: bytes sent, -1 in case of error
+******************************************************************************/
+static ssize_t send_mmsg(int sd, const struct sockaddr *to, socklen_t to_length,
+                         const unsigned char *data, size_t length, int datagram_size)
+{
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iov[UDP_BATCH_MAX];
+    size_t offset = 0;
+    int count, sent, i;
+
+    for(count = 0; count < UDP_BATCH_MAX && offset < length; count++) {
+        iov[count].iov_base = (void *)(data + offset);
+        iov[count].iov_len = MIN((size_t)datagram_size, length - offset);
+        offset += iov[count].iov_len;
+
+        memset(&msgs[count], 0, sizeof(msgs[count]));
+        msgs[count].msg_hdr.msg_name = (void *)to;
+        msgs[count].msg_hdr.msg_namelen = to_length;
+        msgs[count].msg_hdr.msg_iov = &iov[count];
+        msgs[count].msg_hdr.msg_iovlen = 1;
+    }
+
+    if((sent = sendmmsg(sd, msgs, count, 0)) <= 0)
+        return -1;
+
+    for(offset = 0, i = 0; i < sent; i++)
+        offset += iov[i].iov_len;
+
+    return offset;
+}
+
+/******************************************************************************
+Description.: send datagrams that lie back to back in a buffer. If the kernel
+              or the outgoing device refuses a method, the next one is tried
+              and remembered for the following calls.
+Input Value.: * sd...........: the UDP socket
+              * to...........: the receiver
+              * to_length....: size of the address
+              * data.........: the datagrams
+              * length.......: length of all datagrams together
+              * datagram_size: size of each datagram, the last may be shorter
+              * method.......: the method to use, it is downgraded if needed
+Return Value: 0 if everything was sent, -1 in case of error
+******************************************************************************/
+int udp_send_batch(int sd, const struct sockaddr *to, socklen_t to_length,
+                   const unsigned char *data, size_t length, int datagram_size,
+                   udp_batch_method *method)
+{
+    size_t offset = 0;
+    ssize_t rc;
+
+    while(offset < length) {
+        switch(*method) {
+        case UDP_BATCH_GSO:
+            rc = send_gso(sd, to, to_length, data + offset, length - offset, datagram_size);
+            break;
+        case UDP_BATCH_MMSG:
+            rc = send_mmsg(sd, to, to_length, data + offset, length - offset, datagram_size);
+            break;
+        default:
+            rc = sendto(sd, data + offset, MIN((size_t)datagram_size, length - offset), 0, to, to_length);
+            break;
+        }
+
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+
+            /*
+             * devices without checksum offload answer EIO to UDP_SEGMENT,
+             * segments larger than the MTU get EMSGSIZE as the kernel
+             * would have to fragment them
+             */
+            if(*method == UDP_BATCH_GSO && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP || errno == EMSGSIZE)) {
+                *method = UDP_BATCH_MMSG;
+                continue;
+            }
+            if(*method == UDP_BATCH_MMSG && errno == ENOSYS) {
+                *method = UDP_BATCH_SINGLE;
+                continue;
+            }
+            return -1;
+        }
+
+        offset += rc;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: send datagrams like udp_send_batch(), but spread over a time
+              window instead of in one burst. The datagrams go out in slots
+              of equal size at least UDP_PACE_MIN_GAP apart, so switches and
+              receivers with small buffers do not drop the tail of a frame.
+Input Value.: see udp_send_batch()
+              * window.......: microseconds to spread the datagrams over,
+                               0 sends them at once
+Return Value: 0 if everything was sent, -1 in case of error
+******************************************************************************/
+int udp_send_paced(int sd, const struct sockaddr *to, socklen_t to_length,
+                   const unsigned char *data, size_t length, int datagram_size,
+                   udp_batch_method *method, long long window)
+{
+    struct timespec next;
+    size_t count, slots, slot_size, offset;
+    long long gap;
+
+    count = (length + datagram_size - 1) / datagram_size;
+    slots = window > 0 ? MIN(count, (size_t)(window / UDP_PACE_MIN_GAP)) : 0;
+    if(slots <= 1)
+        return udp_send_batch(sd, to, to_length, data, length, datagram_size, method);
+
+    slot_size = (count + slots - 1) / slots * datagram_size;
+    gap = window / slots;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for(offset = 0; offset < length; offset += slot_size) {
+        if(offset > 0) {
+            next.tv_nsec += gap * 1000;
+            next.tv_sec += next.tv_nsec / (1000 * 1000 * 1000);
+            next.tv_nsec %= 1000 * 1000 * 1000;
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+        }
+
+        if(udp_send_batch(sd, to, to_length, data + offset, MIN(slot_size, length - offset), datagram_size, method) != 0)
+            return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef UDP_BATCH_H
+#define UDP_BATCH_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+/* datagrams handed to the kernel with one sendmmsg() or UDP_SEGMENT send */
+#define UDP_BATCH_MAX 64
+
+/* largest UDP payload of a single send over IPv4 */
+#define UDP_BATCH_MAX_LENGTH 65507
+
+/* paced sending leaves at least this many microseconds between two sends */
+#define UDP_PACE_MIN_GAP 250
+
+/* how udp_send_batch() passes the datagrams to the kernel, best first */
+typedef enum {
+    UDP_BATCH_SINGLE,   /* one sendto() per datagram */
+    UDP_BATCH_MMSG,     /* sendmmsg() with up to UDP_BATCH_MAX datagrams */
+    UDP_BATCH_GSO       /* UDP_SEGMENT, the kernel splits one buffer into datagrams */
+} udp_batch_method;
+
+udp_batch_method udp_batch_probe(int sd);
+const char *udp_batch_name(udp_batch_method method);
+int udp_send_batch(int sd, const struct sockaddr *to, socklen_t to_length,
+                   const unsigned char *data, size_t length, int datagram_size,
+                   udp_batch_method *method);
+int udp_send_paced(int sd, const struct sockaddr *to, socklen_t to_length,
+                   const unsigned char *data, size_t length, int datagram_size,
+                   udp_batch_method *method, long long window);
+
+#endif